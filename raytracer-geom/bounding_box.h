@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector.h>
+#include <triangle.h>
+#include <sphere.h>
+#include <ray.h>
+
+#include <cfloat>
+#include <algorithm>
+#include <limits>
+
+// Relative widening of slab exits, so that rounding never drops a hit on a flat box. Geometry in
+// single precision rounds more coarsely and needs more of it.
+constexpr double kSlabSlack = sizeof(Scalar) < sizeof(double) ? 1e-6 : 1e-9;
+
+class BoundingBox {
+public:
+    BoundingBox()
+        : min_(std::array<Scalar, 3>{kMax, kMax, kMax}),
+          max_(std::array<Scalar, 3>{-kMax, -kMax, -kMax}) {
+    }
+    BoundingBox(Vector min, Vector max) : min_(min), max_(max) {
+    }
+
+    void Extend(const Vector& point) {
+        for (int i = 0; i < 3; ++i) {
+            min_[i] = std::min(min_[i], point[i]);
+            max_[i] = std::max(max_[i], point[i]);
+        }
+    }
+    void Extend(const BoundingBox& other) {
+        if (other.IsEmpty()) {
+            return;
+        }
+        Extend(other.min_);
+        Extend(other.max_);
+    }
+
+    const Vector& GetMin() const {
+        return min_;
+    }
+    const Vector& GetMax() const {
+        return max_;
+    }
+    Vector GetCenter() const {
+        return (min_ + max_) * 0.5;
+    }
+    bool IsEmpty() const {
+        return min_[0] > max_[0] || min_[1] > max_[1] || min_[2] > max_[2];
+    }
+    bool operator==(const BoundingBox& other) const {
+        for (int i = 0; i < 3; ++i) {
+            if (min_[i] != other.min_[i] || max_[i] != other.max_[i]) {
+                return false;
+            }
+        }
+        return true;
+    }
+    double SurfaceArea() const {
+        if (IsEmpty()) {
+            return 0;
+        }
+        Vector d = max_ - min_;
+        return 2 * (d[0] * d[1] + d[1] * d[2] + d[2] * d[0]);
+    }
+
+private:
+    static constexpr Scalar kMax = std::numeric_limits<Scalar>::max();
+
+    Vector min_;
+    Vector max_;
+};
+
+inline BoundingBox GetBoundingBox(const Triangle& triangle) {
+    BoundingBox box;
+    for (size_t i = 0; i < 3; ++i) {
+        box.Extend(triangle.GetVertex(i));
+    }
+    return box;
+}
+inline BoundingBox GetBoundingBox(const Sphere& sphere) {
+    double r = sphere.GetRadius();
+    return {sphere.GetCenter() - Vector{r, r, r}, sphere.GetCenter() + Vector{r, r, r}};
+}
+
+// Reciprocal of the ray direction, shared by all slab tests of one traversal.
+inline Vector InverseDirection(const Ray& ray) {
+    const Vector& d = ray.GetDirection();
+    return {1 / d[0], 1 / d[1], 1 / d[2]};
+}
+
+// Slab test in the ray parameter t (not the distance). Comparisons are written so that a NaN
+// coming from a zero direction component on a slab plane keeps the ray inside that slab.
+inline bool IntersectsBox(const Ray& ray, const Vector& inverse_direction, const BoundingBox& box,
+                          double t_min, double t_max, double* t_enter = nullptr) {
+    const Vector& origin = ray.GetOrigin();
+    for (int i = 0; i < 3; ++i) {
+        double t0 = (box.GetMin()[i] - origin[i]) * inverse_direction[i];
+        double t1 = (box.GetMax()[i] - origin[i]) * inverse_direction[i];
+        if (t0 > t1) {
+            std::swap(t0, t1);
+        }
+        t1 *= 1 + kSlabSlack;
+        t_min = t0 > t_min ? t0 : t_min;
+        t_max = t1 < t_max ? t1 : t_max;
+        if (t_min > t_max) {
+            return false;
+        }
+    }
+    if (t_enter) {
+        *t_enter = t_min;
+    }
+    return true;
+}
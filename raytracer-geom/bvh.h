@@ -0,0 +1,398 @@
+#pragma once
+
+#include <bounding_box.h>
+#include <ray_packet.h>
+#include <ray.h>
+
+#include <array>
+#include <vector>
+#include <cstdint>
+#include <numeric>
+#include <algorithm>
+#include <queue>
+
+struct BvhNode {
+    BoundingBox box;
+    // Leaf: first slot in the primitive order. Inner node: index of the right child, the left
+    // child always follows its parent.
+    uint32_t offset = 0;
+    // Number of primitives in a leaf, 0 for inner nodes.
+    uint32_t count = 0;
+
+    bool IsLeaf() const {
+        return count > 0;
+    }
+};
+
+// Bounding volume hierarchy over abstract primitives given by their boxes. Nodes are split with
+// the binned surface area heuristic; the caller owns the primitives and tests them itself.
+class Bvh {
+public:
+    static constexpr int kBins = 16;
+    static constexpr uint32_t kMaxLeafSize = 8;
+    static constexpr int kMaxDepth = 64;
+    static constexpr double kTraversalCost = 1;
+    static constexpr double kIntersectionCost = 1;
+    // Refitted trees whose SAH cost grew past this factor of the built one should be rebuilt.
+    static constexpr double kMaxDegradation = 1.5;
+
+    Bvh() {
+    }
+    explicit Bvh(const std::vector<BoundingBox>& boxes) : primitives_(boxes.size()) {
+        if (boxes.empty()) {
+            return;
+        }
+        std::iota(primitives_.begin(), primitives_.end(), 0);
+        std::vector<Vector> centers;
+        centers.reserve(boxes.size());
+        for (const BoundingBox& box : boxes) {
+            centers.push_back(box.GetCenter());
+        }
+        nodes_.reserve(2 * boxes.size());
+        Build(boxes, centers, 0, primitives_.size(), 0);
+        Link();
+    }
+    // Adopts a tree built before, e.g. one loaded from a cache file.
+    Bvh(std::vector<BvhNode> nodes, std::vector<uint32_t> primitives)
+        : nodes_(std::move(nodes)), primitives_(std::move(primitives)) {
+        Link();
+    }
+
+    const std::vector<BvhNode>& GetNodes() const {
+        return nodes_;
+    }
+    // Primitive indices in leaf order, leaves refer to ranges of this array.
+    const std::vector<uint32_t>& GetPrimitives() const {
+        return primitives_;
+    }
+    bool Empty() const {
+        return nodes_.empty();
+    }
+    // The leaf node that holds `primitive`.
+    uint32_t GetLeaf(uint32_t primitive) const {
+        return leaves_[primitive];
+    }
+
+    // Refits the boxes above the given primitives after they moved, bottom-up, without changing
+    // the topology. `get_box(primitive)` returns the current box of any primitive in the same
+    // leaf as a changed one. Costs O(changed primitives * depth), not O(tree size).
+    template <class GetBox>
+    void Refit(const std::vector<uint32_t>& changed, GetBox&& get_box) {
+        // Children always have larger indices than their parents, so the largest index first
+        // sees every node after all of its changed children.
+        std::priority_queue<uint32_t> queue;
+        for (uint32_t primitive : changed) {
+            queue.push(leaves_[primitive]);
+        }
+        uint32_t last = UINT32_MAX;
+        while (!queue.empty()) {
+            uint32_t index = queue.top();
+            queue.pop();
+            if (index == last) {
+                continue;
+            }
+            last = index;
+            BvhNode& node = nodes_[index];
+            BoundingBox box;
+            if (node.IsLeaf()) {
+                for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                    box.Extend(get_box(primitives_[i]));
+                }
+            } else {
+                box.Extend(nodes_[index + 1].box);
+                box.Extend(nodes_[node.offset].box);
+            }
+            if (box == node.box) {
+                continue;
+            }
+            cost_sum_ += NodeCost(node, box) - NodeCost(node, node.box);
+            node.box = box;
+            if (index != 0) {
+                queue.push(parents_[index]);
+            }
+        }
+    }
+
+    // SAH cost of the tree: expected traversal and intersection work of a random ray that hits
+    // the root box.
+    double Cost() const {
+        double root_area = nodes_.empty() ? 0 : nodes_[0].box.SurfaceArea();
+        return root_area > 0 ? cost_sum_ / root_area : 0;
+    }
+    // How many times the tree got worse by refits since it was built.
+    double Degradation() const {
+        return built_cost_ > 0 ? Cost() / built_cost_ : 1;
+    }
+
+    // Visits the leaves hit by the ray front to back. `visit(node, t_max)` tests the primitives
+    // of leaf `nodes_[node]` and returns the ray parameter of the closest hit so far (or `t_max`
+    // unchanged), which prunes all boxes behind it.
+    template <class Visit>
+    void TraverseLeaves(const Ray& ray, double t_max, Visit&& visit) const {
+        if (nodes_.empty()) {
+            return;
+        }
+        const Vector inverse_direction = InverseDirection(ray);
+        std::array<uint32_t, 2 * kMaxDepth> stack;
+        int size = 0;
+        if (!IntersectsBox(ray, inverse_direction, nodes_[0].box, 0, t_max)) {
+            return;
+        }
+        stack[size++] = 0;
+        while (size > 0) {
+            uint32_t index = stack[--size];
+            const BvhNode& node = nodes_[index];
+            if (node.IsLeaf()) {
+                t_max = visit(index, t_max);
+                continue;
+            }
+            uint32_t left = index + 1, right = node.offset;
+            double t_left, t_right;
+            bool hit_left =
+                IntersectsBox(ray, inverse_direction, nodes_[left].box, 0, t_max, &t_left);
+            bool hit_right =
+                IntersectsBox(ray, inverse_direction, nodes_[right].box, 0, t_max, &t_right);
+            if (hit_left && hit_right) {
+                if (t_left > t_right) {
+                    std::swap(left, right);
+                }
+                stack[size++] = right;
+                stack[size++] = left;
+            } else if (hit_left) {
+                stack[size++] = left;
+            } else if (hit_right) {
+                stack[size++] = right;
+            }
+        }
+    }
+
+    // Same as TraverseLeaves, one primitive at a time: `visit(primitive, t_max)`.
+    template <class Visit>
+    void Traverse(const Ray& ray, double t_max, Visit&& visit) const {
+        TraverseLeaves(ray, t_max, [&](uint32_t index, double t_max) {
+            const BvhNode& node = nodes_[index];
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                t_max = visit(primitives_[i], t_max);
+            }
+            return t_max;
+        });
+    }
+
+    // TraverseLeaves for a packet of coherent rays, `t_max[i]` being the limit of ray i.
+    // `visit(node, first)` tests rays [first, packet.Size()) against the leaf and lowers their
+    // limits. Boxes outside the packet frustum are culled without per-ray tests, and the rays
+    // in front of the first one that hits a box are skipped for its whole subtree. Rays in
+    // front of `first` are skipped from the start, as when continuing into a subtree.
+    template <class Visit>
+    void TraversePacket(const RayPacket& packet, double* t_max, Visit&& visit,
+                        int first = 0) const {
+        if (nodes_.empty() || first >= packet.Size()) {
+            return;
+        }
+        std::array<std::pair<uint32_t, int>, 2 * kMaxDepth> stack;
+        int size = 0;
+        stack[size++] = {0, first};
+        while (size > 0) {
+            auto [index, first] = stack[--size];
+            const BvhNode& node = nodes_[index];
+            double packet_t_max = *std::max_element(t_max + first, t_max + packet.Size());
+            if (packet.MissesBox(node.box, packet_t_max)) {
+                continue;
+            }
+            first = packet.FirstHit(node.box, first, t_max);
+            if (first == packet.Size()) {
+                continue;
+            }
+            if (node.IsLeaf()) {
+                visit(index, first);
+                continue;
+            }
+            uint32_t left = index + 1, right = node.offset;
+            if (packet.Entry(nodes_[left].box, first) > packet.Entry(nodes_[right].box, first)) {
+                std::swap(left, right);
+            }
+            stack[size++] = {right, first};
+            stack[size++] = {left, first};
+        }
+    }
+
+    // Any-hit query over the segment [t_min, t_max]: returns true as soon as `test(node)` does
+    // for one of the leaves the segment passes through, without looking for the closest hit.
+    template <class Test>
+    bool TraverseLeavesAny(const Ray& ray, double t_min, double t_max, Test&& test) const {
+        if (nodes_.empty()) {
+            return false;
+        }
+        const Vector inverse_direction = InverseDirection(ray);
+        std::array<uint32_t, 2 * kMaxDepth> stack;
+        int size = 0;
+        stack[size++] = 0;
+        while (size > 0) {
+            uint32_t index = stack[--size];
+            const BvhNode& node = nodes_[index];
+            if (!IntersectsBox(ray, inverse_direction, node.box, t_min, t_max)) {
+                continue;
+            }
+            if (node.IsLeaf()) {
+                if (test(index)) {
+                    return true;
+                }
+                continue;
+            }
+            stack[size++] = node.offset;
+            stack[size++] = index + 1;
+        }
+        return false;
+    }
+
+    // Same as TraverseLeavesAny, one primitive at a time: `test(primitive)`.
+    template <class Test>
+    bool TraverseAny(const Ray& ray, double t_min, double t_max, Test&& test) const {
+        return TraverseLeavesAny(ray, t_min, t_max, [&](uint32_t index) {
+            const BvhNode& node = nodes_[index];
+            for (uint32_t i = node.offset; i < node.offset + node.count; ++i) {
+                if (test(primitives_[i])) {
+                    return true;
+                }
+            }
+            return false;
+        });
+    }
+
+private:
+    struct Bin {
+        BoundingBox box;
+        uint32_t count = 0;
+    };
+
+    void Build(const std::vector<BoundingBox>& boxes, const std::vector<Vector>& centers,
+               uint32_t begin, uint32_t end, int depth) {
+        uint32_t index = nodes_.size();
+        nodes_.emplace_back();
+        BoundingBox box, center_box;
+        for (uint32_t i = begin; i < end; ++i) {
+            box.Extend(boxes[primitives_[i]]);
+            center_box.Extend(centers[primitives_[i]]);
+        }
+        nodes_[index].box = box;
+        uint32_t count = end - begin;
+
+        int best_axis = -1;
+        int best_split = 0;
+        double best_cost = kIntersectionCost * count;
+        for (int axis = 0; axis < 3 && count > 1 && depth < kMaxDepth - 1; ++axis) {
+            double low = center_box.GetMin()[axis], high = center_box.GetMax()[axis];
+            if (high <= low) {
+                continue;
+            }
+            std::array<Bin, kBins> bins;
+            double scale = kBins / (high - low);
+            for (uint32_t i = begin; i < end; ++i) {
+                Bin& bin = bins[BinIndex(centers[primitives_[i]][axis], low, scale)];
+                bin.box.Extend(boxes[primitives_[i]]);
+                ++bin.count;
+            }
+            // Sweep from the right to get the cost of every right-hand side, then from the left.
+            std::array<double, kBins> right_area;
+            std::array<uint32_t, kBins> right_count;
+            BoundingBox right_box;
+            uint32_t right_total = 0;
+            for (int i = kBins - 1; i > 0; --i) {
+                right_box.Extend(bins[i].box);
+                right_total += bins[i].count;
+                right_area[i] = right_box.SurfaceArea();
+                right_count[i] = right_total;
+            }
+            BoundingBox left_box;
+            uint32_t left_total = 0;
+            for (int i = 1; i < kBins; ++i) {
+                left_box.Extend(bins[i - 1].box);
+                left_total += bins[i - 1].count;
+                if (left_total == 0 || right_count[i] == 0) {
+                    continue;
+                }
+                double cost = kTraversalCost + kIntersectionCost *
+                                                   (left_box.SurfaceArea() * left_total +
+                                                    right_area[i] * right_count[i]) /
+                                                   box.SurfaceArea();
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_split = i;
+                }
+            }
+        }
+
+        if (best_axis == -1 && count > kMaxLeafSize && depth < kMaxDepth - 1) {
+            // No split beats a leaf, but the leaf would be too big: split at the median.
+            best_axis = LongestAxis(center_box);
+            best_split = -1;
+        }
+        if (best_axis == -1) {
+            nodes_[index].offset = begin;
+            nodes_[index].count = count;
+            return;
+        }
+
+        auto first = primitives_.begin() + begin, last = primitives_.begin() + end;
+        uint32_t middle;
+        if (best_split >= 0) {
+            double low = center_box.GetMin()[best_axis];
+            double scale = kBins / (center_box.GetMax()[best_axis] - low);
+            middle = std::partition(first, last,
+                                    [&](uint32_t primitive) {
+                                        return BinIndex(centers[primitive][best_axis], low,
+                                                        scale) < best_split;
+                                    }) -
+                     primitives_.begin();
+        } else {
+            middle = begin + count / 2;
+            std::nth_element(first, primitives_.begin() + middle, last,
+                             [&](uint32_t lhs, uint32_t rhs) {
+                                 return centers[lhs][best_axis] < centers[rhs][best_axis];
+                             });
+        }
+        Build(boxes, centers, begin, middle, depth + 1);
+        nodes_[index].offset = nodes_.size();
+        Build(boxes, centers, middle, end, depth + 1);
+    }
+
+    // Fills parents_, leaves_ and the cost of the finished tree.
+    void Link() {
+        parents_.resize(nodes_.size());
+        leaves_.resize(primitives_.size());
+        for (uint32_t i = 0; i < nodes_.size(); ++i) {
+            const BvhNode& node = nodes_[i];
+            cost_sum_ += NodeCost(node, node.box);
+            if (node.IsLeaf()) {
+                for (uint32_t j = node.offset; j < node.offset + node.count; ++j) {
+                    leaves_[primitives_[j]] = i;
+                }
+            } else {
+                parents_[i + 1] = parents_[node.offset] = i;
+            }
+        }
+        built_cost_ = Cost();
+    }
+
+    static double NodeCost(const BvhNode& node, const BoundingBox& box) {
+        return box.SurfaceArea() * (node.IsLeaf() ? kIntersectionCost * node.count
+                                                  : kTraversalCost);
+    }
+    static int BinIndex(double center, double low, double scale) {
+        return std::min(kBins - 1, static_cast<int>((center - low) * scale));
+    }
+    static int LongestAxis(const BoundingBox& box) {
+        Vector d = box.GetMax() - box.GetMin();
+        return d[0] >= d[1] && d[0] >= d[2] ? 0 : (d[1] >= d[2] ? 1 : 2);
+    }
+
+    std::vector<BvhNode> nodes_;
+    std::vector<uint32_t> primitives_;
+    // Parent of every node and leaf of every primitive, used by Refit.
+    std::vector<uint32_t> parents_;
+    std::vector<uint32_t> leaves_;
+    // Sum of NodeCost over all nodes, kept up to date by Refit.
+    double cost_sum_ = 0;
+    double built_cost_ = 0;
+};
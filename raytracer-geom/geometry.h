@@ -1,3 +1,5 @@
+#pragma once
+
 #include <vector.h>
 #include <sphere.h>
 #include <intersection.h>
@@ -6,54 +8,63 @@
 
 #include <optional>
 const double kMykErr = 1e-8;
-bool RootExists(double a, double b, double c) {
-    double d = b * b - 4 * a * c;
+template <class T>
+bool RootExists(T a, T b, T c) {
+    T d = b * b - 4 * a * c;
     return d >= 0;
 }
-std::pair<double, double> Root(double a, double b, double c) {
-    double d = b * b - 4 * a * c;
-    return std::make_pair<double, double>((-b - sqrt(d)) / 2 / a, (-b + sqrt(d)) / 2 / a);
+template <class T>
+std::pair<T, T> Root(T a, T b, T c) {
+    T d = b * b - 4 * a * c;
+    return std::make_pair<T, T>((-b - std::sqrt(d)) / 2 / a, (-b + std::sqrt(d)) / 2 / a);
 }
-bool OneSide(Vector v1, Vector v2) {
+template <class T>
+bool OneSide(BasicVector<T> v1, BasicVector<T> v2) {
     return DotProduct(v1, v2) > 0;
 }
-std::optional<Intersection> GetIntersection(const Ray& ray, const Sphere& sphere) {
-    const Vector &start = ray.GetOrigin(), direction = ray.GetDirection();
-    const Vector& center = sphere.GetCenter();
-    double r = sphere.GetRadius();
-    const Vector delta = start - center;
-    double a = DotProduct(direction, direction);
-    double b = 2 * DotProduct(direction, delta);
-    double c = DotProduct(delta, delta) - r * r;
+
+// Intersection routines work in the precision of their arguments.
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(const BasicRay<T>& ray,
+                                                    const BasicSphere<T>& sphere) {
+    const BasicVector<T> &start = ray.GetOrigin(), direction = ray.GetDirection();
+    const BasicVector<T>& center = sphere.GetCenter();
+    T r = sphere.GetRadius();
+    const BasicVector<T> delta = start - center;
+    T a = DotProduct(direction, direction);
+    T b = 2 * DotProduct(direction, delta);
+    T c = DotProduct(delta, delta) - r * r;
     if (!RootExists(a, b, c)) {
         return {};
     }
-    const std::pair<double, double> pair = Root(a, b, c);
-    double r1 = pair.first, r2 = pair.second;
+    const std::pair<T, T> pair = Root(a, b, c);
+    T r1 = pair.first, r2 = pair.second;
     if (r2 < 0) {
         return {};
     }
-    double pk;
+    T pk;
     if (r1 >= 0) {
         pk = r1;
     } else {
         pk = r2;
     }
-    const Vector p = start + (direction * pk);
-    Vector norm = p - center;
+    const BasicVector<T> p = start + (direction * pk);
+    BasicVector<T> norm = p - center;
     norm.Normalize();
     if (OneSide(norm, direction)) {
         norm = norm * (-1);
     }
-    return Intersection{p, norm, Length(direction) * pk};
+    return BasicIntersection<T>{p, norm, Length(direction) * pk, pk};
 }
 
-std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& triangle) {
-    const Vector& vertex0 = triangle.GetVertex(0);
-    const Vector& vertex1 = triangle.GetVertex(1);
-    const Vector& vertex2 = triangle.GetVertex(2);
-    Vector edge1, edge2, h, s, q;
-    double a, f, u, v;
+template <class T>
+std::optional<BasicIntersection<T>> GetIntersection(const BasicRay<T>& ray,
+                                                    const BasicTriangle<T>& triangle) {
+    const BasicVector<T>& vertex0 = triangle.GetVertex(0);
+    const BasicVector<T>& vertex1 = triangle.GetVertex(1);
+    const BasicVector<T>& vertex2 = triangle.GetVertex(2);
+    BasicVector<T> edge1, edge2, h, s, q;
+    T a, f, u, v;
     edge1 = vertex1 - vertex0;
     edge2 = vertex2 - vertex0;
     h = CrossProduct(ray.GetDirection(), edge2);
@@ -61,7 +72,7 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& tria
     if (a > -kMykErr && a < kMykErr) {
         return {};  // This ray is parallel to this triangle.
     }
-    f = 1.0 / a;
+    f = T(1) / a;
     s = ray.GetOrigin() - vertex0;
     u = f * DotProduct(s, h);
     if (u < 0.0 || u > 1.0) {
@@ -73,64 +84,119 @@ std::optional<Intersection> GetIntersection(const Ray& ray, const Triangle& tria
         return {};
     }
     // At this stage we can compute t to find out where the intersection point is on the line.
-    double t = f * DotProduct(edge2, q);
+    T t = f * DotProduct(edge2, q);
     if (t > kMykErr)  // ray intersection
     {
-        Vector p = ray.GetOrigin() + ray.GetDirection() * t;
-        double dist = Length(ray.GetDirection()) * t;
-        Vector suspect_norm = CrossProduct(edge1, edge2);
+        BasicVector<T> p = ray.GetOrigin() + ray.GetDirection() * t;
+        T dist = Length(ray.GetDirection()) * t;
+        BasicVector<T> suspect_norm = CrossProduct(edge1, edge2);
         suspect_norm.Normalize();
         if (OneSide(suspect_norm, ray.GetDirection())) {
             suspect_norm = suspect_norm * (-1);
         }
-        return Intersection{p, suspect_norm, dist};
+        return BasicIntersection<T>{p, suspect_norm, dist, t, u, v};
     } else {  // This means that there is a line intersection but not a ray intersection.
         return {};
     }
 }
 
-std::optional<Vector> Refract(const Vector& ray, const Vector& normal, double eta) {
-    Vector my_ray = ray;
+// Any-hit versions of GetIntersection: only report whether the ray hits the primitive with the
+// ray parameter inside [t_min, t_max], without building an Intersection.
+template <class T>
+bool HasIntersection(const BasicRay<T>& ray, const BasicSphere<T>& sphere,
+                     std::type_identity_t<T> t_min, std::type_identity_t<T> t_max) {
+    const BasicVector<T> delta = ray.GetOrigin() - sphere.GetCenter();
+    const BasicVector<T>& direction = ray.GetDirection();
+    T r = sphere.GetRadius();
+    T a = DotProduct(direction, direction);
+    T b = 2 * DotProduct(direction, delta);
+    T c = DotProduct(delta, delta) - r * r;
+    if (!RootExists(a, b, c)) {
+        return false;
+    }
+    const std::pair<T, T> pair = Root(a, b, c);
+    return (pair.first >= t_min && pair.first <= t_max) ||
+           (pair.second >= t_min && pair.second <= t_max);
+}
+
+template <class T>
+bool HasIntersection(const BasicRay<T>& ray, const BasicTriangle<T>& triangle,
+                     std::type_identity_t<T> t_min, std::type_identity_t<T> t_max) {
+    const BasicVector<T>& vertex0 = triangle.GetVertex(0);
+    const BasicVector<T> edge1 = triangle.GetVertex(1) - vertex0;
+    const BasicVector<T> edge2 = triangle.GetVertex(2) - vertex0;
+    const BasicVector<T> h = CrossProduct(ray.GetDirection(), edge2);
+    T a = DotProduct(edge1, h);
+    if (a > -kMykErr && a < kMykErr) {
+        return false;
+    }
+    T f = T(1) / a;
+    const BasicVector<T> s = ray.GetOrigin() - vertex0;
+    T u = f * DotProduct(s, h);
+    if (u < 0.0 || u > 1.0) {
+        return false;
+    }
+    const BasicVector<T> q = CrossProduct(s, edge1);
+    T v = f * DotProduct(ray.GetDirection(), q);
+    if (v < 0.0 || u + v > 1.0) {
+        return false;
+    }
+    T t = f * DotProduct(edge2, q);
+    return t > kMykErr && t >= t_min && t <= t_max;
+}
+
+template <class T>
+std::optional<BasicVector<T>> Refract(const BasicVector<T>& ray,
+                                      const std::type_identity_t<BasicVector<T>>& normal,
+                                      std::type_identity_t<T> eta) {
+    BasicVector<T> my_ray = ray;
     my_ray.Normalize();
-    Vector my_normal = normal;
+    BasicVector<T> my_normal = normal;
     my_normal.Normalize();
-    double my_cos = -DotProduct(my_ray, normal);
-    double my_cos_square = my_cos * my_cos;
-    double my_sin_square = 1 - my_cos_square;
-    double eta_square = eta * eta;
+    T my_cos = -DotProduct(my_ray, normal);
+    T my_cos_square = my_cos * my_cos;
+    T my_sin_square = 1 - my_cos_square;
+    T eta_square = eta * eta;
     if (my_sin_square >= 1 / eta_square) {
         return {};
     } else {
         return my_ray * eta +
-               my_normal * (eta * my_cos - sqrt(1 - eta_square * (1 - my_cos_square)));
+               my_normal * (eta * my_cos - std::sqrt(1 - eta_square * (1 - my_cos_square)));
     }
 }
-Vector Reflect(const Vector& ray, const Vector& normal) {
-    double c = -DotProduct(ray, normal);
-    Vector result = ray + normal * (2 * c);
+template <class T>
+BasicVector<T> Reflect(const BasicVector<T>& ray,
+                       const std::type_identity_t<BasicVector<T>>& normal) {
+    T c = -DotProduct(ray, normal);
+    BasicVector<T> result = ray + normal * (2 * c);
     result.Normalize();
     return result;
 }
-inline double Determinant(const Vector& v1, const Vector& v2, int ind1, int ind2) {
+template <class T>
+inline T Determinant(const BasicVector<T>& v1, const BasicVector<T>& v2, int ind1, int ind2) {
     return v1[ind1] * v2[ind2] - v1[ind2] * v2[ind1];
 }
-inline std::pair<double, double> Solve(const Vector& v1, const Vector& v2, const Vector& v3,
-                                       int ind1, int ind2, double det) {
-    double x1 = v1[ind1], x2 = v2[ind1], x3 = v3[ind1], y1 = v1[ind2], y2 = v2[ind2], y3 = v3[ind2];
-    double answer1 = (y2 * x3 - x2 * y3) / det, answer2 = (x1 * y3 - x3 * y1) / det;
+template <class T>
+inline std::pair<T, T> Solve(const BasicVector<T>& v1, const BasicVector<T>& v2,
+                             const BasicVector<T>& v3, int ind1, int ind2, T det) {
+    T x1 = v1[ind1], x2 = v2[ind1], x3 = v3[ind1], y1 = v1[ind2], y2 = v2[ind2], y3 = v3[ind2];
+    T answer1 = (y2 * x3 - x2 * y3) / det, answer2 = (x1 * y3 - x3 * y1) / det;
     return std::make_pair(answer1, answer2);
 }
-Vector GetBarycentricCoords(const Triangle& triangle, const Vector& point) {
-    const Vector &a = triangle.GetVertex(0), b = triangle.GetVertex(1), c = triangle.GetVertex(2);
-    Vector p = point - a, ab = b - a, ac = c - a;
+template <class T>
+BasicVector<T> GetBarycentricCoords(const BasicTriangle<T>& triangle,
+                                    const std::type_identity_t<BasicVector<T>>& point) {
+    const BasicVector<T> &a = triangle.GetVertex(0), b = triangle.GetVertex(1),
+                          c = triangle.GetVertex(2);
+    BasicVector<T> p = point - a, ab = b - a, ac = c - a;
     std::array<std::pair<int, int>, 3> indexes = {std::make_pair(0, 1), std::make_pair(0, 2),
                                                   std::make_pair(1, 2)};
     for (auto [ind1, ind2] : indexes) {
-        double det = Determinant(ab, ac, ind1, ind2);
+        T det = Determinant(ab, ac, ind1, ind2);
         if (det < -kMykErr || det > kMykErr) {
             auto pair = Solve(ab, ac, p, ind1, ind2, det);
-            double beta = pair.first, gamma = pair.second;
-            double alpha = 1 - beta - gamma;
+            T beta = pair.first, gamma = pair.second;
+            T alpha = 1 - beta - gamma;
             return {alpha, beta, gamma};
         }
     }
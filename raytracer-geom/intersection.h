@@ -2,24 +2,44 @@
 
 #include <vector.h>
 
-class Intersection {
+template <class T>
+class BasicIntersection {
 public:
-    Intersection(Vector pos, Vector norm, double dist)
+    BasicIntersection(BasicVector<T> pos, BasicVector<T> norm, T dist)
         : position_(pos), normal_(norm), distance_(dist) {
     }
+    // `u` and `v` are the barycentric coordinates of the hit point along the edges
+    // vertex0 -> vertex1 and vertex0 -> vertex2 of a triangle, `t` the ray parameter.
+    BasicIntersection(BasicVector<T> pos, BasicVector<T> norm, T dist, T t, T u = 0, T v = 0)
+        : position_(pos), normal_(norm), distance_(dist), t_(t), u_(u), v_(v) {
+    }
 
-    const Vector& GetPosition() const {
+    const BasicVector<T>& GetPosition() const {
         return position_;
     };
-    const Vector& GetNormal() const {
+    const BasicVector<T>& GetNormal() const {
         return normal_;
     };
-    double GetDistance() const {
+    T GetDistance() const {
         return distance_;
     };
+    T GetT() const {
+        return t_;
+    }
+    T GetU() const {
+        return u_;
+    }
+    T GetV() const {
+        return v_;
+    }
 
 private:
-    Vector position_;
-    Vector normal_;
-    double distance_;
+    BasicVector<T> position_;
+    BasicVector<T> normal_;
+    T distance_;
+    T t_ = 0;
+    T u_ = 0;
+    T v_ = 0;
 };
+
+using Intersection = BasicIntersection<Scalar>;
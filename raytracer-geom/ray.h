@@ -2,18 +2,22 @@
 
 #include <vector.h>
 
-class Ray {
+template <class T>
+class BasicRay {
 public:
-    Ray(Vector origin, Vector direction) : origin_(origin), direction_(direction) {
+    BasicRay(BasicVector<T> origin, BasicVector<T> direction)
+        : origin_(origin), direction_(direction) {
     }
-    const Vector& GetOrigin() const {
+    const BasicVector<T>& GetOrigin() const {
         return origin_;
     };
-    const Vector& GetDirection() const {
+    const BasicVector<T>& GetDirection() const {
         return direction_;
     };
 
 private:
-    Vector origin_;
-    Vector direction_;
+    BasicVector<T> origin_;
+    BasicVector<T> direction_;
 };
+
+using Ray = BasicRay<Scalar>;
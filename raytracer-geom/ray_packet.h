@@ -0,0 +1,137 @@
+#pragma once
+
+#include <bounding_box.h>
+#include <ray.h>
+
+#include <algorithm>
+#include <array>
+
+// A bundle of coherent rays (a block of camera rays) traced through a BVH together. Rays are
+// kept in structure-of-arrays form so that box tests run across rays. When all rays share their
+// origin, the packet also keeps the interval of its inverse directions along every axis where
+// all rays point the same way, which bounds the whole bundle like a frustum.
+class RayPacket {
+public:
+    static constexpr int kMaxSize = 64;
+
+    void Add(const Ray& ray) {
+        int i = size_++;
+        rays_[i] = &ray;
+        const Vector& origin = ray.GetOrigin();
+        const Vector& direction = ray.GetDirection();
+        for (int axis = 0; axis < 3; ++axis) {
+            origin_[axis][i] = origin[axis];
+            inverse_direction_[axis][i] = 1 / direction[axis];
+        }
+        if (i == 0) {
+            shared_origin_ = origin;
+            for (int axis = 0; axis < 3; ++axis) {
+                inverse_min_[axis] = inverse_max_[axis] = inverse_direction_[axis][0];
+            }
+            shared_ = true;
+            same_sign_ = {true, true, true};
+            return;
+        }
+        for (int axis = 0; axis < 3; ++axis) {
+            double inverse = inverse_direction_[axis][i];
+            if (origin[axis] != shared_origin_[axis]) {
+                shared_ = false;
+            }
+            if (std::signbit(inverse) != std::signbit(inverse_min_[axis])) {
+                same_sign_[axis] = false;
+            }
+            inverse_min_[axis] = std::min(inverse_min_[axis], inverse);
+            inverse_max_[axis] = std::max(inverse_max_[axis], inverse);
+        }
+    }
+
+    int Size() const {
+        return size_;
+    }
+    const Ray& GetRay(int i) const {
+        return *rays_[i];
+    }
+
+    // Conservative frustum test: true only if no ray of the packet can enter the box before
+    // `t_max`. Axes along which the rays point both ways do not constrain the packet, and
+    // packets without a shared origin are never culled.
+    bool MissesBox(const BoundingBox& box, double t_max) const {
+        if (!shared_ || size_ == 0) {
+            return false;
+        }
+        double t_enter = 0, t_exit = t_max;
+        for (int axis = 0; axis < 3; ++axis) {
+            if (!same_sign_[axis] || !std::isfinite(inverse_min_[axis]) ||
+                !std::isfinite(inverse_max_[axis])) {
+                continue;
+            }
+            // Entry and exit parameters of every ray lie in these products of intervals.
+            double low = box.GetMin()[axis] - shared_origin_[axis];
+            double high = box.GetMax()[axis] - shared_origin_[axis];
+            if (inverse_min_[axis] < 0) {
+                std::swap(low, high);
+            }
+            double near = std::min(low * inverse_min_[axis], low * inverse_max_[axis]);
+            double far = std::max(high * inverse_min_[axis], high * inverse_max_[axis]);
+            t_enter = std::max(t_enter, near);
+            t_exit = std::min(t_exit, far * (1 + kSlabSlack));
+        }
+        return t_enter > t_exit;
+    }
+
+    // Slab test of rays [first, Size()) against the box, each ray up to its own `t_max[i]`.
+    // Returns the first ray that hits the box, or Size() if none does. Rays are tested in groups
+    // of kGroup so that the group runs across SIMD lanes and the scan stops at the first hit.
+    int FirstHit(const BoundingBox& box, int first, const double* t_max) const {
+        constexpr int kGroup = 4;
+        for (int start = first; start < size_; start += kGroup) {
+            alignas(32) double t_enter[kGroup], t_exit[kGroup];
+            for (int k = 0; k < kGroup; ++k) {
+                t_enter[k] = 0;
+                t_exit[k] = start + k < size_ ? t_max[start + k] : -1;
+            }
+            for (int axis = 0; axis < 3; ++axis) {
+                const double low = box.GetMin()[axis], high = box.GetMax()[axis];
+                const double* origin = origin_[axis] + start;
+                const double* inverse = inverse_direction_[axis] + start;
+                // Branch-free; a NaN from a zero direction component on a slab plane leaves
+                // the ray inside that slab, as in IntersectsBox.
+                for (int k = 0; k < kGroup; ++k) {
+                    double t0 = (low - origin[k]) * inverse[k];
+                    double t1 = (high - origin[k]) * inverse[k];
+                    double near = t0 < t1 ? t0 : t1;
+                    double far = (t0 < t1 ? t1 : t0) * (1 + kSlabSlack);
+                    t_enter[k] = near > t_enter[k] ? near : t_enter[k];
+                    t_exit[k] = far < t_exit[k] ? far : t_exit[k];
+                }
+            }
+            for (int k = 0; k < kGroup; ++k) {
+                if (t_enter[k] <= t_exit[k]) {
+                    return start + k;
+                }
+            }
+        }
+        return size_;
+    }
+
+    // Entry parameter of ray `i` into the box, used to order the traversal.
+    double Entry(const BoundingBox& box, int i) const {
+        double t_enter = 0;
+        IntersectsBox(*rays_[i], {inverse_direction_[0][i], inverse_direction_[1][i],
+                                  inverse_direction_[2][i]},
+                      box, 0, DBL_MAX, &t_enter);
+        return t_enter;
+    }
+
+private:
+    int size_ = 0;
+    std::array<const Ray*, kMaxSize> rays_;
+    // Padded so that the last group of FirstHit stays in bounds.
+    alignas(32) double origin_[3][kMaxSize + 4] = {};
+    alignas(32) double inverse_direction_[3][kMaxSize + 4] = {};
+
+    bool shared_ = false;
+    std::array<bool, 3> same_sign_;
+    Vector shared_origin_;
+    std::array<double, 3> inverse_min_, inverse_max_;
+};
@@ -2,20 +2,23 @@
 
 #include <vector.h>
 
-class Sphere {
+template <class T>
+class BasicSphere {
 public:
-    Sphere() {
+    BasicSphere() {
     }
-    Sphere(Vector center, double radius) : center_(center), radius_(radius) {
+    BasicSphere(BasicVector<T> center, T radius) : center_(center), radius_(radius) {
     }
-    const Vector& GetCenter() const {
+    const BasicVector<T>& GetCenter() const {
         return center_;
     };
-    double GetRadius() const {
+    T GetRadius() const {
         return radius_;
     };
 
 private:
-    Vector center_{};
-    double radius_ = 0;
+    BasicVector<T> center_{};
+    T radius_ = 0;
 };
+
+using Sphere = BasicSphere<Scalar>;
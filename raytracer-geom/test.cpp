@@ -1,10 +1,13 @@
 #include <catch.hpp>
 
+#include <chrono>
 #include <cmath>
 #include <string>
 #include <optional>
 
 #include <geometry.h>
+#include <bvh.h>
+#include <triangle_batch.h>
 
 constexpr auto kX = 123.;
 constexpr auto kY = 456.;
@@ -88,6 +91,123 @@ TEST_CASE("Cross product", "[raytracer]") {
     }
 }
 
+template <class T>
+void CheckVectorLanes() {
+    for (int i = 0; i < 100; ++i) {
+        const BasicVector<T> a{0.37 * i - 11, 1.3 - 0.021 * i * i, 0.5 + i % 7};
+        const BasicVector<T> b{2.1 - 0.11 * i, 0.03 * i, -1.7 * (i % 5)};
+        // Packed arithmetic rounds exactly like the scalar formulas.
+        BasicVector<T> sum = a;
+        sum += b;
+        BasicVector<T> cross = CrossProduct(a, b);
+        BasicVector<T> scaled = a;
+        scaled *= T(-2.5);
+        for (int k = 0; k < 3; ++k) {
+            REQUIRE(sum[k] == T(a[k] + b[k]));
+            REQUIRE((a - b)[k] == T(a[k] - b[k]));
+            REQUIRE((a ^ b)[k] == T(a[k] * b[k]));
+            REQUIRE(scaled[k] == T(a[k] * T(-2.5)));
+        }
+        REQUIRE(cross[0] == T(T(a[1] * b[2]) - T(a[2] * b[1])));
+        REQUIRE(cross[1] == T(T(a[2] * b[0]) - T(a[0] * b[2])));
+        REQUIRE(cross[2] == T(T(a[0] * b[1]) - T(a[1] * b[0])));
+        REQUIRE(DotProduct(a, b) == T(T(T(a[0] * b[0]) + T(a[1] * b[1])) + T(a[2] * b[2])));
+
+        BasicVector<T> unit = a;
+        unit.Normalize();
+        REQUIRE(std::fabs(Length(unit) - 1) < 4 * std::numeric_limits<T>::epsilon());
+        REQUIRE(std::fabs(unit[1] * Length(a) - a[1]) < 1e-5 * Length(a));
+    }
+}
+
+TEST_CASE("Vector lanes", "[raytracer]") {
+    // Construction and arithmetic work in constant expressions.
+    constexpr Vector kSum = Vector{1, 2, 3} + Vector{4, 5, 6} * 2;
+    static_assert(kSum[0] == 9 && kSum[1] == 12 && kSum[2] == 15);
+    static_assert(DotProduct(kSum, Vector{1, 0, 0}) == 9);
+    constexpr Vector kCross = CrossProduct(Vector{1, 0, 0}, Vector{0, 1, 0});
+    static_assert(kCross[0] == 0 && kCross[1] == 0 && kCross[2] == 1);
+    // Float is one packed register; double stays three values.
+    static_assert(sizeof(BasicVector<float>) == 16 && sizeof(BasicVector<double>) == 24);
+
+    // Compound operators update in place and return the vector itself.
+    Vector vec{1, 2, 3};
+    (vec += {1, 1, 1}) *= 2;
+    REQUIRE((vec[0] == 4 && vec[1] == 6 && vec[2] == 8));
+    vec -= {4, 6, 8};
+    REQUIRE(Length(vec) == 0);
+
+    CheckVectorLanes<float>();
+    CheckVectorLanes<double>();
+}
+
+// Run with "[.bench]": the packed float Vector against an array-backed one on a typical
+// shading mix (cross products, dot products, normalization and accumulation).
+template <class T>
+struct ArrayVector {
+    std::array<T, 3> data;
+
+    ArrayVector(std::initializer_list<T> list) {
+        auto my_data = std::data(list);
+        data = {my_data[0], my_data[1], my_data[2]};
+    }
+    ArrayVector operator+(const ArrayVector& other) const {
+        return {data[0] + other.data[0], data[1] + other.data[1], data[2] + other.data[2]};
+    }
+    ArrayVector operator*(T k) const {
+        return {k * data[0], k * data[1], k * data[2]};
+    }
+    ArrayVector operator+=(const ArrayVector& other) {
+        *this = *this + other;
+        return *this;
+    }
+    void Normalize() {
+        T mod = std::sqrt(data[0] * data[0] + data[1] * data[1] + data[2] * data[2]);
+        data = {data[0] / mod, data[1] / mod, data[2] / mod};
+    }
+};
+template <class T>
+T DotProduct(const ArrayVector<T>& a, const ArrayVector<T>& b) {
+    return a.data[0] * b.data[0] + a.data[1] * b.data[1] + a.data[2] * b.data[2];
+}
+template <class T>
+ArrayVector<T> CrossProduct(const ArrayVector<T>& a, const ArrayVector<T>& b) {
+    return {a.data[1] * b.data[2] - a.data[2] * b.data[1],
+            a.data[2] * b.data[0] - a.data[0] * b.data[2],
+            a.data[0] * b.data[1] - a.data[1] * b.data[0]};
+}
+
+template <class V, class T>
+double ShadingMix(int iterations) {
+    V sum{0, 0, 0}, a{T(0.3), T(0.5), T(0.7)}, b{T(0.9), T(-0.2), T(0.1)};
+    for (int i = 0; i < iterations; ++i) {
+        V n = CrossProduct(a, b);
+        n.Normalize();
+        sum += n * DotProduct(n, a);
+        a = b + n * T(0.5);
+        b = n;
+    }
+    return DotProduct(sum, sum);
+}
+
+template <class T>
+void CompareVectorThroughput(int iterations) {
+    auto time = [](auto&& function) {
+        auto start = std::chrono::steady_clock::now();
+        volatile double sink = function();
+        (void)sink;
+        return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    };
+    double packed = time([&] { return ShadingMix<BasicVector<T>, T>(iterations); });
+    double array = time([&] { return ShadingMix<ArrayVector<T>, T>(iterations); });
+    WARN(sizeof(T) * 8 << "-bit: packed " << packed << " s, array " << array << " s, speedup "
+                       << array / packed);
+}
+
+TEST_CASE("Vector throughput", "[.bench]") {
+    CompareVectorThroughput<float>(20'000'000);
+}
+
 TEST_CASE("Triangle", "[raytracer]") {
     {
         Triangle triangle{{kX, 0., 0.}, {0., kY, 0.}, {0., 0., 0.}};
@@ -174,3 +294,261 @@ TEST_CASE("Barycentric coords", "[raytracer]") {
     REQUIRE(std::fabs(inside[1] - 0.1) < kErr);
     REQUIRE(std::fabs(inside[2] - 0.1) < kErr);
 }
+
+TEST_CASE("Bvh", "[raytracer]") {
+    std::vector<Triangle> triangles;
+    std::vector<BoundingBox> boxes;
+    for (int i = 0; i < 20; ++i) {
+        for (int j = 0; j < 20; ++j) {
+            double x = i, y = j, z = (i * 7 + j * 3) % 5;
+            triangles.push_back({{x, y, z}, {x + 1.5, y, z + 0.5}, {x, y + 1.5, z - 0.5}});
+            boxes.push_back(GetBoundingBox(triangles.back()));
+        }
+    }
+    Bvh bvh(boxes);
+    REQUIRE(bvh.GetPrimitives().size() == triangles.size());
+
+    for (int i = 0; i < 50; ++i) {
+        Ray ray{{0.37 * i - 2, 0.29 * i + 1, 10}, {0.1 * (i % 7) - 0.2, 0.05 * (i % 5), -1}};
+        double expected = -1;
+        for (const Triangle& triangle : triangles) {
+            auto intersection = GetIntersection(ray, triangle);
+            if (intersection && (expected < 0 || intersection->GetDistance() < expected)) {
+                expected = intersection->GetDistance();
+            }
+        }
+        double actual = -1;
+        bvh.Traverse(ray, DBL_MAX, [&](uint32_t index, double t_max) {
+            auto intersection = GetIntersection(ray, triangles[index]);
+            if (intersection && (actual < 0 || intersection->GetDistance() < actual)) {
+                actual = intersection->GetDistance();
+                return actual / Length(ray.GetDirection());
+            }
+            return t_max;
+        });
+        REQUIRE(std::fabs(actual - expected) < kErr);
+    }
+}
+
+TEST_CASE("Bvh refit", "[raytracer]") {
+    std::vector<Triangle> triangles;
+    std::vector<BoundingBox> boxes;
+    for (int i = 0; i < 30; ++i) {
+        for (int j = 0; j < 30; ++j) {
+            double x = i, y = j;
+            triangles.push_back({{x, y, 0}, {x + 1, y, 0}, {x, y + 1, 0}});
+            boxes.push_back(GetBoundingBox(triangles.back()));
+        }
+    }
+    Bvh bvh(boxes);
+    REQUIRE(bvh.Degradation() == Approx(1));
+
+    // A few triangles lift off the plane.
+    std::vector<uint32_t> changed;
+    for (uint32_t i = 0; i < triangles.size(); i += 97) {
+        triangles[i] = {{0.5, 0.5, 3. + i * 0.01}, {29.5, 0.5, 3.}, {0.5, 29.5, 3.}};
+        changed.push_back(i);
+    }
+    auto get_box = [&](uint32_t i) { return GetBoundingBox(triangles[i]); };
+    bvh.Refit(changed, get_box);
+    BoundingBox all;
+    for (const Triangle& triangle : triangles) {
+        all.Extend(GetBoundingBox(triangle));
+    }
+    REQUIRE(bvh.GetNodes()[0].box == all);
+    REQUIRE(bvh.Degradation() > Bvh::kMaxDegradation);
+
+    for (int i = 0; i < 50; ++i) {
+        Ray ray{{0.57 * i + 0.1, 0.43 * i + 0.2, 10}, {0.01 * (i % 7), -0.02 * (i % 5), -1}};
+        double expected = -1;
+        for (const Triangle& triangle : triangles) {
+            auto intersection = GetIntersection(ray, triangle);
+            if (intersection && (expected < 0 || intersection->GetDistance() < expected)) {
+                expected = intersection->GetDistance();
+            }
+        }
+        double actual = -1;
+        bvh.Traverse(ray, DBL_MAX, [&](uint32_t index, double t_max) {
+            auto intersection = GetIntersection(ray, triangles[index]);
+            if (intersection && (actual < 0 || intersection->GetDistance() < actual)) {
+                actual = intersection->GetDistance();
+                return actual / Length(ray.GetDirection());
+            }
+            return t_max;
+        });
+        REQUIRE(std::fabs(actual - expected) < kErr);
+    }
+
+    // Moving them back restores the tree as it was built.
+    for (uint32_t i : changed) {
+        double x = i / 30, y = i % 30;
+        triangles[i] = {{x, y, 0}, {x + 1, y, 0}, {x, y + 1, 0}};
+    }
+    bvh.Refit(changed, get_box);
+    REQUIRE(bvh.Degradation() == Approx(1));
+}
+
+TEST_CASE("Segment intersection", "[raytracer]") {
+    Sphere sphere({0, 0, 0}, 2.);
+    Ray ray{{5, 0, 0}, {-1, 0, 0}};
+    REQUIRE(HasIntersection(ray, sphere, 0, 10));
+    REQUIRE(HasIntersection(ray, sphere, 4, 10));
+    REQUIRE(!HasIntersection(ray, sphere, 0, 2.5));
+    REQUIRE(!HasIntersection(ray, sphere, 7.5, 10));
+
+    Triangle triangle{{0, 0, 0}, {4, 0, 0}, {0, 4, 0}};
+    ray = {{1, 1, 2}, {0, 0, -2}};
+    REQUIRE(HasIntersection(ray, triangle, 0, 1));
+    REQUIRE(!HasIntersection(ray, triangle, 0, 1 - 1e-6));
+    REQUIRE(!HasIntersection(ray, triangle, 1 + 1e-6, 2));
+}
+
+TEST_CASE("Triangle batch", "[raytracer]") {
+    std::vector<Triangle> triangles;
+    for (int i = 0; i < 7; ++i) {
+        double z = -1. - 0.5 * ((i * 5) % 7);
+        triangles.push_back({{-2. + i * 0.3, -2., z}, {2., -2. + i * 0.2, z}, {0., 2., z + 0.1 * i}});
+    }
+    // Degenerate and parallel to most rays.
+    triangles.push_back({{0., 0., -1.}, {1., 0., -1.}, {2., 0., -1.}});
+    TriangleBatch batch;
+    for (const Triangle& triangle : triangles) {
+        batch.Add(triangle);
+    }
+
+    for (int i = 0; i < 200; ++i) {
+        Ray ray{{0.01 * i - 1, 0.013 * i - 1.3, 1.}, {0.002 * (i % 11) - 0.01, 0.001 * (i % 13), -1}};
+        for (auto [t_min, t_max] : {std::pair{0., DBL_MAX}, std::pair{3., 3.6}}) {
+            std::optional<Intersection> expected_hit;
+            int expected = -1;
+            for (size_t j = 0; j < triangles.size(); ++j) {
+                auto intersection = GetIntersection(ray, triangles[j]);
+                if (!intersection) {
+                    continue;
+                }
+                double t = intersection->GetT();
+                if (t >= t_min && t <= t_max && (expected < 0 || t < expected_hit->GetT())) {
+                    expected_hit = intersection;
+                    expected = j;
+                }
+            }
+            BatchHit scalar_hit, simd_hit;
+            int scalar = IntersectBatchScalar(ray, batch, t_min, t_max, &scalar_hit);
+            int simd = IntersectBatch(ray, batch, t_min, t_max, &simd_hit);
+            REQUIRE(scalar == expected);
+            REQUIRE(simd == scalar);
+            if (expected >= 0) {
+                REQUIRE(std::fabs(scalar_hit.t - expected_hit->GetT()) < kErr);
+                REQUIRE(std::fabs(scalar_hit.u - expected_hit->GetU()) < kErr);
+                REQUIRE(std::fabs(scalar_hit.v - expected_hit->GetV()) < kErr);
+                REQUIRE(simd_hit.t == scalar_hit.t);
+                REQUIRE(simd_hit.u == scalar_hit.u);
+                REQUIRE(simd_hit.v == scalar_hit.v);
+                // The barycentrics locate the hit point.
+                const Triangle& triangle = triangles[expected];
+                Vector p = triangle.GetVertex(0) +
+                           (triangle.GetVertex(1) - triangle.GetVertex(0)) * scalar_hit.u +
+                           (triangle.GetVertex(2) - triangle.GetVertex(0)) * scalar_hit.v;
+                REQUIRE(Length(p - expected_hit->GetPosition()) < kErr);
+            }
+        }
+    }
+
+    TriangleBatch empty;
+    BatchHit hit;
+    REQUIRE(IntersectBatch({{0, 0, 1}, {0, 0, -1}}, empty, 0, DBL_MAX, &hit) == -1);
+}
+
+TEST_CASE("Single precision", "[raytracer]") {
+    using FloatVector = BasicVector<float>;
+    const BasicSphere<float> sphere({0, 0, -5}, 1);
+    const BasicRay<float> ray({0.1, 0.2, 0}, {0, 0, -1});
+    auto sphere_hit = GetIntersection(ray, sphere);
+    auto exact_hit = GetIntersection(BasicRay<double>({0.1, 0.2, 0}, {0, 0, -1}),
+                                     BasicSphere<double>({0, 0, -5}, 1));
+    REQUIRE(sphere_hit.has_value());
+    REQUIRE(std::fabs(sphere_hit->GetDistance() - exact_hit->GetDistance()) < 1e-5);
+
+    std::vector<BasicTriangle<float>> triangles;
+    std::vector<BasicTriangle<double>> exact_triangles;
+    BasicTriangleBatch<float> batch;
+    for (int i = 0; i < 8; ++i) {
+        double z = -1. - 0.5 * ((i * 5) % 7);
+        BasicVector<double> a{-2. + i * 0.3, -2., z}, b{2., -2. + i * 0.2, z};
+        BasicVector<double> c{0., 2., z + 0.1 * i};
+        exact_triangles.push_back({a, b, c});
+        triangles.push_back({FloatVector(a), FloatVector(b), FloatVector(c)});
+        batch.Add(triangles.back());
+    }
+    for (int i = 0; i < 200; ++i) {
+        BasicVector<double> origin{0.01 * i - 1, 0.013 * i - 1.3, 1.};
+        BasicVector<double> direction{0.002 * (i % 11) - 0.01, 0.001 * (i % 13), -1};
+        const BasicRay<float> float_ray{FloatVector(origin), FloatVector(direction)};
+        BatchHit scalar_hit, simd_hit;
+        int scalar = IntersectBatchScalar(float_ray, batch, 0, DBL_MAX, &scalar_hit);
+        int simd = IntersectBatch(float_ray, batch, 0, DBL_MAX, &simd_hit);
+        REQUIRE(simd == scalar);
+        if (scalar < 0) {
+            continue;
+        }
+        REQUIRE(simd_hit.t == scalar_hit.t);
+        REQUIRE(simd_hit.u == scalar_hit.u);
+        REQUIRE(simd_hit.v == scalar_hit.v);
+        auto exact = GetIntersection(BasicRay<double>(origin, direction), exact_triangles[scalar]);
+        REQUIRE(exact.has_value());
+        REQUIRE(std::fabs(scalar_hit.t - exact->GetT()) < 1e-5);
+    }
+}
+
+TEST_CASE("Ray packet", "[raytracer]") {
+    std::vector<Triangle> triangles;
+    std::vector<BoundingBox> boxes;
+    for (int i = 0; i < 10; ++i) {
+        for (int j = 0; j < 10; ++j) {
+            double x = i - 5, y = j - 5, z = -3 - (i + j) % 4;
+            triangles.push_back({{x, y, z}, {x + 1, y, z}, {x, y + 1, z + 0.5}});
+            boxes.push_back(GetBoundingBox(triangles.back()));
+        }
+    }
+    Bvh bvh(boxes);
+    auto closest = [&](const Ray& ray, uint32_t primitive, double t_max) {
+        auto intersection = GetIntersection(ray, triangles[primitive]);
+        if (intersection) {
+            return std::min(t_max, intersection->GetDistance() / Length(ray.GetDirection()));
+        }
+        return t_max;
+    };
+
+    std::vector<Ray> rays;
+    for (int x = 0; x < 8; ++x) {
+        for (int y = 0; y < 8; ++y) {
+            rays.push_back({{0.5, 0.5, 0}, {0.1 * x - 0.3, 0.1 * y - 0.5, -1}});
+        }
+    }
+    RayPacket packet;
+    for (const Ray& ray : rays) {
+        packet.Add(ray);
+    }
+    std::vector<double> t_max(rays.size(), DBL_MAX);
+    bvh.TraversePacket(packet, t_max.data(), [&](uint32_t node, int first) {
+        const BvhNode& leaf = bvh.GetNodes()[node];
+        for (int i = first; i < packet.Size(); ++i) {
+            for (uint32_t j = leaf.offset; j < leaf.offset + leaf.count; ++j) {
+                t_max[i] = closest(packet.GetRay(i), bvh.GetPrimitives()[j], t_max[i]);
+            }
+        }
+    });
+    for (size_t i = 0; i < rays.size(); ++i) {
+        double expected = DBL_MAX;
+        bvh.Traverse(rays[i], DBL_MAX, [&](uint32_t primitive, double t) {
+            expected = closest(rays[i], primitive, t);
+            return expected;
+        });
+        REQUIRE(t_max[i] == expected);
+    }
+
+    BoundingBox behind({-1, -1, 1}, {1, 1, 2});
+    REQUIRE(packet.MissesBox(behind, DBL_MAX));
+    REQUIRE(packet.FirstHit(behind, 0, t_max.data()) == packet.Size());
+    REQUIRE(!packet.MissesBox(boxes[0], DBL_MAX));
+}
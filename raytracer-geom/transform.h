@@ -0,0 +1,90 @@
+#pragma once
+
+#include <vector.h>
+#include <bounding_box.h>
+#include <ray.h>
+
+#include <array>
+
+// Affine transform given by the top 3x4 block of a row-major 4x4 matrix.
+class Transform {
+public:
+    Transform() : rows_({1, 0, 0, 0, 0, 1, 0, 0, 0, 0, 1, 0}) {
+    }
+    explicit Transform(std::array<double, 12> rows) : rows_(rows) {
+    }
+
+    static Transform Translation(const Vector& offset) {
+        return Transform({1, 0, 0, offset[0], 0, 1, 0, offset[1], 0, 0, 1, offset[2]});
+    }
+    static Transform TranslationScale(const Vector& offset, double scale) {
+        return Transform(
+            {scale, 0, 0, offset[0], 0, scale, 0, offset[1], 0, 0, scale, offset[2]});
+    }
+
+    double At(int row, int column) const {
+        return rows_[row * 4 + column];
+    }
+
+    Vector ApplyToPoint(const Vector& p) const {
+        return ApplyToDirection(p) + Vector{At(0, 3), At(1, 3), At(2, 3)};
+    }
+    Vector ApplyToDirection(const Vector& d) const {
+        return {At(0, 0) * d[0] + At(0, 1) * d[1] + At(0, 2) * d[2],
+                At(1, 0) * d[0] + At(1, 1) * d[1] + At(1, 2) * d[2],
+                At(2, 0) * d[0] + At(2, 1) * d[1] + At(2, 2) * d[2]};
+    }
+    // Normals go through the transposed linear part; call it on the inverse transform.
+    Vector ApplyToNormalTransposed(const Vector& n) const {
+        Vector result{At(0, 0) * n[0] + At(1, 0) * n[1] + At(2, 0) * n[2],
+                      At(0, 1) * n[0] + At(1, 1) * n[1] + At(2, 1) * n[2],
+                      At(0, 2) * n[0] + At(1, 2) * n[1] + At(2, 2) * n[2]};
+        result.Normalize();
+        return result;
+    }
+    // Both ends of the ray move, so the ray parameter of every hit stays the same.
+    Ray ApplyToRay(const Ray& ray) const {
+        return Ray(ApplyToPoint(ray.GetOrigin()), ApplyToDirection(ray.GetDirection()));
+    }
+    BoundingBox ApplyToBox(const BoundingBox& box) const {
+        BoundingBox result;
+        if (box.IsEmpty()) {
+            return result;
+        }
+        for (int corner = 0; corner < 8; ++corner) {
+            result.Extend(ApplyToPoint({corner & 1 ? box.GetMax()[0] : box.GetMin()[0],
+                                        corner & 2 ? box.GetMax()[1] : box.GetMin()[1],
+                                        corner & 4 ? box.GetMax()[2] : box.GetMin()[2]}));
+        }
+        return result;
+    }
+
+    // Of the linear part: 0 for a transform that has no inverse.
+    double Determinant() const {
+        return At(0, 0) * (At(1, 1) * At(2, 2) - At(1, 2) * At(2, 1)) -
+               At(0, 1) * (At(1, 0) * At(2, 2) - At(1, 2) * At(2, 0)) +
+               At(0, 2) * (At(1, 0) * At(2, 1) - At(1, 1) * At(2, 0));
+    }
+    Transform Inverse() const {
+        // Inverse of the linear part by cofactors, then the translation.
+        double a = At(0, 0), b = At(0, 1), c = At(0, 2);
+        double d = At(1, 0), e = At(1, 1), f = At(1, 2);
+        double g = At(2, 0), h = At(2, 1), i = At(2, 2);
+        double k = 1 / Determinant();
+        std::array<double, 12> inverse = {(e * i - f * h) * k, (c * h - b * i) * k,
+                                          (b * f - c * e) * k, 0,
+                                          (f * g - d * i) * k, (a * i - c * g) * k,
+                                          (c * d - a * f) * k, 0,
+                                          (d * h - e * g) * k, (b * g - a * h) * k,
+                                          (a * e - b * d) * k, 0};
+        Transform result(inverse);
+        Vector offset = result.ApplyToDirection({At(0, 3), At(1, 3), At(2, 3)});
+        for (int row = 0; row < 3; ++row) {
+            result.rows_[row * 4 + 3] = -offset[row];
+        }
+        return result;
+    }
+
+private:
+    std::array<double, 12> rows_;
+};
@@ -4,35 +4,39 @@
 #include <vector.h>
 #include <cmath>
 
-class Triangle {
+template <class T>
+class BasicTriangle {
 public:
     //    Triangle() : vertices_({Vector{0,0,0},Vector{0,0,0},Vector{0,0,0}}){
     //    }
-    Triangle() {
+    BasicTriangle() {
     }
-    Triangle(std::initializer_list<Vector> list) {
+    BasicTriangle(std::initializer_list<BasicVector<T>> list) {
         auto d = data(list);
         vertices_ = {d[0], d[1], d[2]};
     }
-    Vector GetNormal() const {
-        Vector a = vertices_[2] - vertices_[0];
-        Vector b = vertices_[1] - vertices_[0];
-        Vector normal = CrossProduct(a, b);
+    BasicVector<T> GetNormal() const {
+        BasicVector<T> a = vertices_[2] - vertices_[0];
+        BasicVector<T> b = vertices_[1] - vertices_[0];
+        BasicVector<T> normal = CrossProduct(a, b);
         normal.Normalize();
         return normal;
     }
 
-    double Area() const {
-        Vector a = vertices_[2] - vertices_[0];
-        Vector b = vertices_[1] - vertices_[0];
-        return fabs(Length(CrossProduct(a, b))) / 2;
+    T Area() const {
+        BasicVector<T> a = vertices_[2] - vertices_[0];
+        BasicVector<T> b = vertices_[1] - vertices_[0];
+        return std::fabs(Length(CrossProduct(a, b))) / 2;
     }
 
-    const Vector& GetVertex(size_t ind) const {
+    const BasicVector<T>& GetVertex(size_t ind) const {
         return vertices_[ind];
     }
 
 
 private:
-    std::array<Vector, 3> vertices_ = {Vector(), Vector(), Vector()};
+    std::array<BasicVector<T>, 3> vertices_ = {BasicVector<T>(), BasicVector<T>(),
+                                               BasicVector<T>()};
 };
+
+using Triangle = BasicTriangle<Scalar>;
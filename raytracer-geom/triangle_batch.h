@@ -0,0 +1,392 @@
+#pragma once
+
+#include <geometry.h>
+
+#include <cfloat>
+#include <limits>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE2__)
+#include <immintrin.h>
+#endif
+
+// Up to kSize triangles transposed into structure-of-arrays form: coordinate `i` of the first
+// vertex of triangle `j` is `vertex0[i][j]`. Edges are stored instead of the other two vertices,
+// exactly as GetIntersection computes them. Unused lanes hold degenerate triangles. A float
+// batch fills one AVX register per coordinate where a double batch needs two.
+template <class T>
+struct BasicTriangleBatch {
+    static constexpr int kSize = 8;
+
+    alignas(32) T vertex0[3][kSize] = {};
+    alignas(32) T edge1[3][kSize] = {};
+    alignas(32) T edge2[3][kSize] = {};
+    int count = 0;
+
+    void Set(int lane, const BasicTriangle<T>& triangle) {
+        for (int i = 0; i < 3; ++i) {
+            vertex0[i][lane] = triangle.GetVertex(0)[i];
+            edge1[i][lane] = triangle.GetVertex(1)[i] - triangle.GetVertex(0)[i];
+            edge2[i][lane] = triangle.GetVertex(2)[i] - triangle.GetVertex(0)[i];
+        }
+    }
+    void Add(const BasicTriangle<T>& triangle) {
+        Set(count++, triangle);
+    }
+};
+
+using TriangleBatch = BasicTriangleBatch<Scalar>;
+
+constexpr double kBatchMiss = std::numeric_limits<double>::infinity();
+
+// Möller–Trumbore on one lane, in the same order of operations as GetIntersection. Also stores
+// the barycentric coordinates of the hit point along the two edges.
+template <class T>
+inline T IntersectBatchLane(const BasicRay<T>& ray, const BasicTriangleBatch<T>& batch, int j,
+                            T* u, T* v) {
+    const BasicVector<T>& d = ray.GetDirection();
+    const BasicVector<T>& o = ray.GetOrigin();
+    BasicVector<T> e1{batch.edge1[0][j], batch.edge1[1][j], batch.edge1[2][j]};
+    BasicVector<T> e2{batch.edge2[0][j], batch.edge2[1][j], batch.edge2[2][j]};
+    BasicVector<T> h = CrossProduct(d, e2);
+    T a = DotProduct(e1, h);
+    if (a > -kMykErr && a < kMykErr) {
+        return kBatchMiss;
+    }
+    T f = T(1) / a;
+    BasicVector<T> s{o[0] - batch.vertex0[0][j], o[1] - batch.vertex0[1][j],
+                     o[2] - batch.vertex0[2][j]};
+    *u = f * DotProduct(s, h);
+    if (*u < 0.0 || *u > 1.0) {
+        return kBatchMiss;
+    }
+    BasicVector<T> q = CrossProduct(s, e1);
+    *v = f * DotProduct(d, q);
+    if (*v < 0.0 || *u + *v > 1.0) {
+        return kBatchMiss;
+    }
+    return f * DotProduct(e2, q);
+}
+
+// Where a ray hits a batch: ray parameter and barycentric coordinates (u, v) of the hit point,
+// which is vertex0 + u * edge1 + v * edge2.
+struct BatchHit {
+    double t;
+    double u;
+    double v;
+};
+
+// Reference implementation: nearest hit with t > kMykErr inside [t_min, t_max]. Returns the
+// lane of that triangle and stores the hit, or returns -1 if no lane is hit.
+template <class T>
+inline int IntersectBatchScalar(const std::type_identity_t<BasicRay<T>>& ray,
+                                const BasicTriangleBatch<T>& batch, double t_min, double t_max,
+                                BatchHit* hit) {
+    // Limits rounded to T, as the SIMD kernels compare them.
+    const T low = t_min, high = std::min<double>(t_max, std::numeric_limits<T>::max());
+    int best = -1;
+    BatchHit best_hit{kBatchMiss, 0, 0};
+    for (int j = 0; j < batch.count; ++j) {
+        T u = 0, v = 0;
+        T lane_t = IntersectBatchLane(ray, batch, j, &u, &v);
+        if (lane_t > kMykErr && lane_t >= low && lane_t <= high && lane_t < best_hit.t) {
+            best_hit = {lane_t, u, v};
+            best = j;
+        }
+    }
+    if (best >= 0) {
+        *hit = best_hit;
+    }
+    return best;
+}
+
+// Reduction shared by the SIMD kernels, whose lanes already hold kBatchMiss for every miss.
+template <class T>
+inline int NearestLane(const T* lane_t, const T* lane_u, const T* lane_v, int count,
+                       BatchHit* hit) {
+    int best = -1;
+    T best_t = kBatchMiss;
+    for (int j = 0; j < count; ++j) {
+        if (lane_t[j] < best_t) {
+            best_t = lane_t[j];
+            best = j;
+        }
+    }
+    if (best >= 0) {
+        *hit = {best_t, lane_u[best], lane_v[best]};
+    }
+    return best;
+}
+
+#if defined(__AVX2__)
+
+inline int IntersectBatchAvx2(const BasicRay<double>& ray, const BasicTriangleBatch<double>& batch,
+                              double t_min, double t_max, BatchHit* hit) {
+    constexpr int kWidth = 4;
+    const BasicVector<double>& d = ray.GetDirection();
+    const BasicVector<double>& o = ray.GetOrigin();
+    const __m256d dx = _mm256_set1_pd(d[0]), dy = _mm256_set1_pd(d[1]), dz = _mm256_set1_pd(d[2]);
+    const __m256d ox = _mm256_set1_pd(o[0]), oy = _mm256_set1_pd(o[1]), oz = _mm256_set1_pd(o[2]);
+    const __m256d zero = _mm256_setzero_pd(), one = _mm256_set1_pd(1.0);
+    const __m256d eps = _mm256_set1_pd(kMykErr), minus_eps = _mm256_set1_pd(-kMykErr);
+    const __m256d low = _mm256_set1_pd(std::max(t_min, kMykErr)), high = _mm256_set1_pd(t_max);
+    const __m256d miss = _mm256_set1_pd(kBatchMiss);
+
+    alignas(32) double lane_t[BasicTriangleBatch<double>::kSize];
+    alignas(32) double lane_u[BasicTriangleBatch<double>::kSize];
+    alignas(32) double lane_v[BasicTriangleBatch<double>::kSize];
+    for (int j = 0; j < batch.count; j += kWidth) {
+        __m256d e1x = _mm256_load_pd(&batch.edge1[0][j]);
+        __m256d e1y = _mm256_load_pd(&batch.edge1[1][j]);
+        __m256d e1z = _mm256_load_pd(&batch.edge1[2][j]);
+        __m256d e2x = _mm256_load_pd(&batch.edge2[0][j]);
+        __m256d e2y = _mm256_load_pd(&batch.edge2[1][j]);
+        __m256d e2z = _mm256_load_pd(&batch.edge2[2][j]);
+
+        __m256d hx = _mm256_sub_pd(_mm256_mul_pd(dy, e2z), _mm256_mul_pd(dz, e2y));
+        __m256d hy = _mm256_sub_pd(_mm256_mul_pd(dz, e2x), _mm256_mul_pd(dx, e2z));
+        __m256d hz = _mm256_sub_pd(_mm256_mul_pd(dx, e2y), _mm256_mul_pd(dy, e2x));
+        __m256d a = _mm256_add_pd(
+            _mm256_add_pd(_mm256_mul_pd(e1x, hx), _mm256_mul_pd(e1y, hy)), _mm256_mul_pd(e1z, hz));
+        __m256d mask = _mm256_or_pd(_mm256_cmp_pd(a, minus_eps, _CMP_LE_OQ),
+                                    _mm256_cmp_pd(a, eps, _CMP_GE_OQ));
+        __m256d f = _mm256_div_pd(one, a);
+
+        __m256d sx = _mm256_sub_pd(ox, _mm256_load_pd(&batch.vertex0[0][j]));
+        __m256d sy = _mm256_sub_pd(oy, _mm256_load_pd(&batch.vertex0[1][j]));
+        __m256d sz = _mm256_sub_pd(oz, _mm256_load_pd(&batch.vertex0[2][j]));
+        __m256d u = _mm256_mul_pd(
+            f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(sx, hx), _mm256_mul_pd(sy, hy)),
+                             _mm256_mul_pd(sz, hz)));
+        mask = _mm256_and_pd(mask, _mm256_cmp_pd(u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_pd(mask, _mm256_cmp_pd(u, one, _CMP_LE_OQ));
+
+        __m256d qx = _mm256_sub_pd(_mm256_mul_pd(sy, e1z), _mm256_mul_pd(sz, e1y));
+        __m256d qy = _mm256_sub_pd(_mm256_mul_pd(sz, e1x), _mm256_mul_pd(sx, e1z));
+        __m256d qz = _mm256_sub_pd(_mm256_mul_pd(sx, e1y), _mm256_mul_pd(sy, e1x));
+        __m256d v = _mm256_mul_pd(
+            f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(dx, qx), _mm256_mul_pd(dy, qy)),
+                             _mm256_mul_pd(dz, qz)));
+        mask = _mm256_and_pd(mask, _mm256_cmp_pd(v, zero, _CMP_GE_OQ));
+        mask = _mm256_and_pd(mask, _mm256_cmp_pd(_mm256_add_pd(u, v), one, _CMP_LE_OQ));
+
+        __m256d lane = _mm256_mul_pd(
+            f, _mm256_add_pd(_mm256_add_pd(_mm256_mul_pd(e2x, qx), _mm256_mul_pd(e2y, qy)),
+                             _mm256_mul_pd(e2z, qz)));
+        mask = _mm256_and_pd(mask, _mm256_cmp_pd(lane, eps, _CMP_GT_OQ));
+        mask = _mm256_and_pd(mask, _mm256_cmp_pd(lane, low, _CMP_GE_OQ));
+        mask = _mm256_and_pd(mask, _mm256_cmp_pd(lane, high, _CMP_LE_OQ));
+        _mm256_store_pd(&lane_t[j], _mm256_blendv_pd(miss, lane, mask));
+        _mm256_store_pd(&lane_u[j], u);
+        _mm256_store_pd(&lane_v[j], v);
+    }
+
+    return NearestLane(lane_t, lane_u, lane_v, batch.count, hit);
+}
+
+
+// The same in single precision: all eight lanes of a batch in one pass.
+inline int IntersectBatchAvx2(const BasicRay<float>& ray, const BasicTriangleBatch<float>& batch,
+                              double t_min, double t_max, BatchHit* hit) {
+    constexpr int kWidth = 8;
+    const BasicVector<float>& d = ray.GetDirection();
+    const BasicVector<float>& o = ray.GetOrigin();
+    const __m256 dx = _mm256_set1_ps(d[0]), dy = _mm256_set1_ps(d[1]), dz = _mm256_set1_ps(d[2]);
+    const __m256 ox = _mm256_set1_ps(o[0]), oy = _mm256_set1_ps(o[1]), oz = _mm256_set1_ps(o[2]);
+    const __m256 zero = _mm256_setzero_ps(), one = _mm256_set1_ps(1.0f);
+    const __m256 eps = _mm256_set1_ps(kMykErr), minus_eps = _mm256_set1_ps(-kMykErr);
+    const __m256 low = _mm256_set1_ps(std::max(t_min, kMykErr));
+    const __m256 high = _mm256_set1_ps(std::min<double>(t_max, FLT_MAX));
+    const __m256 miss = _mm256_set1_ps(kBatchMiss);
+
+    alignas(32) float lane_t[BasicTriangleBatch<float>::kSize];
+    alignas(32) float lane_u[BasicTriangleBatch<float>::kSize];
+    alignas(32) float lane_v[BasicTriangleBatch<float>::kSize];
+    for (int j = 0; j < batch.count; j += kWidth) {
+        __m256 e1x = _mm256_load_ps(&batch.edge1[0][j]);
+        __m256 e1y = _mm256_load_ps(&batch.edge1[1][j]);
+        __m256 e1z = _mm256_load_ps(&batch.edge1[2][j]);
+        __m256 e2x = _mm256_load_ps(&batch.edge2[0][j]);
+        __m256 e2y = _mm256_load_ps(&batch.edge2[1][j]);
+        __m256 e2z = _mm256_load_ps(&batch.edge2[2][j]);
+
+        __m256 hx = _mm256_sub_ps(_mm256_mul_ps(dy, e2z), _mm256_mul_ps(dz, e2y));
+        __m256 hy = _mm256_sub_ps(_mm256_mul_ps(dz, e2x), _mm256_mul_ps(dx, e2z));
+        __m256 hz = _mm256_sub_ps(_mm256_mul_ps(dx, e2y), _mm256_mul_ps(dy, e2x));
+        __m256 a = _mm256_add_ps(
+            _mm256_add_ps(_mm256_mul_ps(e1x, hx), _mm256_mul_ps(e1y, hy)), _mm256_mul_ps(e1z, hz));
+        __m256 mask = _mm256_or_ps(_mm256_cmp_ps(a, minus_eps, _CMP_LE_OQ),
+                                   _mm256_cmp_ps(a, eps, _CMP_GE_OQ));
+        __m256 f = _mm256_div_ps(one, a);
+
+        __m256 sx = _mm256_sub_ps(ox, _mm256_load_ps(&batch.vertex0[0][j]));
+        __m256 sy = _mm256_sub_ps(oy, _mm256_load_ps(&batch.vertex0[1][j]));
+        __m256 sz = _mm256_sub_ps(oz, _mm256_load_ps(&batch.vertex0[2][j]));
+        __m256 u = _mm256_mul_ps(
+            f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(sx, hx), _mm256_mul_ps(sy, hy)),
+                             _mm256_mul_ps(sz, hz)));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(u, one, _CMP_LE_OQ));
+
+        __m256 qx = _mm256_sub_ps(_mm256_mul_ps(sy, e1z), _mm256_mul_ps(sz, e1y));
+        __m256 qy = _mm256_sub_ps(_mm256_mul_ps(sz, e1x), _mm256_mul_ps(sx, e1z));
+        __m256 qz = _mm256_sub_ps(_mm256_mul_ps(sx, e1y), _mm256_mul_ps(sy, e1x));
+        __m256 v = _mm256_mul_ps(
+            f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(dx, qx), _mm256_mul_ps(dy, qy)),
+                             _mm256_mul_ps(dz, qz)));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(v, zero, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(_mm256_add_ps(u, v), one, _CMP_LE_OQ));
+
+        __m256 lane = _mm256_mul_ps(
+            f, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(e2x, qx), _mm256_mul_ps(e2y, qy)),
+                             _mm256_mul_ps(e2z, qz)));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(lane, eps, _CMP_GT_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(lane, low, _CMP_GE_OQ));
+        mask = _mm256_and_ps(mask, _mm256_cmp_ps(lane, high, _CMP_LE_OQ));
+        _mm256_store_ps(&lane_t[j], _mm256_blendv_ps(miss, lane, mask));
+        _mm256_store_ps(&lane_u[j], u);
+        _mm256_store_ps(&lane_v[j], v);
+    }
+
+    return NearestLane(lane_t, lane_u, lane_v, batch.count, hit);
+}
+
+#elif defined(__SSE2__)
+
+inline int IntersectBatchSse2(const BasicRay<double>& ray, const BasicTriangleBatch<double>& batch,
+                              double t_min, double t_max, BatchHit* hit) {
+    constexpr int kWidth = 2;
+    const BasicVector<double>& d = ray.GetDirection();
+    const BasicVector<double>& o = ray.GetOrigin();
+    const __m128d dx = _mm_set1_pd(d[0]), dy = _mm_set1_pd(d[1]), dz = _mm_set1_pd(d[2]);
+    const __m128d ox = _mm_set1_pd(o[0]), oy = _mm_set1_pd(o[1]), oz = _mm_set1_pd(o[2]);
+    const __m128d zero = _mm_setzero_pd(), one = _mm_set1_pd(1.0);
+    const __m128d eps = _mm_set1_pd(kMykErr), minus_eps = _mm_set1_pd(-kMykErr);
+    const __m128d low = _mm_set1_pd(std::max(t_min, kMykErr)), high = _mm_set1_pd(t_max);
+    const __m128d miss = _mm_set1_pd(kBatchMiss);
+
+    alignas(16) double lane_t[BasicTriangleBatch<double>::kSize];
+    alignas(16) double lane_u[BasicTriangleBatch<double>::kSize];
+    alignas(16) double lane_v[BasicTriangleBatch<double>::kSize];
+    for (int j = 0; j < batch.count; j += kWidth) {
+        __m128d e1x = _mm_load_pd(&batch.edge1[0][j]);
+        __m128d e1y = _mm_load_pd(&batch.edge1[1][j]);
+        __m128d e1z = _mm_load_pd(&batch.edge1[2][j]);
+        __m128d e2x = _mm_load_pd(&batch.edge2[0][j]);
+        __m128d e2y = _mm_load_pd(&batch.edge2[1][j]);
+        __m128d e2z = _mm_load_pd(&batch.edge2[2][j]);
+
+        __m128d hx = _mm_sub_pd(_mm_mul_pd(dy, e2z), _mm_mul_pd(dz, e2y));
+        __m128d hy = _mm_sub_pd(_mm_mul_pd(dz, e2x), _mm_mul_pd(dx, e2z));
+        __m128d hz = _mm_sub_pd(_mm_mul_pd(dx, e2y), _mm_mul_pd(dy, e2x));
+        __m128d a = _mm_add_pd(_mm_add_pd(_mm_mul_pd(e1x, hx), _mm_mul_pd(e1y, hy)),
+                               _mm_mul_pd(e1z, hz));
+        __m128d mask = _mm_or_pd(_mm_cmple_pd(a, minus_eps), _mm_cmpge_pd(a, eps));
+        __m128d f = _mm_div_pd(one, a);
+
+        __m128d sx = _mm_sub_pd(ox, _mm_load_pd(&batch.vertex0[0][j]));
+        __m128d sy = _mm_sub_pd(oy, _mm_load_pd(&batch.vertex0[1][j]));
+        __m128d sz = _mm_sub_pd(oz, _mm_load_pd(&batch.vertex0[2][j]));
+        __m128d u = _mm_mul_pd(
+            f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(sx, hx), _mm_mul_pd(sy, hy)), _mm_mul_pd(sz, hz)));
+        mask = _mm_and_pd(mask, _mm_cmpge_pd(u, zero));
+        mask = _mm_and_pd(mask, _mm_cmple_pd(u, one));
+
+        __m128d qx = _mm_sub_pd(_mm_mul_pd(sy, e1z), _mm_mul_pd(sz, e1y));
+        __m128d qy = _mm_sub_pd(_mm_mul_pd(sz, e1x), _mm_mul_pd(sx, e1z));
+        __m128d qz = _mm_sub_pd(_mm_mul_pd(sx, e1y), _mm_mul_pd(sy, e1x));
+        __m128d v = _mm_mul_pd(
+            f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(dx, qx), _mm_mul_pd(dy, qy)), _mm_mul_pd(dz, qz)));
+        mask = _mm_and_pd(mask, _mm_cmpge_pd(v, zero));
+        mask = _mm_and_pd(mask, _mm_cmple_pd(_mm_add_pd(u, v), one));
+
+        __m128d lane = _mm_mul_pd(f, _mm_add_pd(_mm_add_pd(_mm_mul_pd(e2x, qx), _mm_mul_pd(e2y, qy)),
+                                                _mm_mul_pd(e2z, qz)));
+        mask = _mm_and_pd(mask, _mm_cmpgt_pd(lane, eps));
+        mask = _mm_and_pd(mask, _mm_cmpge_pd(lane, low));
+        mask = _mm_and_pd(mask, _mm_cmple_pd(lane, high));
+        _mm_store_pd(&lane_t[j], _mm_or_pd(_mm_and_pd(mask, lane), _mm_andnot_pd(mask, miss)));
+        _mm_store_pd(&lane_u[j], u);
+        _mm_store_pd(&lane_v[j], v);
+    }
+
+    return NearestLane(lane_t, lane_u, lane_v, batch.count, hit);
+}
+
+
+inline int IntersectBatchSse2(const BasicRay<float>& ray, const BasicTriangleBatch<float>& batch,
+                              double t_min, double t_max, BatchHit* hit) {
+    constexpr int kWidth = 4;
+    const BasicVector<float>& d = ray.GetDirection();
+    const BasicVector<float>& o = ray.GetOrigin();
+    const __m128 dx = _mm_set1_ps(d[0]), dy = _mm_set1_ps(d[1]), dz = _mm_set1_ps(d[2]);
+    const __m128 ox = _mm_set1_ps(o[0]), oy = _mm_set1_ps(o[1]), oz = _mm_set1_ps(o[2]);
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+    const __m128 eps = _mm_set1_ps(kMykErr), minus_eps = _mm_set1_ps(-kMykErr);
+    const __m128 low = _mm_set1_ps(std::max(t_min, kMykErr));
+    const __m128 high = _mm_set1_ps(std::min<double>(t_max, FLT_MAX));
+    const __m128 miss = _mm_set1_ps(kBatchMiss);
+
+    alignas(16) float lane_t[BasicTriangleBatch<float>::kSize];
+    alignas(16) float lane_u[BasicTriangleBatch<float>::kSize];
+    alignas(16) float lane_v[BasicTriangleBatch<float>::kSize];
+    for (int j = 0; j < batch.count; j += kWidth) {
+        __m128 e1x = _mm_load_ps(&batch.edge1[0][j]);
+        __m128 e1y = _mm_load_ps(&batch.edge1[1][j]);
+        __m128 e1z = _mm_load_ps(&batch.edge1[2][j]);
+        __m128 e2x = _mm_load_ps(&batch.edge2[0][j]);
+        __m128 e2y = _mm_load_ps(&batch.edge2[1][j]);
+        __m128 e2z = _mm_load_ps(&batch.edge2[2][j]);
+
+        __m128 hx = _mm_sub_ps(_mm_mul_ps(dy, e2z), _mm_mul_ps(dz, e2y));
+        __m128 hy = _mm_sub_ps(_mm_mul_ps(dz, e2x), _mm_mul_ps(dx, e2z));
+        __m128 hz = _mm_sub_ps(_mm_mul_ps(dx, e2y), _mm_mul_ps(dy, e2x));
+        __m128 a = _mm_add_ps(_mm_add_ps(_mm_mul_ps(e1x, hx), _mm_mul_ps(e1y, hy)),
+                              _mm_mul_ps(e1z, hz));
+        __m128 mask = _mm_or_ps(_mm_cmple_ps(a, minus_eps), _mm_cmpge_ps(a, eps));
+        __m128 f = _mm_div_ps(one, a);
+
+        __m128 sx = _mm_sub_ps(ox, _mm_load_ps(&batch.vertex0[0][j]));
+        __m128 sy = _mm_sub_ps(oy, _mm_load_ps(&batch.vertex0[1][j]));
+        __m128 sz = _mm_sub_ps(oz, _mm_load_ps(&batch.vertex0[2][j]));
+        __m128 u = _mm_mul_ps(
+            f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(sx, hx), _mm_mul_ps(sy, hy)), _mm_mul_ps(sz, hz)));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(u, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(u, one));
+
+        __m128 qx = _mm_sub_ps(_mm_mul_ps(sy, e1z), _mm_mul_ps(sz, e1y));
+        __m128 qy = _mm_sub_ps(_mm_mul_ps(sz, e1x), _mm_mul_ps(sx, e1z));
+        __m128 qz = _mm_sub_ps(_mm_mul_ps(sx, e1y), _mm_mul_ps(sy, e1x));
+        __m128 v = _mm_mul_ps(
+            f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, qx), _mm_mul_ps(dy, qy)), _mm_mul_ps(dz, qz)));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(v, zero));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(_mm_add_ps(u, v), one));
+
+        __m128 lane = _mm_mul_ps(f, _mm_add_ps(_mm_add_ps(_mm_mul_ps(e2x, qx), _mm_mul_ps(e2y, qy)),
+                                               _mm_mul_ps(e2z, qz)));
+        mask = _mm_and_ps(mask, _mm_cmpgt_ps(lane, eps));
+        mask = _mm_and_ps(mask, _mm_cmpge_ps(lane, low));
+        mask = _mm_and_ps(mask, _mm_cmple_ps(lane, high));
+        _mm_store_ps(&lane_t[j], _mm_or_ps(_mm_and_ps(mask, lane), _mm_andnot_ps(mask, miss)));
+        _mm_store_ps(&lane_u[j], u);
+        _mm_store_ps(&lane_v[j], v);
+    }
+
+    return NearestLane(lane_t, lane_u, lane_v, batch.count, hit);
+}
+
+#endif
+
+// The widest kernel the target was compiled for.
+template <class T>
+inline int IntersectBatch(const std::type_identity_t<BasicRay<T>>& ray,
+                          const BasicTriangleBatch<T>& batch, double t_min, double t_max,
+                          BatchHit* hit) {
+#if defined(__AVX2__)
+    return IntersectBatchAvx2(ray, batch, t_min, t_max, hit);
+#elif defined(__SSE2__)
+    return IntersectBatchSse2(ray, batch, t_min, t_max, hit);
+#else
+    return IntersectBatchScalar<T>(ray, batch, t_min, t_max, hit);
+#endif
+}
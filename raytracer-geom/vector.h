@@ -5,63 +5,197 @@
 #include <iostream>
 #include <initializer_list>
 #include <algorithm>
+#include <type_traits>
+
+#if defined(__SSE__)
+#include <immintrin.h>
+#endif
+
+// Scalar type of the whole render pipeline, picked per build: define RAYTRACER_FLOAT for single
+// precision. The geometry types below are templates over it, so both precisions can be used
+// side by side; the unqualified names (Vector, Ray, ...) refer to the build's precision.
+#ifdef RAYTRACER_FLOAT
+using Scalar = float;
+#else
+using Scalar = double;
+#endif
+
+// Storage of x, y and z. Float packs them with a padding lane that no result reads into one
+// 16-byte SIMD register, which the compiler lowers to SSE2, or to scalar code on targets
+// without it, and keeps in registers across operations. Other types stay three plain values:
+// four double lanes would make every vertex and normal buffer a third larger, for no gain.
+template <class T>
+struct VectorStorage {
+    static constexpr bool kPacked = false;
+    using Type = std::array<T, 3>;
+};
+template <>
+struct VectorStorage<float> {
+    static constexpr bool kPacked = true;
+    typedef float Type __attribute__((vector_size(16)));
+};
+
+// 1 / sqrt(x): the hardware estimate refined by one Newton step for float, about 23 correct
+// bits. Double has no estimate below AVX-512.
+template <class T>
+inline T InverseSqrt(T x) {
+#if defined(__SSE__)
+    if constexpr (std::is_same_v<T, float>) {
+        float r = _mm_cvtss_f32(_mm_rsqrt_ss(_mm_set_ss(x)));
+        return r * (1.5f - 0.5f * x * r * r);
+    }
+#endif
+    return 1 / std::sqrt(x);
+}
+
+template <class T>
+class BasicVector {
+    static constexpr bool kPacked = VectorStorage<T>::kPacked;
+    using Storage = typename VectorStorage<T>::Type;
 
-class Vector {
 public:
-    Vector() : data_({0, 0, 0}) {
+    constexpr BasicVector() : data_(Make(0, 0, 0)) {
+    }
+    // Coordinates are given in double and rounded to T, so that literals and values computed
+    // in double work for either precision.
+    constexpr BasicVector(std::initializer_list<double> list)
+        : data_(Make(static_cast<T>(std::data(list)[0]), static_cast<T>(std::data(list)[1]),
+                     static_cast<T>(std::data(list)[2]))) {
     }
-    Vector(std::initializer_list<double> list) {
-        auto my_data = data(list);
-        data_ = {my_data[0], my_data[1], my_data[2]};
+    constexpr BasicVector(std::array<T, 3> data) : data_(Make(data[0], data[1], data[2])) {
     }
-    Vector(std::array<double, 3> data) : data_(data) {
+    template <class U>
+        requires(!std::is_same_v<U, T>)
+    constexpr BasicVector(const std::array<U, 3>& data)
+        : data_(Make(static_cast<T>(data[0]), static_cast<T>(data[1]),
+                     static_cast<T>(data[2]))) {
+    }
+    template <class U>
+    constexpr explicit BasicVector(const BasicVector<U>& other)
+        : data_(Make(static_cast<T>(other[0]), static_cast<T>(other[1]),
+                     static_cast<T>(other[2]))) {
     }
 
-    double& operator[](size_t ind) {
-        return data_[ind];
+    T& operator[](size_t ind) {
+        if constexpr (kPacked) {
+            return reinterpret_cast<T*>(&data_)[ind];
+        } else {
+            return data_[ind];
+        }
     };
-    double operator[](size_t ind) const {
+    constexpr T operator[](size_t ind) const {
         return data_[ind];
     };
-    Vector operator+(const Vector& other) const {
-        return {data_[0] + other[0], data_[1] + other[1], data_[2] + other[2]};
+
+    constexpr BasicVector& operator+=(const BasicVector& other) {
+        data_ = Apply(data_, other.data_, [](auto a, auto b) { return a + b; });
+        return *this;
+    }
+    constexpr BasicVector& operator-=(const BasicVector& other) {
+        data_ = Apply(data_, other.data_, [](auto a, auto b) { return a - b; });
+        return *this;
     }
-    Vector operator+=(const Vector& other) {
-        *this = *this + other;
+    constexpr BasicVector& operator*=(T k) {
+        data_ = Apply(data_, [k](auto a) { return a * k; });
         return *this;
     }
-    Vector operator*=(double k) {
-        *this = *this * k;
+    // Lane-wise product.
+    constexpr BasicVector& operator^=(const BasicVector& other) {
+        data_ = Apply(data_, other.data_, [](auto a, auto b) { return a * b; });
         return *this;
     }
-    Vector operator-(const Vector& other) const {
-        return {data_[0] - other[0], data_[1] - other[1], data_[2] - other[2]};
+    constexpr BasicVector operator+(const BasicVector& other) const {
+        return BasicVector(*this) += other;
+    }
+    constexpr BasicVector operator-(const BasicVector& other) const {
+        return BasicVector(*this) -= other;
     }
-    Vector operator*(double k) const {
-        return {k * data_[0], k * data_[1], k * data_[2]};
+    constexpr BasicVector operator*(T k) const {
+        return BasicVector(*this) *= k;
     }
-    Vector operator^(Vector other) const {
-        return Vector{data_[0] * other[0], data_[1] * other[1], data_[2] * other[2]};
+    constexpr BasicVector operator^(const BasicVector& other) const {
+        return BasicVector(*this) ^= other;
     }
+
+    // A refined reciprocal square root and one packed multiply for float; one square root and a
+    // divide per coordinate otherwise.
     void Normalize() {
-        double mod = sqrt(data_[0] * data_[0] + data_[1] * data_[1] + data_[2] * data_[2]);
-        data_ = {data_[0] / mod, data_[1] / mod, data_[2] / mod};
+        if constexpr (std::is_same_v<T, float>) {
+            *this *= InverseSqrt(Dot(*this, *this));
+        } else {
+            const T length = std::sqrt(Dot(*this, *this));
+            data_ = Apply(data_, [length](auto a) { return a / length; });
+        }
     };
 
+    // Summed x + y, then + z, as in scalar code.
+    static constexpr T Dot(const BasicVector& lhs, const BasicVector& rhs) {
+        Storage product = Apply(lhs.data_, rhs.data_, [](auto a, auto b) { return a * b; });
+        return product[0] + product[1] + product[2];
+    }
+    static constexpr BasicVector Cross(const BasicVector& lhs, const BasicVector& rhs) {
+        BasicVector result;
+        if constexpr (kPacked) {
+            const Storage &a = lhs.data_, &b = rhs.data_;
+            Storage a_yzx = __builtin_shufflevector(a, a, 1, 2, 0, 3);
+            Storage a_zxy = __builtin_shufflevector(a, a, 2, 0, 1, 3);
+            Storage b_yzx = __builtin_shufflevector(b, b, 1, 2, 0, 3);
+            Storage b_zxy = __builtin_shufflevector(b, b, 2, 0, 1, 3);
+            result.data_ = a_yzx * b_zxy - a_zxy * b_yzx;
+        } else {
+            result.data_ = {lhs[1] * rhs[2] - lhs[2] * rhs[1], lhs[2] * rhs[0] - lhs[0] * rhs[2],
+                            lhs[0] * rhs[1] - lhs[1] * rhs[0]};
+        }
+        return result;
+    }
+
 private:
-    std::array<double, 3> data_;
+    static constexpr Storage Make(T x, T y, T z) {
+        if constexpr (kPacked) {
+            return Storage{x, y, z, 0};
+        } else {
+            return Storage{x, y, z};
+        }
+    }
+    // `f` applied to whole registers when packed, else to each coordinate.
+    template <class F>
+    static constexpr Storage Apply(const Storage& a, F f) {
+        if constexpr (kPacked) {
+            return f(a);
+        } else {
+            return {f(a[0]), f(a[1]), f(a[2])};
+        }
+    }
+    template <class F>
+    static constexpr Storage Apply(const Storage& a, const Storage& b, F f) {
+        if constexpr (kPacked) {
+            return f(a, b);
+        } else {
+            return {f(a[0], b[0]), f(a[1], b[1]), f(a[2], b[2])};
+        }
+    }
+
+    Storage data_;
 };
 
-inline double DotProduct(const Vector& lhs, const Vector& rhs) {
-    return lhs[0] * rhs[0] + lhs[1] * rhs[1] + lhs[2] * rhs[2];
+using Vector = BasicVector<Scalar>;
+
+template <class T>
+constexpr T DotProduct(const BasicVector<T>& lhs,
+                       const std::type_identity_t<BasicVector<T>>& rhs) {
+    return BasicVector<T>::Dot(lhs, rhs);
 }
-inline Vector CrossProduct(const Vector& a, const Vector& b) {
-    return {a[1] * b[2] - a[2] * b[1], a[2] * b[0] - a[0] * b[2], a[0] * b[1] - a[1] * b[0]};
+template <class T>
+constexpr BasicVector<T> CrossProduct(const BasicVector<T>& a,
+                                      const std::type_identity_t<BasicVector<T>>& b) {
+    return BasicVector<T>::Cross(a, b);
 }
-inline double Length(const Vector& vec) {
-    return sqrt(vec[0] * vec[0] + vec[1] * vec[1] + vec[2] * vec[2]);
+template <class T>
+inline T Length(const BasicVector<T>& vec) {
+    return std::sqrt(DotProduct(vec, vec));
 }
 
-inline Vector Multiply(const Vector& v, const double k) {
-    return {v[0] * k, v[1] * k, v[2] * k};
+template <class T>
+constexpr BasicVector<T> Multiply(const BasicVector<T>& v, const std::type_identity_t<T> k) {
+    return v * k;
 }
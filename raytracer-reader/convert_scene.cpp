@@ -0,0 +1,35 @@
+#include <paged_scene.h>
+
+#include <filesystem>
+#include <iostream>
+
+// Compiles an .obj scene, with its materials and instanced meshes, into a scene file, or into a
+// paged scene file for scenes too large to keep in memory:
+//
+//     convert_scene scene.obj scene.rtscene
+//     convert_scene scene.obj scene.rtpaged
+//
+// The file records the Scalar precision of this build, and only builds of the same precision
+// load it.
+int main(int argc, char** argv) {
+    if (argc != 3) {
+        std::cerr << "Usage: " << argv[0] << " <scene.obj> <scene" << kSceneFileExtension
+                  << "|scene" << kPagedSceneExtension << ">\n";
+        return 2;
+    }
+    if (!std::filesystem::is_regular_file(argv[1])) {
+        std::cerr << "Can't read " << argv[1] << "\n";
+        return 1;
+    }
+    try {
+        if (IsPagedSceneFile(argv[2])) {
+            SavePagedScene(ReadScene(argv[1]), argv[2]);
+        } else {
+            SaveSceneFile(ReadScene(argv[1]), argv[2]);
+        }
+    } catch (const std::exception& error) {
+        std::cerr << error.what() << "\n";
+        return 1;
+    }
+    return 0;
+}
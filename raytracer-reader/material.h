@@ -2,8 +2,17 @@
 
 #include <vector.h>
 #include <string>
+#include <string_view>
+#include <array>
+#include <cstdint>
+#include <limits>
+#include <map>
+#include <optional>
+#include <stdexcept>
+#include <vector>
 
-struct Material {
+// Aligned to a cache line, so that shading a hit touches as few lines as possible.
+struct alignas(64) Material {
     std::string name;
     Vector ambient_color;
     Vector diffuse_color;
@@ -13,3 +22,84 @@ struct Material {
     double refraction_index;
     std::array<double, 3> albedo;
 };
+
+// Index of a material in its MaterialTable.
+using MaterialId = uint16_t;
+
+// Materials packed in one array and addressed by a small id. Several names may map to one id:
+// materials with equal properties are stored once, under the first name they came with.
+class MaterialTable {
+public:
+    // One material for every id.
+    static constexpr size_t kMaxSize = size_t(std::numeric_limits<MaterialId>::max()) + 1;
+
+    // Id of the material called `material.name`. A name seen before keeps its material; a new
+    // one is added, or joins an equal material that is already there. Throws
+    // std::runtime_error if a new material does not fit in kMaxSize.
+    MaterialId Add(const Material& material) {
+        if (auto it = ids_.find(material.name); it != ids_.end()) {
+            return it->second;
+        }
+        const Key key = Properties(material);
+        auto it = by_properties_.find(key);
+        if (it == by_properties_.end()) {
+            if (materials_.size() == kMaxSize) {
+                throw std::runtime_error("More than " + std::to_string(kMaxSize) +
+                                         " materials");
+            }
+            it = by_properties_.emplace(key, materials_.size()).first;
+            materials_.push_back(material);
+        }
+        ids_.emplace(material.name, it->second);
+        return it->second;
+    }
+    // Id of `name`, which is added as a default material if not there yet.
+    MaterialId Get(const std::string& name) {
+        if (auto it = ids_.find(name); it != ids_.end()) {
+            return it->second;
+        }
+        Material material{};
+        material.name = name;
+        return Add(material);
+    }
+    std::optional<MaterialId> Find(std::string_view name) const {
+        auto it = ids_.find(name);
+        return it == ids_.end() ? std::nullopt : std::optional<MaterialId>(it->second);
+    }
+
+    const Material& operator[](MaterialId id) const {
+        return materials_[id];
+    }
+    size_t Size() const {
+        return materials_.size();
+    }
+    const std::vector<Material>& GetMaterials() const {
+        return materials_;
+    }
+    const std::map<std::string, MaterialId, std::less<>>& GetNames() const {
+        return ids_;
+    }
+
+private:
+    using Key = std::array<double, 17>;
+    static Key Properties(const Material& material) {
+        Key key;
+        size_t k = 0;
+        for (const Vector* color : {&material.ambient_color, &material.diffuse_color,
+                                    &material.specular_color, &material.intensity}) {
+            for (size_t i = 0; i < 3; ++i) {
+                key[k++] = (*color)[i];
+            }
+        }
+        key[k++] = material.specular_exponent;
+        key[k++] = material.refraction_index;
+        for (double albedo : material.albedo) {
+            key[k++] = albedo;
+        }
+        return key;
+    }
+
+    std::vector<Material> materials_;
+    std::map<std::string, MaterialId, std::less<>> ids_;
+    std::map<Key, MaterialId> by_properties_;
+};
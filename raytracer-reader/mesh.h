@@ -0,0 +1,34 @@
+#pragma once
+
+#include <triangle_mesh.h>
+#include <material.h>
+#include <transform.h>
+#include <bvh.h>
+
+#include <vector>
+#include <cstdint>
+#include <optional>
+
+// Triangles stored once, with their own BVH, and placed into a scene by instances.
+struct Mesh {
+    TriangleMesh triangles;
+    Bvh bvh;
+};
+
+inline std::vector<BoundingBox> GetTriangleBoxes(const TriangleMesh& triangles) {
+    std::vector<BoundingBox> boxes;
+    boxes.reserve(triangles.Size());
+    for (size_t i = 0; i < triangles.Size(); ++i) {
+        boxes.push_back(GetBoundingBox(triangles.GetTriangle(i)));
+    }
+    return boxes;
+}
+
+// One placement of a mesh. If `material` is set it replaces the materials of all triangles.
+struct Instance {
+    uint32_t mesh = 0;
+    // Object to world space and back.
+    Transform transform;
+    Transform inverse;
+    std::optional<MaterialId> material;
+};
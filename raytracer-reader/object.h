@@ -6,12 +6,12 @@
 #include <geometry.h>
 
 struct Object {
-    const Material *material = nullptr;
-    const Triangle polygon{};
-    const std::array<Vector, 3> normals;
+    MaterialId material = 0;
+    Triangle polygon{};
+    std::array<Vector, 3> normals;
     Object() {
     }
-    Object(Material *material, Triangle polygon, std::array<Vector, 3> normals)
+    Object(MaterialId material, Triangle polygon, std::array<Vector, 3> normals)
         : material(material), polygon(polygon), normals(normals) {
     }
     Vector GetNormalAtPoint(Vector p) const {
@@ -24,11 +24,11 @@ struct Object {
 };
 
 struct SphereObject {
-    const Material *material = nullptr;
+    MaterialId material = 0;
     Sphere sphere{};
     SphereObject() {
     }
-    SphereObject(Material *material, Sphere sphere) : material(material), sphere(sphere) {
+    SphereObject(MaterialId material, Sphere sphere) : material(material), sphere(sphere) {
     }
     Vector GetNormalAtPoint(Vector p) const {
         Vector normal = p - sphere.GetCenter();
@@ -36,19 +36,3 @@ struct SphereObject {
         return normal;
     }
 };
-
-struct FinalObject {
-public:
-    Object object{};
-    SphereObject sphere_object{};
-    FinalObject(SphereObject sphere_object) : sphere_object(sphere_object) {
-    }
-    FinalObject(Object object) : object(object), if_triangle_(true) {
-    }
-    bool IfTriangle() const {
-        return if_triangle_;
-    }
-
-private:
-    bool if_triangle_ = false;
-};
@@ -0,0 +1,264 @@
+#pragma once
+
+#include <scene_file.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+// Paged scene file, for scenes whose triangles do not fit in memory. The scene's BVH is cut into
+// clusters, subtrees of at most kClusterPrimitives primitives, each stored as a record of its
+// own: the triangles it holds, indexed like a mesh, and its part of the tree. What stays in
+// memory is the rest of the scene (spheres, lights, materials, instanced meshes) and the top of
+// the tree down to the cluster roots; clusters are read from the mapping when traversal reaches
+// them.
+
+inline constexpr char kPagedSceneMagic[8] = {'R', 'T', 'P', 'A', 'G', 'E', 'D', '\0'};
+inline constexpr uint32_t kPagedSceneVersion = 1;
+inline constexpr std::string_view kPagedSceneExtension = ".rtpaged";
+inline constexpr uint32_t kClusterPrimitives = 4096;
+
+inline bool IsPagedSceneFile(std::string_view filename) {
+    return filename.ends_with(kPagedSceneExtension);
+}
+
+// One subtree of a paged scene. Its BVH indexes local primitives: triangles [0, k) of
+// `triangles`, then the primitives that stay resident, local id k + i being `resident[i]`, an
+// index into the spheres and then the instances of the resident scene.
+struct GeometryCluster {
+    TriangleMesh triangles;
+    std::vector<uint32_t> resident;
+    Bvh bvh;
+
+    // Bytes held by the arrays.
+    size_t MemoryUsage() const {
+        return triangles.MemoryUsage() + resident.size() * sizeof(uint32_t) +
+               bvh.GetNodes().size() * sizeof(BvhNode) +
+               bvh.GetPrimitives().size() * sizeof(uint32_t);
+    }
+};
+
+// The clusters of a paged scene file and the top of its tree, whose leaves hold one cluster
+// each: primitive c of the top BVH is cluster c.
+class ClusterFile {
+public:
+    ClusterFile(MappedFile file, Bvh bvh, std::vector<uint64_t> offsets, size_t material_count,
+                size_t resident_count)
+        : file_(std::move(file)),
+          bvh_(std::move(bvh)),
+          offsets_(std::move(offsets)),
+          material_count_(material_count),
+          resident_count_(resident_count) {
+    }
+
+    const Bvh& GetBvh() const {
+        return bvh_;
+    }
+    uint32_t ClusterCount() const {
+        return offsets_.size() - 1;
+    }
+    // Copies cluster `cluster` out of the mapping. Clusters are checked as they are read, not
+    // when the file is opened; throws std::runtime_error for one that is damaged.
+    GeometryCluster ReadCluster(uint32_t cluster) const {
+        CacheReader reader(
+            file_.View().substr(offsets_[cluster], offsets_[cluster + 1] - offsets_[cluster]));
+        GeometryCluster result;
+        if (!GetTriangles(&reader, material_count_, &result.triangles) ||
+            !reader.GetArray(&result.resident) ||
+            !::GetBvh(&reader, result.triangles.Size() + result.resident.size(), &result.bvh)) {
+            throw std::runtime_error("Damaged cluster in a paged scene file");
+        }
+        for (uint32_t id : result.resident) {
+            if (id >= resident_count_) {
+                throw std::runtime_error("Damaged cluster in a paged scene file");
+            }
+        }
+        return result;
+    }
+
+private:
+    MappedFile file_;
+    Bvh bvh_;
+    // Cluster c takes bytes [offsets_[c], offsets_[c + 1]) of the file.
+    std::vector<uint64_t> offsets_;
+    size_t material_count_;
+    size_t resident_count_;
+};
+
+// What a paged scene file loads to: the scene without its own triangles, and their clusters.
+struct PagedScene {
+    Scene resident;
+    ClusterFile clusters;
+};
+
+// Writes `scene` as a paged scene file, cutting its BVH into subtrees of at most
+// `cluster_primitives` primitives (or single leaves). Throws std::runtime_error if the file
+// cannot be written.
+inline void SavePagedScene(const Scene& scene, const std::string& path,
+                           uint32_t cluster_primitives = kClusterPrimitives) {
+    const Bvh& bvh = scene.GetBvh();
+    const std::vector<BvhNode>& nodes = bvh.GetNodes();
+    const TriangleMesh& triangles = scene.GetTriangles();
+    const uint32_t triangle_count = triangles.Size();
+
+    // Children come after their parents, so a backward sweep counts the primitives under
+    // every node.
+    std::vector<uint64_t> counts(nodes.size());
+    for (size_t i = nodes.size(); i-- > 0;) {
+        counts[i] = nodes[i].IsLeaf() ? nodes[i].count : counts[i + 1] + counts[nodes[i].offset];
+    }
+    // The top of the tree in the same layout, with the subtrees below cluster_primitives cut
+    // off into leaves; roots[c] is the node cluster c starts at.
+    std::vector<BvhNode> top;
+    std::vector<uint32_t> roots;
+    auto cut = [&](auto&& self, uint32_t index) -> void {
+        const size_t top_index = top.size();
+        top.push_back({nodes[index].box});
+        if (nodes[index].IsLeaf() || counts[index] <= cluster_primitives) {
+            top[top_index].offset = roots.size();
+            top[top_index].count = 1;
+            roots.push_back(index);
+            return;
+        }
+        self(self, index + 1);
+        top[top_index].offset = top.size();
+        self(self, nodes[index].offset);
+    };
+    if (!nodes.empty()) {
+        cut(cut, 0);
+    }
+
+    // Every cluster aligned, so that the arrays of its record are aligned in the mapping.
+    CacheWriter clusters;
+    std::vector<uint64_t> offsets;
+    for (uint32_t root : roots) {
+        offsets.push_back(clusters.Data().size());
+        GeometryCluster cluster;
+        std::vector<BvhNode> local_nodes;
+        std::vector<uint32_t> local_primitives;
+        std::unordered_map<uint32_t, uint32_t> vertex_ids, normal_ids;
+        // Slots of local_primitives holding a resident primitive, to be shifted past the
+        // triangles once they are all known.
+        std::vector<size_t> resident_slots;
+        auto add_triangle = [&](uint32_t id) {
+            std::array<uint32_t, 3> vertices, normals;
+            for (size_t k = 0; k < 3; ++k) {
+                uint32_t vertex = triangles.GetVertexIndices()[3 * id + k];
+                auto [v, new_vertex] = vertex_ids.try_emplace(vertex, vertex_ids.size());
+                if (new_vertex) {
+                    cluster.triangles.AddVertex(triangles.GetVertexBuffer()[vertex]);
+                }
+                vertices[k] = v->second;
+                uint32_t normal = triangles.GetNormalIndices()[3 * id + k];
+                auto [n, new_normal] = normal_ids.try_emplace(normal, normal_ids.size());
+                if (new_normal) {
+                    cluster.triangles.AddNormal(triangles.GetNormalBuffer()[normal]);
+                }
+                normals[k] = n->second;
+            }
+            cluster.triangles.Add(triangles.GetMaterial(id), vertices, normals);
+            return static_cast<uint32_t>(cluster.triangles.Size() - 1);
+        };
+        auto copy = [&](auto&& self, uint32_t index) -> void {
+            const size_t local = local_nodes.size();
+            local_nodes.push_back(nodes[index]);
+            const BvhNode& node = nodes[index];
+            if (node.IsLeaf()) {
+                local_nodes[local].offset = local_primitives.size();
+                for (uint32_t j = node.offset; j < node.offset + node.count; ++j) {
+                    uint32_t id = bvh.GetPrimitives()[j];
+                    if (id < triangle_count) {
+                        local_primitives.push_back(add_triangle(id));
+                    } else {
+                        resident_slots.push_back(local_primitives.size());
+                        local_primitives.push_back(cluster.resident.size());
+                        cluster.resident.push_back(id - triangle_count);
+                    }
+                }
+                return;
+            }
+            self(self, index + 1);
+            local_nodes[local].offset = local_nodes.size();
+            self(self, node.offset);
+        };
+        copy(copy, root);
+        for (size_t slot : resident_slots) {
+            local_primitives[slot] += cluster.triangles.Size();
+        }
+        PutTriangles(cluster.triangles, &clusters);
+        clusters.PutArray(cluster.resident);
+        PutBvh(Bvh(std::move(local_nodes), std::move(local_primitives)), &clusters);
+        clusters.Align();
+    }
+    offsets.push_back(clusters.Data().size());
+
+    const Scene resident(scene.GetMaterials(), scene.GetLights(), scene.GetSphereObjects(), {},
+                         scene.GetMeshes(), scene.GetInstances());
+    std::vector<uint32_t> cluster_ids(roots.size());
+    std::iota(cluster_ids.begin(), cluster_ids.end(), 0);
+    CacheWriter writer;
+    writer.Put(kPagedSceneMagic);
+    writer.Put(kPagedSceneVersion);
+    writer.Put(kByteOrderMark);
+    writer.Put<uint32_t>(sizeof(Scalar));
+    writer.Put(kSceneCacheVersion);
+    PutScene(resident, &writer);
+    // Offsets from the start of the clusters, which follow the top of the tree.
+    writer.PutArray(offsets);
+    PutBvh(Bvh(std::move(top), std::move(cluster_ids)), &writer);
+    writer.Align();
+    writer.PutBytes(clusters.Data());
+    if (!WriteFileAtomically(path, writer.Data())) {
+        throw std::runtime_error("Can't write " + path);
+    }
+}
+
+// The resident part of the paged scene file and its clusters, left in the mapping; nothing if
+// the file is missing, damaged or of another version.
+inline std::optional<PagedScene> LoadPagedScene(const std::string& path) {
+    MappedFile file(path);
+    CacheReader reader(file.View());
+    char magic[sizeof(kPagedSceneMagic)];
+    uint32_t version, byte_order, scalar_size, record_version;
+    if (!reader.Get(&magic) || std::memcmp(magic, kPagedSceneMagic, sizeof(magic)) != 0 ||
+        !reader.Get(&version) || version != kPagedSceneVersion || !reader.Get(&byte_order) ||
+        byte_order != kByteOrderMark || !reader.Get(&scalar_size) ||
+        scalar_size != sizeof(Scalar) || !reader.Get(&record_version) ||
+        record_version != kSceneCacheVersion) {
+        return std::nullopt;
+    }
+    std::optional<Scene> resident = GetScene(&reader);
+    if (!resident) {
+        return std::nullopt;
+    }
+    std::vector<uint64_t> offsets;
+    Bvh bvh;
+    if (!reader.GetArray(&offsets) || offsets.empty() ||
+        !GetBvh(&reader, offsets.size() - 1, &bvh)) {
+        return std::nullopt;
+    }
+    const uint64_t base = (reader.Offset() + kArrayAlignment - 1) / kArrayAlignment *
+                          kArrayAlignment;
+    if (base > file.View().size() || !std::is_sorted(offsets.begin(), offsets.end()) ||
+        offsets.back() > file.View().size() - base) {
+        return std::nullopt;
+    }
+    for (uint64_t& offset : offsets) {
+        offset += base;
+    }
+    const size_t material_count = resident->GetMaterials().Size();
+    const size_t resident_count =
+        resident->GetSphereObjects().size() + resident->GetInstances().size();
+    return PagedScene{std::move(*resident),
+                      ClusterFile(std::move(file), std::move(bvh), std::move(offsets),
+                                  material_count, resident_count)};
+}
+
@@ -0,0 +1,82 @@
+#pragma once
+
+#include <object.h>
+#include <triangle_mesh.h>
+#include <material.h>
+#include <triangle.h>
+#include <sphere.h>
+#include <geometry.h>
+
+#include <array>
+#include <cstdint>
+#include <vector>
+
+// Primitives in structure-of-arrays form, addressed by a compact primitive id: triangles take
+// ids [0, TriangleCount()) and spheres the ids after them, the order in which a scene indexes
+// its BVH primitives. Each array holds one field, so intersection streams only vertices or
+// spheres, and shading only normals and materials. Triangles are read in place from the indexed
+// mesh they come from, which must outlive the store. Materials are ids into the scene's
+// MaterialTable.
+class PrimitiveStore {
+public:
+    PrimitiveStore(const TriangleMesh& triangles,
+                   const std::vector<SphereObject>& sphere_objects)
+        : triangles_(&triangles) {
+        spheres_.reserve(sphere_objects.size());
+        sphere_materials_.reserve(sphere_objects.size());
+        for (const SphereObject& sphere_object : sphere_objects) {
+            spheres_.push_back(sphere_object.sphere);
+            sphere_materials_.push_back(sphere_object.material);
+        }
+    }
+
+    uint32_t TriangleCount() const {
+        return triangles_->Size();
+    }
+    uint32_t Size() const {
+        return triangles_->Size() + spheres_.size();
+    }
+    bool IsTriangle(uint32_t id) const {
+        return id < triangles_->Size();
+    }
+
+    Triangle GetTriangle(uint32_t id) const {
+        return triangles_->GetTriangle(id);
+    }
+    const Sphere& GetSphere(uint32_t id) const {
+        return spheres_[id - triangles_->Size()];
+    }
+    // For a sphere that moved; triangles are read from the mesh as it is.
+    void SetSphere(uint32_t id, const Sphere& sphere) {
+        spheres_[id - triangles_->Size()] = sphere;
+    }
+    MaterialId GetMaterial(uint32_t id) const {
+        return IsTriangle(id) ? triangles_->GetMaterial(id)
+                              : sphere_materials_[id - triangles_->Size()];
+    }
+    Vector GetSphereNormal(uint32_t id, const Vector& point) const {
+        Vector normal = point - GetSphere(id).GetCenter();
+        normal.Normalize();
+        return normal;
+    }
+    // Normal of a triangle at barycentric coordinates (u, v) along its two edges, interpolated
+    // between the vertex normals. Flat triangles share one precomputed geometric normal.
+    Vector GetTriangleNormal(uint32_t id, double u, double v) const {
+        return triangles_->GetNormal(id, u, v);
+    }
+    bool IsFlat(uint32_t id) const {
+        return triangles_->IsFlat(id);
+    }
+
+    // Bytes held by all arrays, those of the mesh included.
+    size_t MemoryUsage() const {
+        return triangles_->MemoryUsage() +
+               spheres_.size() * (sizeof(Sphere) + sizeof(MaterialId));
+    }
+
+private:
+    const TriangleMesh* triangles_;
+    // Per sphere.
+    std::vector<Sphere> spheres_;
+    std::vector<MaterialId> sphere_materials_;
+};
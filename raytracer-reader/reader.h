@@ -1,198 +1,111 @@
 #pragma once
-#include <string>
-#include <vector>
-#include <vector.h>
-#include <cassert>
+
 #include <charconv>
-#include <optional>
+#include <cstdint>
+#include <string_view>
 
-inline double ConvertToDouble(std::string_view s) {
-    double result;
-    std::from_chars(s.data(), s.data() + s.size(), result);
-    return result;
-}
+// Zero-copy scanning of .obj and .mtl text: tokens are views into the text, numbers are read in
+// place.
 
-// trim from start
-static inline std::string &Ltrim(std::string &s) {
-    s.erase(s.begin(),
-            std::find_if(s.begin(), s.end(), std::not1(std::ptr_fun<int, int>(std::isspace))));
-    return s;
+inline bool IsBlank(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\v' || c == '\f';
 }
-
-// trim from end
-static inline std::string &Rtrim(std::string &s) {
-    s.erase(
-        std::find_if(s.rbegin(), s.rend(), std::not1(std::ptr_fun<int, int>(std::isspace))).base(),
-        s.end());
+// `s` without blanks at either end.
+inline std::string_view TrimBlanks(std::string_view s) {
+    while (!s.empty() && IsBlank(s.front())) {
+        s.remove_prefix(1);
+    }
+    while (!s.empty() && IsBlank(s.back())) {
+        s.remove_suffix(1);
+    }
     return s;
 }
-
-std::vector<std::string> Split(const std::string &s, char delim = ' ', bool without_empty = true) {
-    std::stringstream ss(s);
-    std::string item;
-    std::vector<std::string> elems;
-    while (std::getline(ss, item, delim)) {
-        if (without_empty) {
-            if (!item.empty()) {
-                elems.push_back(item);
-            }
-        } else {
-            elems.push_back(item);
-        }
-    }
-    return elems;
+// Removes the next blank-separated token from the front of `s` and returns it; empty at the end.
+inline std::string_view NextToken(std::string_view* s) {
+    size_t begin = 0;
+    while (begin < s->size() && IsBlank((*s)[begin])) {
+        ++begin;
+    }
+    size_t end = begin;
+    while (end < s->size() && !IsBlank((*s)[end])) {
+        ++end;
+    }
+    std::string_view token = s->substr(begin, end - begin);
+    s->remove_prefix(end);
+    return token;
 }
 
-class Reader {
-protected:
-    std::string s_;
-
-public:
-    Reader(std::string s) : s_(s) {
-    }
-    void Trim() {
-        Ltrim(Rtrim(s_));
-    }
-    Vector GetVector() {
-        Trim();
-        auto v = Split(s_);
-        assert(v.size() == 3);
-        double x = ConvertToDouble(v[0]), y = ConvertToDouble(v[1]), z = ConvertToDouble(v[2]);
-        return {x, y, z};
-    }
-    double GetDouble() {
-        Trim();
-        return ConvertToDouble(s_);
-    }
-};
-
-class ReaderMtl : Reader {
-
-public:
-    ReaderMtl(std::string s) : Reader(s) {
-        Trim();
-    }
-
-    bool Newmtl() {
-        return s_.starts_with("newmtl") || s_.starts_with("Newmtl");
-    }
-    bool Ka() {
-        return s_.starts_with("Ka");
-    }
-    bool Kd() {
-        return s_.starts_with("Kd");
-    }
-    bool Ks() {
-        return s_.starts_with("Ks");
-    }
-    bool Ke() {
-        return s_.starts_with("Ke");
-    }
-    bool Ns() {
-        return s_.starts_with("Ns");
-    }
-    bool Ni() {
-        return s_.starts_with("Ni");
-    }
-    bool Al() {
-        return s_.starts_with("al");
-    }
-    std::string GetNewmtl() {
-        s_ = s_.substr(6);
-        Trim();
-        return s_;
-    }
-    Vector GetKaKdKsKe() {
-        s_ = s_.substr(2);
-        Trim();
-        return GetVector();
-    }
-    double GetNsNi() {
-        s_ = s_.substr(2);
-        Trim();
-        return GetDouble();
-    }
-    std::array<double, 3> GetAl() {
-        s_ = s_.substr(2);
-        Trim();
-        Vector v = GetVector();
-        return {v[0], v[1], v[2]};
-    }
-};
-
-class ReaderObj : Reader {
-
-public:
-    ReaderObj(std::string s) : Reader(s) {
-        Trim();
-    }
-    bool V() {
-        return s_.starts_with("v") && !Vn();
-    }
-    bool Vn() {
-        return s_.starts_with("vn");
-    }
-    bool F() {
-        return s_.starts_with("f");
-    }
-
-    bool Mtllib() {
-        return s_.starts_with("mtllib");
-    }
-    bool Usemtl() {
-        return s_.starts_with("usemtl");
-    }
-    bool S() {
-        return s_.starts_with("S");
-    }
-    bool P() {
-        return s_.starts_with("P");
-    }
-    Vector GetVnV() {
-        s_ = s_.substr(2);
-        Trim();
-        return GetVector();
-    }
-    std::string GetMtllibUsemtl() {
-        s_ = s_.substr(6);
-        Trim();
-        return s_;
-    }
-    std::pair<Vector, double> GetS() {
-        s_ = s_.substr(2);
-        Trim();
-        std::vector<std::string> v = Split(s_);
-        assert(v.size() == 4);
-        double x = ConvertToDouble(v[0]), y = ConvertToDouble(v[1]), z = ConvertToDouble(v[2]),
-               r = ConvertToDouble(v[3]);
-        return {{x, y, z}, r};
-    };
-    std::pair<Vector, Vector> GetP() {
-        s_ = s_.substr(2);
-        Trim();
-        std::vector<std::string> v = Split(s_);
-        assert(v.size() == 6);
-        double x = ConvertToDouble(v[0]), y = ConvertToDouble(v[1]), z = ConvertToDouble(v[2]),
-               r = ConvertToDouble(v[3]), g = ConvertToDouble(v[4]), b = ConvertToDouble((v[5]));
-        return {{x, y, z}, {r, g, b}};
-    };
-    std::vector<std::pair<int, std::optional<int>>> GetF() {
-        std::vector<std::pair<int, std::optional<int>>> result;
-        s_ = s_.substr(2);
-        Trim();
-        std::vector<std::string> v = Split(s_);
-        for (std::string vertex : v) {
-            Reader local_reader(vertex);
-            std::vector<std::string> local_vector = Split(vertex, '/', false);
-            assert(local_vector.size() <= 3);
-            if (local_vector.size() == 3) {
-                result.push_back(
-                    {ConvertToDouble(local_vector[0]), ConvertToDouble(local_vector[2])});
-            } else {
-                result.push_back({ConvertToDouble(local_vector[0]), {}});
-            }
+// Reads a decimal number at `first` into `value` and returns its end, or `first` if there is
+// none. The result is the one std::from_chars gives: up to 19 digits with a decimal exponent
+// within 22 are converted with a single rounding, anything else goes to from_chars.
+inline const char* ScanDouble(const char* first, const char* last, double* value) {
+    static constexpr double kPowers[] = {1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,
+                                         1e8,  1e9,  1e10, 1e11, 1e12, 1e13, 1e14, 1e15,
+                                         1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22};
+    const char* p = first;
+    bool negative = p != last && *p == '-';
+    p += negative;
+    uint64_t mantissa = 0;
+    int digits = 0, exponent = 0;
+    const char* digits_begin = p;
+    for (; p != last && *p >= '0' && *p <= '9'; ++p, ++digits) {
+        mantissa = mantissa * 10 + (*p - '0');
+    }
+    bool any_digit = p != digits_begin;
+    if (p != last && *p == '.') {
+        const char* fraction = ++p;
+        for (; p != last && *p >= '0' && *p <= '9'; ++p, ++digits) {
+            mantissa = mantissa * 10 + (*p - '0');
+        }
+        exponent = -static_cast<int>(p - fraction);
+        any_digit = any_digit || p != fraction;
+    }
+    if (!any_digit) {
+        return std::from_chars(first, last, *value).ptr;
+    }
+    if (p != last && (*p == 'e' || *p == 'E')) {
+        const char* q = p + 1;
+        bool negative_exponent = q != last && *q == '-';
+        q += negative_exponent || (q != last && *q == '+');
+        int power = 0;
+        const char* power_begin = q;
+        for (; q != last && *q >= '0' && *q <= '9' && power < 10000; ++q) {
+            power = power * 10 + (*q - '0');
         }
-        return result;
+        if (q != power_begin) {
+            exponent += negative_exponent ? -power : power;
+            p = q;
+        }
+    }
+    if (digits > 19 || mantissa > (uint64_t(1) << 53) || exponent < -22 || exponent > 22 ||
+        (p != last && *p >= '0' && *p <= '9')) {
+        return std::from_chars(first, last, *value).ptr;
     }
-};
-// just empty comment
\ No newline at end of file
+    double result = static_cast<double>(mantissa);
+    result = exponent < 0 ? result / kPowers[-exponent] : result * kPowers[exponent];
+    *value = negative ? -result : result;
+    return p;
+}
+// A token that is a number as a whole.
+inline bool ScanDouble(std::string_view token, double* value) {
+    return !token.empty() &&
+           ScanDouble(token.data(), token.data() + token.size(), value) ==
+               token.data() + token.size();
+}
+// The number at the front of `token`, or 0 if there is none.
+inline double ScanLeadingDouble(std::string_view token) {
+    double value = 0;
+    ScanDouble(token.data(), token.data() + token.size(), &value);
+    return value;
+}
+// The integer at the front of `token`, or 0 if there is none.
+inline int ScanInt(std::string_view token) {
+    size_t i = 0;
+    bool negative = !token.empty() && token[0] == '-';
+    i += negative;
+    int value = 0;
+    for (; i < token.size() && token[i] >= '0' && token[i] <= '9'; ++i) {
+        value = value * 10 + (token[i] - '0');
+    }
+    return negative ? -value : value;
+}
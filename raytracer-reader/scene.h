@@ -9,20 +9,48 @@
 #include <material.h>
 #include <vector.h>
 #include <object.h>
+#include <triangle_mesh.h>
 #include <light.h>
 #include <reader.h>
+#include <bvh.h>
+#include <mesh.h>
+#include <mapped_file.h>
+#include <thread_pool.h>
 
+#include <cassert>
+#include <cmath>
 #include <vector>
 #include <map>
 #include <string>
 #include <fstream>
+#include <optional>
+#include <stdexcept>
+#include <cstdint>
+
+// What Scene::Refit did to one hierarchy.
+struct RefitResult {
+    // Primitives whose boxes were refitted.
+    std::vector<uint32_t> primitives;
+    // Rebuilt from scratch, so any leaf may hold other primitives than before.
+    bool rebuilt = false;
+};
 
 class Scene {
 private:
-    std::vector<Object> objects_{};
+    TriangleMesh triangles_;
     std::vector<SphereObject> sphere_objects_{};
     std::vector<Light> lights_;
-    std::map<std::string, Material> materials_;
+    MaterialTable materials_;
+    std::vector<Mesh> meshes_;
+    std::vector<Instance> instances_;
+    // Built over all triangles, then all spheres, then all instances, see GetPrimitiveBoxes.
+    Bvh bvh_;
+    // Primitives of bvh_ and of every mesh moved since the last Refit.
+    std::vector<uint32_t> changed_;
+    std::vector<std::vector<uint32_t>> changed_in_mesh_;
+    // What the last Refit did to bvh_ and to every mesh.
+    RefitResult refitted_;
+    std::vector<RefitResult> mesh_refitted_;
 
 public:
     //    Scene(const Scene& scene) :materials_(scene.materials_),lights_(scene.lights_){
@@ -30,17 +58,25 @@ public:
     //
     //        }
     //    }
-    Scene(std::map<std::string, Material> materials, std::vector<Light> lights,
-          std::vector<SphereObject> sphere_objects, std::vector<Object> objects)
-        : lights_(lights), materials_(materials) {
-        for (auto sphere : sphere_objects) {
-            sphere_objects_.push_back(
-                SphereObject(&materials_[sphere.material->name], sphere.sphere));
-        }
-        for (auto object : objects) {
-            objects_.push_back(
-                Object(&materials_[object.material->name], object.polygon, object.normals));
+    Scene(MaterialTable materials, std::vector<Light> lights,
+          std::vector<SphereObject> sphere_objects, TriangleMesh triangles,
+          std::vector<Mesh> meshes = {}, std::vector<Instance> instances = {},
+          std::optional<Bvh> bvh = std::nullopt)
+        : triangles_(std::move(triangles)),
+          sphere_objects_(std::move(sphere_objects)),
+          lights_(std::move(lights)),
+          materials_(std::move(materials)),
+          meshes_(std::move(meshes)),
+          instances_(std::move(instances)) {
+        // Meshes may come with their hierarchy already built.
+        for (Mesh& mesh : meshes_) {
+            if (mesh.bvh.Empty()) {
+                mesh.bvh = Bvh(GetTriangleBoxes(mesh.triangles));
+            }
         }
+        changed_in_mesh_.resize(meshes_.size());
+        mesh_refitted_.resize(meshes_.size());
+        bvh_ = bvh ? std::move(*bvh) : Bvh(GetPrimitiveBoxes());
     }
     //    Scene(const Scene& other)
     //        : Scene(other.GetMaterials(), other.GetLights(), other.GetSphereObjects(),
@@ -60,8 +96,8 @@ public:
     //    }
     //    ~Scene() = default;
 
-    const std::vector<Object>& GetObjects() const {
-        return objects_;
+    const TriangleMesh& GetTriangles() const {
+        return triangles_;
     };
     const std::vector<SphereObject>& GetSphereObjects() const {
         return sphere_objects_;
@@ -69,126 +105,505 @@ public:
     const std::vector<Light>& GetLights() const {
         return lights_;
     };
-    const std::map<std::string, Material>& GetMaterials() const {
+    const MaterialTable& GetMaterials() const {
         return materials_;
     };
+    const std::vector<Mesh>& GetMeshes() const {
+        return meshes_;
+    }
+    const std::vector<Instance>& GetInstances() const {
+        return instances_;
+    }
+    const Bvh& GetBvh() const {
+        return bvh_;
+    }
+    // Primitive i is triangle i for i < triangles_.Size(), then come the spheres and then the
+    // instances, each bounded by the world box of its mesh.
+    BoundingBox GetPrimitiveBox(size_t i) const {
+        if (i < triangles_.Size()) {
+            return GetBoundingBox(triangles_.GetTriangle(i));
+        }
+        i -= triangles_.Size();
+        if (i < sphere_objects_.size()) {
+            return GetBoundingBox(sphere_objects_[i].sphere);
+        }
+        const Instance& instance = instances_[i - sphere_objects_.size()];
+        const Bvh& mesh_bvh = meshes_[instance.mesh].bvh;
+        return mesh_bvh.Empty() ? BoundingBox()
+                                : instance.transform.ApplyToBox(mesh_bvh.GetNodes()[0].box);
+    }
+    std::vector<BoundingBox> GetPrimitiveBoxes() const {
+        std::vector<BoundingBox> boxes;
+        size_t count = triangles_.Size() + sphere_objects_.size() + instances_.size();
+        boxes.reserve(count);
+        for (size_t i = 0; i < count; ++i) {
+            boxes.push_back(GetPrimitiveBox(i));
+        }
+        return boxes;
+    }
+
+    // In-place updates for animation. They take effect for tracing after Refit.
+    void SetSphere(size_t index, const Sphere& sphere) {
+        sphere_objects_[index].sphere = sphere;
+        changed_.push_back(triangles_.Size() + index);
+    }
+    // See TriangleMesh::Set for how shared vertices are treated.
+    void SetTriangle(size_t index, const Triangle& polygon, const std::array<Vector, 3>& normals) {
+        triangles_.Set(index, polygon, normals);
+        changed_.push_back(index);
+    }
+    // Keeps the triangle flat shaded.
+    void SetTriangle(size_t index, const Triangle& polygon) {
+        Vector normal = polygon.GetNormal();
+        SetTriangle(index, polygon, {normal, normal, normal});
+    }
+    void SetMeshTriangle(size_t mesh, size_t index, const Triangle& polygon,
+                         const std::array<Vector, 3>& normals) {
+        meshes_[mesh].triangles.Set(index, polygon, normals);
+        changed_in_mesh_[mesh].push_back(index);
+    }
+    void SetMeshTriangle(size_t mesh, size_t index, const Triangle& polygon) {
+        Vector normal = polygon.GetNormal();
+        SetMeshTriangle(mesh, index, polygon, {normal, normal, normal});
+    }
+    void SetInstanceTransform(size_t index, const Transform& transform) {
+        instances_[index].transform = transform;
+        instances_[index].inverse = transform.Inverse();
+        changed_.push_back(triangles_.Size() + sphere_objects_.size() + index);
+    }
+
+    // Refits the hierarchies above everything updated since the last call, so the cost follows
+    // the number of changes. A hierarchy whose SAH cost degraded by more than
+    // Bvh::kMaxDegradation is rebuilt from scratch instead. GetRefitted tells what was done.
+    void Refit() {
+        refitted_ = {};
+        for (size_t i = 0; i < meshes_.size(); ++i) {
+            mesh_refitted_[i] = {};
+            if (changed_in_mesh_[i].empty()) {
+                continue;
+            }
+            Mesh& mesh = meshes_[i];
+            mesh.bvh.Refit(changed_in_mesh_[i], [&](uint32_t j) {
+                return GetBoundingBox(mesh.triangles.GetTriangle(j));
+            });
+            const bool rebuilt = mesh.bvh.Degradation() > Bvh::kMaxDegradation;
+            if (rebuilt) {
+                mesh.bvh = Bvh(GetTriangleBoxes(mesh.triangles));
+            }
+            mesh_refitted_[i] = {std::move(changed_in_mesh_[i]), rebuilt};
+            changed_in_mesh_[i].clear();
+            for (size_t j = 0; j < instances_.size(); ++j) {
+                if (instances_[j].mesh == i) {
+                    changed_.push_back(triangles_.Size() + sphere_objects_.size() + j);
+                }
+            }
+        }
+        if (changed_.empty()) {
+            return;
+        }
+        bvh_.Refit(changed_, [&](uint32_t i) { return GetPrimitiveBox(i); });
+        const bool rebuilt = bvh_.Degradation() > Bvh::kMaxDegradation;
+        if (rebuilt) {
+            bvh_ = Bvh(GetPrimitiveBoxes());
+        }
+        refitted_ = {std::move(changed_), rebuilt};
+        changed_.clear();
+    }
+    // What the last Refit did to the scene's own hierarchy, and to that of mesh `mesh`.
+    const RefitResult& GetRefitted() const {
+        return refitted_;
+    }
+    const RefitResult& GetMeshRefitted(size_t mesh) const {
+        return mesh_refitted_[mesh];
+    }
 };
 
-inline std::map<std::string, Material> ReadMaterials(std::string_view filename) {
-    std::map<std::string, Material> result;
-    std::ifstream infile;
-    infile.open(filename.data());
+// Three numbers that follow the keyword of a line.
+inline Vector ScanVector(std::string_view* rest) {
+    double x = ScanLeadingDouble(NextToken(rest));
+    double y = ScanLeadingDouble(NextToken(rest));
+    double z = ScanLeadingDouble(NextToken(rest));
+    return {x, y, z};
+}
 
+// Adds the materials of .mtl text to `materials`; see MaterialTable::Add for names that are
+// already there.
+inline void ParseMaterials(std::string_view text, MaterialTable* materials) {
     bool begun = false;
     Material current_material{};
-    for (std::string line; std::getline(infile, line);) {
-        ReaderMtl line_reader(line);
-        if (line_reader.Newmtl()) {
+    while (!text.empty()) {
+        const size_t end = std::min(text.find('\n'), text.size());
+        std::string_view rest = text.substr(0, end);
+        text.remove_prefix(std::min(end + 1, text.size()));
+        const std::string_view keyword = NextToken(&rest);
+        if (keyword == "newmtl" || keyword == "Newmtl") {
             if (begun) {
-                result.insert({current_material.name, current_material});
+                materials->Add(current_material);
             }
             begun = true;
             current_material =
                 Material{"", Vector(), Vector(), Vector(), Vector(), 0, 0, {1, 0, 0}};
-            current_material.name = line_reader.GetNewmtl();
-        }
-        if (line_reader.Ka()) {
-            current_material.ambient_color = line_reader.GetKaKdKsKe();
-        }
-        if (line_reader.Kd()) {
-            current_material.diffuse_color = line_reader.GetKaKdKsKe();
-        }
-        if (line_reader.Ks()) {
-            current_material.specular_color = line_reader.GetKaKdKsKe();
-        }
-        if (line_reader.Ke()) {
-            current_material.intensity = line_reader.GetKaKdKsKe();
-        }
-        if (line_reader.Ns()) {
-            current_material.specular_exponent = line_reader.GetNsNi();
+            current_material.name = TrimBlanks(rest);
+        } else if (keyword == "Ka") {
+            current_material.ambient_color = ScanVector(&rest);
+        } else if (keyword == "Kd") {
+            current_material.diffuse_color = ScanVector(&rest);
+        } else if (keyword == "Ks") {
+            current_material.specular_color = ScanVector(&rest);
+        } else if (keyword == "Ke") {
+            current_material.intensity = ScanVector(&rest);
+        } else if (keyword == "Ns") {
+            current_material.specular_exponent = ScanLeadingDouble(NextToken(&rest));
+        } else if (keyword == "Ni") {
+            current_material.refraction_index = ScanLeadingDouble(NextToken(&rest));
+        } else if (keyword == "al") {
+            Vector albedo = ScanVector(&rest);
+            current_material.albedo = {albedo[0], albedo[1], albedo[2]};
         }
-        if (line_reader.Ni()) {
-            current_material.refraction_index = line_reader.GetNsNi();
+    }
+    if (begun) {
+        materials->Add(current_material);
+    }
+}
+inline void ReadMaterials(const std::string& filename, MaterialTable* materials) {
+    const MappedFile file(filename);
+    ParseMaterials(file.View(), materials);
+}
+
+// Bytes of an .obj file parsed as one task by ReadScene.
+inline constexpr size_t kObjChunkSize = 1 << 20;
+
+inline Scene ReadScene(const std::string& filename, int threads = 0,
+                       size_t chunk_size = kObjChunkSize);
+
+// Triangles of an instanced .obj file. Its materials are merged into `materials`, names that
+// are already there win. Lights, spheres and instances of the file itself are ignored.
+inline Mesh ReadMesh(const std::string& filename, MaterialTable* materials, int threads = 0) {
+    const Scene scene = ReadScene(filename, threads);
+    std::vector<MaterialId> ids;
+    for (const Material& material : scene.GetMaterials().GetMaterials()) {
+        ids.push_back(materials->Add(material));
+    }
+    Mesh mesh{scene.GetTriangles(), {}};
+    mesh.triangles.RemapMaterials(ids);
+    return mesh;
+}
+
+// Throws std::runtime_error for a transform that can't be inverted, such as a scale of 0.
+inline Transform InstanceTransform(const std::vector<double>& numbers) {
+    Transform transform;
+    if (numbers.size() == 3) {
+        transform = Transform::Translation({numbers[0], numbers[1], numbers[2]});
+    } else if (numbers.size() == 4) {
+        transform = Transform::TranslationScale({numbers[0], numbers[1], numbers[2]}, numbers[3]);
+    } else {
+        assert(numbers.size() == 12);
+        std::array<double, 12> rows;
+        std::copy(numbers.begin(), numbers.end(), rows.begin());
+        transform = Transform(rows);
+    }
+    const double det = transform.Determinant();
+    if (!std::isfinite(det) || !std::isfinite(1 / det)) {
+        throw std::runtime_error("Instance transform can't be inverted");
+    }
+    return transform;
+}
+
+// Zero-based position of a vertex or normal referred to by a face, given by its one-based .obj
+// index or, if negative, counted back from the last one read so far. Throws std::runtime_error
+// for an index that is 0 or does not name one of the `size` there are in the file.
+inline uint32_t ObjIndex(int index, size_t count, size_t size) {
+    const int64_t position = index > 0 ? int64_t(index) - 1 : int64_t(count) + index;
+    if (index == 0 || position < 0 || uint64_t(position) >= size) {
+        throw std::runtime_error("Face index " + std::to_string(index) + " out of range");
+    }
+    return position;
+}
+
+// Lines of an .obj file parsed apart from the rest of it. Indices stay as written and materials
+// as names; ReadScene resolves both once the chunks before are known.
+struct ObjChunk {
+    // A line that changes the current material or the material table.
+    struct Event {
+        enum Kind { kMtllib, kUsemtl, kInstance } kind = kMtllib;
+        std::string name = {};
+        // Transform and material override of an instance.
+        std::vector<double> numbers = {};
+        std::string material = {};
+    };
+    struct Face {
+        // Its corners in `corners`.
+        uint32_t first_corner;
+        uint32_t corner_count;
+        // v and vn lines of the chunk before it, which negative indices count back from.
+        uint32_t vertex_count;
+        uint32_t vn_count;
+        // Its first triangle, and the slot in `normals` of its first flat triangle.
+        uint32_t first_triangle;
+        uint32_t first_flat;
+        uint32_t segment;
+    };
+
+    std::vector<Vector> vertices;
+    // Normals in the order the serial reader adds them: vn lines, and after every face a slot for
+    // each of its flat triangles, filled in once the vertices are known.
+    std::vector<Vector> normals;
+    // Slot in `normals` of every vn line.
+    std::vector<uint32_t> vn_slots;
+    std::vector<std::pair<int, std::optional<int>>> corners;
+    std::vector<Face> faces;
+    uint32_t triangle_count = 0;
+    // With their segments.
+    std::vector<std::pair<Sphere, uint32_t>> spheres;
+    std::vector<Light> lights;
+    std::vector<Event> events;
+    // Segment s holds the lines between events s - 1 and s and shares one material; whether any
+    // face or sphere in it uses that material.
+    std::vector<char> used = {false};
+};
+
+// Parses the lines of `text` in place: tokens are views into it and numbers are scanned where
+// they are, so only the buffers of the chunk allocate, each once, sized by a first pass over the
+// line keywords. Texture coordinates and lines of unknown kinds are skipped. Throws
+// std::runtime_error for an instance line without 3, 4 or 12 numbers.
+inline ObjChunk ParseObjChunk(std::string_view text) {
+    ObjChunk chunk;
+    auto for_each_line = [&](auto&& parse) {
+        for (std::string_view rest = text; !rest.empty();) {
+            const size_t end = std::min(rest.find('\n'), rest.size());
+            std::string_view line = rest.substr(0, end);
+            rest.remove_prefix(std::min(end + 1, rest.size()));
+            const std::string_view keyword = NextToken(&line);
+            parse(keyword, line);
         }
-        if (line_reader.Al()) {
-            current_material.albedo = line_reader.GetAl();
+    };
+    size_t vertex_lines = 0, normal_lines = 0, face_lines = 0;
+    for_each_line([&](std::string_view keyword, std::string_view) {
+        vertex_lines += keyword == "v";
+        normal_lines += keyword == "vn";
+        face_lines += keyword == "f";
+    });
+    chunk.vertices.reserve(vertex_lines);
+    chunk.normals.reserve(normal_lines);
+    chunk.vn_slots.reserve(normal_lines);
+    chunk.faces.reserve(face_lines);
+    chunk.corners.reserve(3 * face_lines);
+
+    auto use_material = [&] {
+        chunk.used.back() = true;
+        return chunk.events.size();
+    };
+    auto add_event = [&](ObjChunk::Event event) {
+        chunk.events.push_back(std::move(event));
+        chunk.used.push_back(false);
+    };
+    for_each_line([&](std::string_view keyword, std::string_view rest) {
+        if (keyword == "v") {
+            chunk.vertices.push_back(ScanVector(&rest));
+        } else if (keyword == "vn") {
+            chunk.vn_slots.push_back(chunk.normals.size());
+            chunk.normals.push_back(ScanVector(&rest));
+        } else if (keyword == "f") {
+            ObjChunk::Face face{static_cast<uint32_t>(chunk.corners.size()),
+                                0,
+                                static_cast<uint32_t>(chunk.vertices.size()),
+                                static_cast<uint32_t>(chunk.vn_slots.size()),
+                                chunk.triangle_count,
+                                static_cast<uint32_t>(chunk.normals.size()),
+                                0};
+            // Corners are `v`, `v/vt` or `v/vt/vn` with vt possibly empty.
+            for (std::string_view corner = NextToken(&rest); !corner.empty();
+                 corner = NextToken(&rest)) {
+                const size_t first_slash = corner.find('/');
+                const size_t second_slash = corner.find('/', first_slash + 1);
+                std::optional<int> normal;
+                if (first_slash != corner.npos && second_slash != corner.npos) {
+                    normal = ScanInt(corner.substr(second_slash + 1));
+                }
+                chunk.corners.emplace_back(ScanInt(corner), normal);
+                ++face.corner_count;
+            }
+            const auto* corners = &chunk.corners[face.first_corner];
+            for (size_t i = 1; i + 1 < face.corner_count; ++i) {
+                if (!corners[0].second || !corners[i].second || !corners[i + 1].second) {
+                    chunk.normals.emplace_back();
+                }
+                face.segment = use_material();
+                ++chunk.triangle_count;
+            }
+            chunk.faces.push_back(face);
+        } else if (keyword == "usemtl") {
+            add_event({ObjChunk::Event::kUsemtl, std::string(TrimBlanks(rest))});
+        } else if (keyword == "mtllib") {
+            add_event({ObjChunk::Event::kMtllib, std::string(TrimBlanks(rest))});
+        } else if (keyword == "S") {
+            const Vector center = ScanVector(&rest);
+            const double radius = ScanLeadingDouble(NextToken(&rest));
+            chunk.spheres.emplace_back(Sphere(center, radius), use_material());
+        } else if (keyword == "P") {
+            const Vector position = ScanVector(&rest);
+            const Vector intensity = ScanVector(&rest);
+            chunk.lights.push_back(Light(position, intensity));
+        } else if (keyword == "I") {
+            // `I file.obj <3, 4 or 12 numbers> [material]`.
+            ObjChunk::Event event{ObjChunk::Event::kInstance, std::string(NextToken(&rest))};
+            for (std::string_view token = NextToken(&rest); !token.empty();
+                 token = NextToken(&rest)) {
+                double number;
+                if (ScanDouble(token, &number)) {
+                    event.numbers.push_back(number);
+                } else if (TrimBlanks(rest).empty()) {
+                    event.material = token;
+                } else {
+                    event.numbers.push_back(ScanLeadingDouble(token));
+                }
+            }
+            const size_t count = event.numbers.size();
+            if (count != 3 && count != 4 && count != 12) {
+                throw std::runtime_error("Instance of " + event.name +
+                                         " needs 3, 4 or 12 numbers, not " +
+                                         std::to_string(count));
+            }
+            add_event(std::move(event));
         }
-    }
-    result[current_material.name] = current_material;
-    return result;
+    });
+    return chunk;
 }
-inline Scene ReadScene(const std::string& filename) {
-    std::vector<Object> objects{};
-    std::vector<SphereObject> sphere_objects{};
-    std::vector<Light> lights{};
-    std::map<std::string, Material> materials;
+
+// Reads an .obj file split into chunks of about `chunk_size` bytes at line boundaries, parsed on
+// `threads` threads (0 for all). The lines that touch materials are then replayed in file order,
+// so ids come out as a serial read gives them, and the chunks are stitched together with their
+// indices shifted by the counts before them. The scene does not depend on the chunking. Throws
+// std::runtime_error for a face index out of range.
+inline Scene ReadScene(const std::string& filename, int threads, size_t chunk_size) {
+    const MappedFile file(filename);
+    std::vector<std::string_view> ranges;
+    for (std::string_view text = file.View(); !text.empty();) {
+        size_t end = text.size() <= chunk_size ? text.npos : text.find('\n', chunk_size - 1);
+        end = end == text.npos ? text.size() : end + 1;
+        ranges.push_back(text.substr(0, end));
+        text.remove_prefix(end);
+    }
+    std::vector<ObjChunk> chunks(ranges.size());
+    ParallelFor(threads, chunks.size(), [&](size_t i) { chunks[i] = ParseObjChunk(ranges[i]); });
+
+    std::vector<Mesh> meshes{};
+    std::vector<Instance> instances{};
+    std::map<std::string, uint32_t> mesh_indices;
+    MaterialTable materials;
     std::string cut_filename =
         static_cast<std::string>(filename.substr(0, filename.find_last_of('/') + 1));
-    std::ifstream infile;
-    infile.open(filename.data());
-
-    std::vector<Vector> vs{Vector()};
-    std::vector<Vector> vns{Vector()};
     std::string current_material;
-    for (std::string line; std::getline(infile, line);) {
-        ReaderObj line_reader(line);
-        if (line_reader.Mtllib()) {
-            materials = ReadMaterials(cut_filename + line_reader.GetMtllibUsemtl());
-        }
-        if (line_reader.Usemtl()) {
-            current_material = line_reader.GetMtllibUsemtl();
-        }
-        if (line_reader.V()) {
-            vs.push_back(line_reader.GetVnV());
-        }
-        if (line_reader.Vn()) {
-            vns.push_back(line_reader.GetVnV());
-        }
-        if (line_reader.P()) {
-            Vector position;
-            Vector intensity;
-            std::tie(position, intensity) = line_reader.GetP();
-            lights.push_back(Light(position, intensity));
+    // Id of current_material, looked up when first used after usemtl or mtllib.
+    std::optional<MaterialId> current_id;
+    std::vector<std::vector<MaterialId>> segment_ids(chunks.size());
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        const ObjChunk& chunk = chunks[c];
+        segment_ids[c].resize(chunk.used.size());
+        for (size_t s = 0; s < chunk.used.size(); ++s) {
+            if (chunk.used[s]) {
+                if (!current_id) {
+                    current_id = materials.Get(current_material);
+                }
+                segment_ids[c][s] = *current_id;
+            }
+            if (s == chunk.events.size()) {
+                break;
+            }
+            const ObjChunk::Event& event = chunk.events[s];
+            if (event.kind == ObjChunk::Event::kMtllib) {
+                ReadMaterials(cut_filename + event.name, &materials);
+                current_id.reset();
+            } else if (event.kind == ObjChunk::Event::kUsemtl) {
+                current_material = event.name;
+                current_id.reset();
+            } else {
+                auto [it, inserted] = mesh_indices.try_emplace(event.name, meshes.size());
+                if (inserted) {
+                    meshes.push_back(ReadMesh(cut_filename + event.name, &materials, threads));
+                }
+                Instance instance;
+                instance.mesh = it->second;
+                instance.transform = InstanceTransform(event.numbers);
+                instance.inverse = instance.transform.Inverse();
+                if (!event.material.empty()) {
+                    instance.material = materials.Get(event.material);
+                }
+                instances.push_back(instance);
+            }
         }
-        if (line_reader.S()) {
-            Vector center;
-            double radius;
-            std::tie(center, radius) = line_reader.GetS();
-            sphere_objects.push_back(
-                SphereObject(&materials[current_material], Sphere(center, radius)));
+    }
+
+    // Where every chunk starts in the merged buffers.
+    std::vector<size_t> vertex_offsets{0}, normal_offsets{0}, vn_offsets{0}, triangle_offsets{0};
+    for (const ObjChunk& chunk : chunks) {
+        vertex_offsets.push_back(vertex_offsets.back() + chunk.vertices.size());
+        normal_offsets.push_back(normal_offsets.back() + chunk.normals.size());
+        vn_offsets.push_back(vn_offsets.back() + chunk.vn_slots.size());
+        triangle_offsets.push_back(triangle_offsets.back() + chunk.triangle_count);
+    }
+    std::vector<Vector> vertices(vertex_offsets.back());
+    std::vector<Vector> normals(normal_offsets.back());
+    // Normals of the file in its order.
+    std::vector<uint32_t> normal_ids(vn_offsets.back());
+    ParallelFor(threads, chunks.size(), [&](size_t c) {
+        const ObjChunk& chunk = chunks[c];
+        std::copy(chunk.vertices.begin(), chunk.vertices.end(),
+                  vertices.begin() + vertex_offsets[c]);
+        std::copy(chunk.normals.begin(), chunk.normals.end(),
+                  normals.begin() + normal_offsets[c]);
+        for (size_t i = 0; i < chunk.vn_slots.size(); ++i) {
+            normal_ids[vn_offsets[c] + i] = normal_offsets[c] + chunk.vn_slots[i];
         }
-        if (line_reader.F()) {
-            auto v = line_reader.GetF();
-            std::vector<Triangle> triangles{};
-            std::vector<std::array<Vector, 3>> normals{};
-            int l = v.size();
-            int ind_v0;
-            std::optional<int> ind_vn0;
-            std::tie(ind_v0, ind_vn0) = v[0];
-            int vss = vs.size();
-            int vnss = vns.size();
-            Vector v0 = vs[(vss + ind_v0) % vss];
-
-            for (int i = 1; i < l - 1; ++i) {
-                int ind_v1, ind_v2;
-                std::optional<int> ind_vn1, ind_vn2;
-                std::tie(ind_v1, ind_vn1) = v[i];
-                std::tie(ind_v2, ind_vn2) = v[i + 1];
-                Triangle triangle({v0, vs[(vss + ind_v1) % vss], vs[(vss + ind_v2) % vss]});
-                triangles.push_back(triangle);
-                if (ind_vn0.has_value() && ind_vn1.has_value() && ind_vn2.has_value()) {
-                    normals.push_back({vns[(vnss + ind_vn0.value()) % vnss],
-                                       vns[(vnss + ind_vn1.value()) % vnss],
-                                       vns[(vnss + ind_vn2.value()) % vnss]});
+    });
+    std::vector<uint32_t> vertex_indices(3 * triangle_offsets.back());
+    std::vector<uint32_t> normal_indices(3 * triangle_offsets.back());
+    std::vector<MaterialId> triangle_materials(triangle_offsets.back());
+    ParallelFor(threads, chunks.size(), [&](size_t c) {
+        const ObjChunk& chunk = chunks[c];
+        for (const ObjChunk::Face& face : chunk.faces) {
+            const auto* corners = &chunk.corners[face.first_corner];
+            auto vertex = [&](size_t k) {
+                return ObjIndex(corners[k].first, vertex_offsets[c] + face.vertex_count,
+                                vertices.size());
+            };
+            auto normal = [&](size_t k) {
+                return normal_ids[ObjIndex(*corners[k].second, vn_offsets[c] + face.vn_count,
+                                           normal_ids.size())];
+            };
+            size_t triangle = triangle_offsets[c] + face.first_triangle;
+            uint32_t flat = normal_offsets[c] + face.first_flat;
+            for (size_t i = 1; i + 1 < face.corner_count; ++i, ++triangle) {
+                std::array<uint32_t, 3> vertex_ids{vertex(0), vertex(i), vertex(i + 1)};
+                std::array<uint32_t, 3> normal_slots{flat, flat, flat};
+                if (corners[0].second && corners[i].second && corners[i + 1].second) {
+                    normal_slots = {normal(0), normal(i), normal(i + 1)};
                 } else {
-                    Vector normal = triangle.GetNormal();
-                    normals.push_back({normal, normal, normal});
+                    Triangle polygon{vertices[vertex_ids[0]], vertices[vertex_ids[1]],
+                                     vertices[vertex_ids[2]]};
+                    normals[flat++] = polygon.GetNormal();
                 }
+                std::copy(vertex_ids.begin(), vertex_ids.end(),
+                          vertex_indices.begin() + 3 * triangle);
+                std::copy(normal_slots.begin(), normal_slots.end(),
+                          normal_indices.begin() + 3 * triangle);
+                triangle_materials[triangle] = segment_ids[c][face.segment];
             }
-            for (int i = 0; i < l - 2; ++i) {
-                objects.push_back(Object(&materials[current_material], triangles[i], normals[i]));
-            }
+        }
+    });
+
+    std::vector<SphereObject> sphere_objects{};
+    std::vector<Light> lights{};
+    for (size_t c = 0; c < chunks.size(); ++c) {
+        for (const auto& [sphere, segment] : chunks[c].spheres) {
+            sphere_objects.push_back(SphereObject(segment_ids[c][segment], sphere));
+        }
+        for (const Light& light : chunks[c].lights) {
+            lights.push_back(light);
         }
     }
-    return Scene(materials, lights, sphere_objects, objects);
+    TriangleMesh triangles(std::move(vertices), std::move(normals), std::move(vertex_indices),
+                           std::move(normal_indices), std::move(triangle_materials));
+    return Scene(std::move(materials), lights, sphere_objects, std::move(triangles),
+                 std::move(meshes), instances);
 }
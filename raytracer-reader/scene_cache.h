@@ -0,0 +1,459 @@
+#pragma once
+
+#include <scene.h>
+#include <mapped_file.h>
+
+#include <cstdint>
+#include <cstring>
+#include <cstdio>
+#include <fstream>
+#include <optional>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <vector>
+
+// Sidecar cache of a parsed scene with its hierarchies, stored next to the .obj file. It is
+// keyed by a hash of every file the scene reads, so editing the .obj, a .mtl or an instanced
+// mesh invalidates it.
+
+inline constexpr char kSceneCacheMagic[8] = {'R', 'T', 'S', 'C', 'A', 'C', 'H', 'E'};
+inline constexpr uint32_t kSceneCacheVersion = 6;
+// Arrays start this many bytes into the file or a multiple of it, so in a mapped file they are
+// aligned for direct use.
+inline constexpr size_t kArrayAlignment = 64;
+
+// Records hold Scalar values, so builds of different precision keep separate caches.
+inline std::string SceneCachePath(const std::string& filename) {
+    return filename + (sizeof(Scalar) == sizeof(double) ? ".cache" : ".f32.cache");
+}
+
+// 64-bit FNV-1a.
+inline uint64_t HashBytes(std::string_view bytes, uint64_t hash = 14695981039346656037ull) {
+    for (char c : bytes) {
+        hash = (hash ^ static_cast<unsigned char>(c)) * 1099511628211ull;
+    }
+    return hash;
+}
+
+// Prefixed with the size, so that the boundaries between files count.
+inline uint64_t HashSizedBytes(std::string_view bytes, uint64_t hash) {
+    uint64_t size = bytes.size();
+    hash = HashBytes({reinterpret_cast<const char*>(&size), sizeof(size)}, hash);
+    return HashBytes(bytes, hash);
+}
+
+// Hash of the contents of the .obj file and, recursively, of the material libraries and meshes
+// it refers to.
+inline uint64_t HashSceneFiles(const std::string& filename, uint64_t hash = HashBytes("")) {
+    const MappedFile file(filename);
+    const std::string_view data = file.View();
+    hash = HashSizedBytes(data, hash);
+    std::string cut_filename = filename.substr(0, filename.find_last_of('/') + 1);
+    size_t begin = 0;
+    while (begin < data.size()) {
+        size_t end = data.find('\n', begin);
+        if (end == std::string_view::npos) {
+            end = data.size();
+        }
+        std::string_view rest = data.substr(begin, end - begin);
+        const std::string_view keyword = NextToken(&rest);
+        if (keyword == "mtllib") {
+            const std::string mtl_filename = cut_filename + std::string(TrimBlanks(rest));
+            hash = HashSizedBytes(MappedFile(mtl_filename).View(), hash);
+        } else if (keyword == "I") {
+            hash = HashSceneFiles(cut_filename + std::string(NextToken(&rest)), hash);
+        }
+        begin = end + 1;
+    }
+    return hash;
+}
+
+class CacheWriter {
+public:
+    template <class T>
+    void Put(const T& value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        data_.append(reinterpret_cast<const char*>(&value), sizeof(T));
+    }
+    template <class T>
+    void PutArray(const std::vector<T>& values) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        Put<uint64_t>(values.size());
+        Align();
+        data_.append(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(T));
+    }
+    void PutString(std::string_view s) {
+        Put<uint64_t>(s.size());
+        data_.append(s);
+    }
+    // Bytes as they are, e.g. records written by another writer.
+    void PutBytes(std::string_view bytes) {
+        data_.append(bytes);
+    }
+    // Pads the data to a multiple of kArrayAlignment.
+    void Align() {
+        data_.resize((data_.size() + kArrayAlignment - 1) / kArrayAlignment * kArrayAlignment);
+    }
+    const std::string& Data() const {
+        return data_;
+    }
+
+private:
+    std::string data_;
+};
+
+// Reads what CacheWriter wrote. Every getter returns false once the data runs out.
+class CacheReader {
+public:
+    explicit CacheReader(std::string_view data) : begin_(data.data()), data_(data) {
+    }
+
+    template <class T>
+    bool Get(T* value) {
+        static_assert(std::is_trivially_copyable_v<T>);
+        if (data_.size() < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(value, data_.data(), sizeof(T));
+        data_.remove_prefix(sizeof(T));
+        return true;
+    }
+    template <class T>
+    bool GetArray(std::vector<T>* values) {
+        uint64_t size;
+        if (!Get(&size)) {
+            return false;
+        }
+        size_t padding = (kArrayAlignment - Offset() % kArrayAlignment) % kArrayAlignment;
+        if (padding > data_.size() || size > (data_.size() - padding) / sizeof(T)) {
+            return false;
+        }
+        data_.remove_prefix(padding);
+        values->resize(size);
+        std::memcpy(values->data(), data_.data(), size * sizeof(T));
+        data_.remove_prefix(size * sizeof(T));
+        return true;
+    }
+    bool GetString(std::string* s) {
+        uint64_t size;
+        if (!Get(&size) || size > data_.size()) {
+            return false;
+        }
+        *s = data_.substr(0, size);
+        data_.remove_prefix(size);
+        return true;
+    }
+    // Bytes read so far.
+    size_t Offset() const {
+        return data_.data() - begin_;
+    }
+
+private:
+    const char* begin_;
+    std::string_view data_;
+};
+
+// Flat records of the cache file. Materials are referred to by their MaterialId. Triangles are
+// stored as the buffers of their TriangleMesh followed by the material ids.
+struct CachedSphere {
+    MaterialId material;
+    Sphere sphere;
+};
+struct CachedInstance {
+    uint32_t mesh;
+    uint32_t material;  // UINT32_MAX if the mesh keeps its own materials
+    Transform transform;
+    Transform inverse;
+};
+struct CachedLight {
+    Vector position;
+    Vector intensity;
+};
+
+inline void PutTriangles(const TriangleMesh& triangles, CacheWriter* writer) {
+    writer->PutArray(triangles.GetVertexBuffer());
+    writer->PutArray(triangles.GetNormalBuffer());
+    writer->PutArray(triangles.GetVertexIndices());
+    writer->PutArray(triangles.GetNormalIndices());
+    std::vector<MaterialId> materials;
+    materials.reserve(triangles.Size());
+    for (size_t i = 0; i < triangles.Size(); ++i) {
+        materials.push_back(triangles.GetMaterial(i));
+    }
+    writer->PutArray(materials);
+}
+// Checks every index, with `material_count` materials in the table, so that a damaged file
+// cannot send a lookup out of bounds.
+inline bool GetTriangles(CacheReader* reader, size_t material_count, TriangleMesh* triangles) {
+    std::vector<Vector> vertices, normals;
+    std::vector<uint32_t> vertex_indices, normal_indices;
+    std::vector<MaterialId> material_ids;
+    if (!reader->GetArray(&vertices) || !reader->GetArray(&normals) ||
+        !reader->GetArray(&vertex_indices) || !reader->GetArray(&normal_indices) ||
+        !reader->GetArray(&material_ids) || vertex_indices.size() != 3 * material_ids.size() ||
+        normal_indices.size() != vertex_indices.size()) {
+        return false;
+    }
+    for (size_t i = 0; i < vertex_indices.size(); ++i) {
+        if (vertex_indices[i] >= vertices.size() || normal_indices[i] >= normals.size()) {
+            return false;
+        }
+    }
+    for (MaterialId id : material_ids) {
+        if (id >= material_count) {
+            return false;
+        }
+    }
+    *triangles = TriangleMesh(std::move(vertices), std::move(normals), std::move(vertex_indices),
+                              std::move(normal_indices), std::move(material_ids));
+    return true;
+}
+
+inline void PutBvh(const Bvh& bvh, CacheWriter* writer) {
+    writer->PutArray(bvh.GetNodes());
+    writer->PutArray(bvh.GetPrimitives());
+}
+// Also checks that the tree is well formed over `primitive_count` primitives, so that a damaged
+// file cannot send a traversal out of bounds: every node is reached once, each subtree takes a
+// contiguous run of nodes starting at its root, and no path is deeper than the fixed traversal
+// stacks allow.
+inline bool GetBvh(CacheReader* reader, size_t primitive_count, Bvh* bvh) {
+    std::vector<BvhNode> nodes;
+    std::vector<uint32_t> primitives;
+    if (!reader->GetArray(&nodes) || !reader->GetArray(&primitives) ||
+        primitives.size() != primitive_count || (nodes.empty() != primitives.empty())) {
+        return false;
+    }
+    for (uint32_t primitive : primitives) {
+        if (primitive >= primitive_count) {
+            return false;
+        }
+    }
+    // Subtrees to check: root, end of its run of nodes and depth.
+    struct Subtree {
+        size_t root, end;
+        int depth;
+    };
+    std::vector<Subtree> pending;
+    if (!nodes.empty()) {
+        pending.push_back({0, nodes.size(), 1});
+    }
+    while (!pending.empty()) {
+        const auto [i, end, depth] = pending.back();
+        pending.pop_back();
+        const BvhNode& node = nodes[i];
+        if (depth > Bvh::kMaxDepth) {
+            return false;
+        }
+        if (node.IsLeaf()) {
+            if (end != i + 1 ||
+                node.offset + static_cast<uint64_t>(node.count) > primitives.size()) {
+                return false;
+            }
+            continue;
+        }
+        if (node.offset <= i + 1 || node.offset >= end) {
+            return false;
+        }
+        pending.push_back({i + 1, node.offset, depth + 1});
+        pending.push_back({node.offset, end, depth + 1});
+    }
+    *bvh = Bvh(std::move(nodes), std::move(primitives));
+    return true;
+}
+
+// Everything in the scene, hierarchies included, as flat arrays.
+inline void PutScene(const Scene& scene, CacheWriter* out) {
+    CacheWriter& writer = *out;
+    // The table in id order, then every name with its id.
+    const MaterialTable& table = scene.GetMaterials();
+    writer.Put<uint64_t>(table.Size());
+    for (const Material& material : table.GetMaterials()) {
+        writer.PutString(material.name);
+        writer.Put(material.ambient_color);
+        writer.Put(material.diffuse_color);
+        writer.Put(material.specular_color);
+        writer.Put(material.intensity);
+        writer.Put(material.specular_exponent);
+        writer.Put(material.refraction_index);
+        writer.Put(material.albedo);
+    }
+    writer.Put<uint64_t>(table.GetNames().size());
+    for (const auto& [name, id] : table.GetNames()) {
+        writer.PutString(name);
+        writer.Put(id);
+    }
+    std::vector<CachedLight> lights;
+    for (const Light& light : scene.GetLights()) {
+        lights.push_back({light.position, light.intensity});
+    }
+    writer.PutArray(lights);
+    PutTriangles(scene.GetTriangles(), &writer);
+    std::vector<CachedSphere> spheres;
+    for (const SphereObject& sphere_object : scene.GetSphereObjects()) {
+        spheres.push_back({sphere_object.material, sphere_object.sphere});
+    }
+    writer.PutArray(spheres);
+    writer.Put<uint64_t>(scene.GetMeshes().size());
+    for (const Mesh& mesh : scene.GetMeshes()) {
+        PutTriangles(mesh.triangles, &writer);
+        PutBvh(mesh.bvh, &writer);
+    }
+    std::vector<CachedInstance> instances;
+    for (const Instance& instance : scene.GetInstances()) {
+        instances.push_back(
+            {instance.mesh,
+             instance.material ? *instance.material : UINT32_MAX,
+             instance.transform, instance.inverse});
+    }
+    writer.PutArray(instances);
+    PutBvh(scene.GetBvh(), &writer);
+}
+
+// Writes `data` to `path` through a temporary file; false if that fails.
+inline bool WriteFileAtomically(const std::string& path, std::string_view data) {
+    const std::string temporary = path + ".tmp" + std::to_string(getpid());
+    FILE* file = std::fopen(temporary.c_str(), "wb");
+    if (!file) {
+        return false;
+    }
+    bool written = std::fwrite(data.data(), 1, data.size(), file) == data.size();
+    written = std::fclose(file) == 0 && written;
+    if (!written || std::rename(temporary.c_str(), path.c_str()) != 0) {
+        std::remove(temporary.c_str());
+        return false;
+    }
+    return true;
+}
+
+inline void SaveSceneCache(const Scene& scene, const std::string& path, uint64_t hash) {
+    CacheWriter writer;
+    writer.Put(kSceneCacheMagic);
+    writer.Put(kSceneCacheVersion);
+    writer.Put<uint32_t>(sizeof(Scalar));
+    writer.Put(hash);
+    PutScene(scene, &writer);
+    // Written aside and renamed, so readers never see a partial file. A cache that cannot be
+    // written is simply not there next time.
+    WriteFileAtomically(path, writer.Data());
+}
+
+// What PutScene wrote, checked so that a damaged file cannot send a lookup or a traversal out of
+// bounds; nothing if it does not hold a valid scene.
+inline std::optional<Scene> GetScene(CacheReader* in) {
+    CacheReader& reader = *in;
+    // Added in id order, each material keeps its id; the other names then join theirs.
+    uint64_t material_count, name_count;
+    if (!reader.Get(&material_count) || material_count > MaterialTable::kMaxSize) {
+        return std::nullopt;
+    }
+    MaterialTable materials;
+    for (uint64_t i = 0; i < material_count; ++i) {
+        Material material;
+        if (!reader.GetString(&material.name) || !reader.Get(&material.ambient_color) ||
+            !reader.Get(&material.diffuse_color) || !reader.Get(&material.specular_color) ||
+            !reader.Get(&material.intensity) || !reader.Get(&material.specular_exponent) ||
+            !reader.Get(&material.refraction_index) || !reader.Get(&material.albedo)) {
+            return std::nullopt;
+        }
+        if (materials.Add(material) != i) {
+            return std::nullopt;
+        }
+    }
+    if (!reader.Get(&name_count)) {
+        return std::nullopt;
+    }
+    for (uint64_t i = 0; i < name_count; ++i) {
+        std::string name;
+        MaterialId id;
+        if (!reader.GetString(&name) || !reader.Get(&id) || id >= materials.Size()) {
+            return std::nullopt;
+        }
+        Material alias = materials[id];
+        alias.name = std::move(name);
+        if (materials.Add(alias) != id) {
+            return std::nullopt;
+        }
+    }
+    std::vector<CachedLight> cached_lights;
+    TriangleMesh triangles;
+    std::vector<CachedSphere> cached_spheres;
+    uint64_t mesh_count;
+    if (!reader.GetArray(&cached_lights) || !GetTriangles(&reader, materials.Size(), &triangles) ||
+        !reader.GetArray(&cached_spheres) || !reader.Get(&mesh_count)) {
+        return std::nullopt;
+    }
+    std::vector<Light> lights;
+    for (const CachedLight& light : cached_lights) {
+        lights.emplace_back(light.position, light.intensity);
+    }
+    std::vector<SphereObject> sphere_objects;
+    for (const CachedSphere& sphere : cached_spheres) {
+        if (sphere.material >= materials.Size()) {
+            return std::nullopt;
+        }
+        sphere_objects.push_back(SphereObject(sphere.material, sphere.sphere));
+    }
+    std::vector<Mesh> meshes;
+    for (uint64_t i = 0; i < mesh_count; ++i) {
+        Mesh& mesh = meshes.emplace_back();
+        if (!GetTriangles(&reader, materials.Size(), &mesh.triangles) ||
+            !GetBvh(&reader, mesh.triangles.Size(), &mesh.bvh)) {
+            return std::nullopt;
+        }
+    }
+    std::vector<CachedInstance> cached_instances;
+    Bvh bvh;
+    if (!reader.GetArray(&cached_instances) ||
+        !GetBvh(&reader, triangles.Size() + sphere_objects.size() + cached_instances.size(),
+                &bvh)) {
+        return std::nullopt;
+    }
+    std::vector<Instance> instances;
+    for (const CachedInstance& cached : cached_instances) {
+        if (cached.mesh >= meshes.size() ||
+            (cached.material != UINT32_MAX && cached.material >= materials.Size())) {
+            return std::nullopt;
+        }
+        std::optional<MaterialId> material;
+        if (cached.material != UINT32_MAX) {
+            material = cached.material;
+        }
+        instances.push_back({cached.mesh, cached.transform, cached.inverse, material});
+    }
+    return Scene(std::move(materials), lights, sphere_objects, std::move(triangles),
+                 std::move(meshes), instances, std::move(bvh));
+}
+
+// The cached scene, or nothing if the cache is missing, stale or damaged.
+inline std::optional<Scene> LoadSceneCache(const std::string& path, uint64_t hash) {
+    const MappedFile file(path);
+    CacheReader reader(file.View());
+    char magic[sizeof(kSceneCacheMagic)];
+    uint32_t version, scalar_size;
+    uint64_t cached_hash;
+    if (!reader.Get(&magic) || std::memcmp(magic, kSceneCacheMagic, sizeof(magic)) != 0 ||
+        !reader.Get(&version) || version != kSceneCacheVersion || !reader.Get(&scalar_size) ||
+        scalar_size != sizeof(Scalar) || !reader.Get(&cached_hash) || cached_hash != hash) {
+        return std::nullopt;
+    }
+    return GetScene(&reader);
+}
+
+// ReadScene that goes through the sidecar cache: a valid cache skips parsing and building,
+// otherwise the scene is read as usual, on `threads` threads, and the cache is rewritten. A file
+// that can't be opened is read as ReadScene does, without a cache.
+inline Scene ReadSceneCached(const std::string& filename, int threads = 0) {
+    if (!std::ifstream(filename)) {
+        return ReadScene(filename, threads);
+    }
+    const uint64_t hash = HashSceneFiles(filename);
+    const std::string path = SceneCachePath(filename);
+    if (std::optional<Scene> scene = LoadSceneCache(path, hash)) {
+        return std::move(*scene);
+    }
+    Scene scene = ReadScene(filename, threads);
+    SaveSceneCache(scene, path, hash);
+    return scene;
+}
@@ -0,0 +1,70 @@
+#pragma once
+
+#include <scene_cache.h>
+
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+
+// Compiled scene file, shipped in place of .obj and .mtl text: the records of the scene cache,
+// hierarchies included, under a header of its own instead of a hash of the sources. Loading is
+// a mapping of the file, checks of every index and bulk copies of its aligned arrays; nothing
+// is parsed, triangulated or looked up by name.
+
+inline constexpr char kSceneFileMagic[8] = {'R', 'T', 'S', 'C', 'E', 'N', 'E', '\0'};
+// Version of the header; the records carry kSceneCacheVersion. Files of other versions, of the
+// other byte order or of the other Scalar precision are refused.
+inline constexpr uint32_t kSceneFileVersion = 1;
+inline constexpr uint32_t kByteOrderMark = 0x01020304;
+inline constexpr std::string_view kSceneFileExtension = ".rtscene";
+
+inline bool IsSceneFile(std::string_view filename) {
+    return filename.ends_with(kSceneFileExtension);
+}
+
+// Throws std::runtime_error if the file cannot be written.
+inline void SaveSceneFile(const Scene& scene, const std::string& path) {
+    CacheWriter writer;
+    writer.Put(kSceneFileMagic);
+    writer.Put(kSceneFileVersion);
+    writer.Put(kByteOrderMark);
+    writer.Put<uint32_t>(sizeof(Scalar));
+    writer.Put(kSceneCacheVersion);
+    PutScene(scene, &writer);
+    if (!WriteFileAtomically(path, writer.Data())) {
+        throw std::runtime_error("Can't write " + path);
+    }
+}
+
+// The scene in the file, or nothing if it is missing, damaged or of another version.
+inline std::optional<Scene> LoadSceneFile(const std::string& path) {
+    const MappedFile file(path);
+    CacheReader reader(file.View());
+    char magic[sizeof(kSceneFileMagic)];
+    uint32_t version, byte_order, scalar_size, record_version;
+    if (!reader.Get(&magic) || std::memcmp(magic, kSceneFileMagic, sizeof(magic)) != 0 ||
+        !reader.Get(&version) || version != kSceneFileVersion || !reader.Get(&byte_order) ||
+        byte_order != kByteOrderMark || !reader.Get(&scalar_size) ||
+        scalar_size != sizeof(Scalar) || !reader.Get(&record_version) ||
+        record_version != kSceneCacheVersion) {
+        return std::nullopt;
+    }
+    return GetScene(&reader);
+}
+
+// A compiled scene file by its extension, anything else as an .obj file through the sidecar
+// cache, read on `threads` threads. Throws std::runtime_error for a scene file that does not
+// load.
+inline Scene LoadScene(const std::string& filename, int threads = 0) {
+    if (!IsSceneFile(filename)) {
+        return ReadSceneCached(filename, threads);
+    }
+    std::optional<Scene> scene = LoadSceneFile(filename);
+    if (!scene) {
+        throw std::runtime_error("Not a valid scene file: " + filename);
+    }
+    return std::move(*scene);
+}
@@ -2,31 +2,106 @@
 #include <util.h>
 
 #include <scene.h>
+#include <scene_cache.h>
+#include <scene_file.h>
+#include <paged_scene.h>
+#include <primitive_store.h>
+
+#include <algorithm>
+#include <cassert>
+#include <cctype>
+#include <charconv>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <optional>
+#include <random>
+#include <set>
+#include <sstream>
+#include <tuple>
+#include <filesystem>
+#include <fstream>
+
+// Same geometry, materials and ids, value for value; the normals of degenerate faces are NaN on
+// both sides.
+void RequireSameScene(const Scene& lhs, const Scene& rhs) {
+    auto require_same = [](const std::vector<Vector>& lhs, const std::vector<Vector>& rhs) {
+        REQUIRE(lhs.size() == rhs.size());
+        for (size_t i = 0; i < lhs.size(); ++i) {
+            for (size_t k = 0; k < 3; ++k) {
+                REQUIRE((lhs[i][k] == rhs[i][k] ||
+                         (std::isnan(lhs[i][k]) && std::isnan(rhs[i][k]))));
+            }
+        }
+    };
+    const TriangleMesh &left = lhs.GetTriangles(), &right = rhs.GetTriangles();
+    require_same(left.GetVertexBuffer(), right.GetVertexBuffer());
+    require_same(left.GetNormalBuffer(), right.GetNormalBuffer());
+    REQUIRE(left.GetVertexIndices() == right.GetVertexIndices());
+    REQUIRE(left.GetNormalIndices() == right.GetNormalIndices());
+    for (size_t i = 0; i < left.Size(); ++i) {
+        REQUIRE(left.GetMaterial(i) == right.GetMaterial(i));
+    }
+
+    REQUIRE(lhs.GetMaterials().GetNames() == rhs.GetMaterials().GetNames());
+    REQUIRE(lhs.GetMaterials().Size() == rhs.GetMaterials().Size());
+    for (MaterialId id = 0; id < lhs.GetMaterials().Size(); ++id) {
+        const Material &a = lhs.GetMaterials()[id], &b = rhs.GetMaterials()[id];
+        REQUIRE(a.name == b.name);
+        require_same({a.ambient_color, a.diffuse_color, a.specular_color, a.intensity},
+                     {b.ambient_color, b.diffuse_color, b.specular_color, b.intensity});
+        REQUIRE(a.specular_exponent == b.specular_exponent);
+        REQUIRE(a.refraction_index == b.refraction_index);
+        REQUIRE(a.albedo == b.albedo);
+    }
+
+    REQUIRE(lhs.GetSphereObjects().size() == rhs.GetSphereObjects().size());
+    for (size_t i = 0; i < lhs.GetSphereObjects().size(); ++i) {
+        const SphereObject &a = lhs.GetSphereObjects()[i], &b = rhs.GetSphereObjects()[i];
+        REQUIRE(a.material == b.material);
+        REQUIRE(Length(a.sphere.GetCenter() - b.sphere.GetCenter()) == 0);
+        REQUIRE(a.sphere.GetRadius() == b.sphere.GetRadius());
+    }
+    REQUIRE(lhs.GetLights().size() == rhs.GetLights().size());
+    for (size_t i = 0; i < lhs.GetLights().size(); ++i) {
+        require_same({lhs.GetLights()[i].position, lhs.GetLights()[i].intensity},
+                     {rhs.GetLights()[i].position, rhs.GetLights()[i].intensity});
+    }
+    REQUIRE(lhs.GetInstances().size() == rhs.GetInstances().size());
+    REQUIRE(lhs.GetMeshes().size() == rhs.GetMeshes().size());
+    REQUIRE(lhs.GetBvh().GetPrimitives() == rhs.GetBvh().GetPrimitives());
+}
 
 TEST_CASE("Scene", "[raytracer]") {
     const auto current_dir = GetFileDir(__FILE__);
     const auto scene = ReadScene(current_dir / "tests/box/cube.obj");
     const auto eps = 1e-6;
 
-    const auto& materials_map = scene.GetMaterials();
-    REQUIRE(materials_map.size() == 9);
+    const auto& materials = scene.GetMaterials();
+    REQUIRE(materials.GetNames().size() == 9);
+    // floor and backWall are equal, so they share one entry under the first name.
+    REQUIRE(materials.Size() == 8);
+    REQUIRE(materials.Find("backWall") == materials.Find("floor"));
+    REQUIRE(materials[*materials.Find("backWall")].name == "floor");
+    REQUIRE(materials.Find("leftWall") != materials.Find("rightWall"));
+    REQUIRE(!materials.Find("nothing"));
 
-    // objects
-    const auto& objects = scene.GetObjects();
-    REQUIRE(objects.size() == 10);
+    // triangles
+    const auto& triangles = scene.GetTriangles();
+    REQUIRE(triangles.Size() == 10);
 
-    const auto& vertex_coord_check = objects[0].polygon.GetVertex(0);
+    const Vector vertex_coord_check = triangles.GetTriangle(0).GetVertex(0);
     REQUIRE(std::fabs(vertex_coord_check[0] - 1.) < eps);
     REQUIRE(std::fabs(vertex_coord_check[1] - 0.) < eps);
     REQUIRE(std::fabs(vertex_coord_check[2] - (-1.04)) < eps);
 
-    const auto& normal_check = *objects[1].GetNormal(1);
+    const Vector normal_check = triangles.GetNormals(1)[1];
     REQUIRE(std::fabs(normal_check[0] - 0.) < eps);
     REQUIRE(std::fabs(normal_check[1] - 1.) < eps);
     REQUIRE(std::fabs(normal_check[2] - 0.) < eps);
 
-    for (const auto& object : objects) {
-        REQUIRE(materials_map.contains(object.material->name));
+    for (size_t i = 0; i < triangles.Size(); ++i) {
+        REQUIRE(triangles.GetMaterial(i) < materials.Size());
     }
 
     // spheres
@@ -39,7 +114,7 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(center[2] - (-0.4)) < eps);
     REQUIRE(std::fabs(spheres[0].sphere.GetRadius() - 0.3) < eps);
     for (const auto& sphere : spheres) {
-        REQUIRE(materials_map.find(sphere.material->name) != materials_map.end());
+        REQUIRE(sphere.material < materials.Size());
     }
 
     // lights
@@ -52,21 +127,815 @@ TEST_CASE("Scene", "[raytracer]") {
     REQUIRE(std::fabs(lights[1].intensity[2] - 0.5) < eps);
 
     // materials
-    const auto& right_sphere = materials_map.at("rightSphere");
+    const auto& right_sphere = materials[*materials.Find("rightSphere")];
     REQUIRE(std::fabs(right_sphere.albedo[0] - 0.) < eps);
     REQUIRE(std::fabs(right_sphere.albedo[1] - 0.3) < eps);
     REQUIRE(std::fabs(right_sphere.albedo[2] - 0.7) < eps);
     REQUIRE(std::fabs(right_sphere.specular_exponent - 1024) < eps);
     REQUIRE(std::fabs(right_sphere.refraction_index - 1.8) < eps);
 
-    const auto& light = materials_map.at("light");
+    const auto& light = materials[*materials.Find("light")];
     REQUIRE(std::fabs(light.ambient_color[1] - 0.78) < eps);
     REQUIRE(std::fabs(light.diffuse_color[2] - 0.78) < eps);
     REQUIRE(std::fabs(light.specular_color[1] - 0.) < eps);
     REQUIRE(std::fabs(light.intensity[2] - 1.) < eps);
 
-    const auto& wall_behind_diffuse = materials_map.at("wallBehind").diffuse_color;
+    const auto& wall_behind_diffuse = materials[*materials.Find("wallBehind")].diffuse_color;
     REQUIRE(std::fabs(wall_behind_diffuse[0] - 0.2) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[1] - 0.7) < eps);
     REQUIRE(std::fabs(wall_behind_diffuse[2] - 0.8) < eps);
+
+    // A full table still takes names of materials it has, but no new material.
+    MaterialTable full;
+    Material material{};
+    for (size_t i = 0; i < MaterialTable::kMaxSize; ++i) {
+        material.name = std::to_string(i);
+        material.specular_exponent = i;
+        REQUIRE(full.Add(material) == i);
+    }
+    material.name = "last";
+    REQUIRE(full.Add(material) == MaterialTable::kMaxSize - 1);
+    REQUIRE(full.Get("0") == 0);
+    material.name = "new";
+    material.specular_exponent = -1;
+    REQUIRE_THROWS_AS(full.Add(material), std::runtime_error);
+    REQUIRE(full.Get("default") == 0);
+    REQUIRE(full.Size() == MaterialTable::kMaxSize);
+    REQUIRE(!full.Find("new"));
+}
+
+TEST_CASE("Scene cache", "[raytracer]") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto dir = std::filesystem::temp_directory_path() / "raytracer_reader_cache";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    for (const char* name : {"cube.obj", "CornellBox-Sphere.mtl"}) {
+        std::filesystem::copy_file(current_dir / "tests/box" / name, dir / name);
+    }
+    const std::string obj = dir / "cube.obj";
+    const std::string cache = SceneCachePath(obj);
+
+    const auto expected = ReadScene(obj);
+    REQUIRE(!LoadSceneCache(cache, HashSceneFiles(obj)));
+    ReadSceneCached(obj);
+    const auto cached = LoadSceneCache(cache, HashSceneFiles(obj));
+    REQUIRE(cached);
+
+    REQUIRE(cached->GetMaterials().Size() == expected.GetMaterials().Size());
+    REQUIRE(cached->GetLights().size() == expected.GetLights().size());
+    REQUIRE(cached->GetTriangles().Size() == expected.GetTriangles().Size());
+    REQUIRE(cached->GetTriangles().GetVertexIndices() ==
+            expected.GetTriangles().GetVertexIndices());
+    for (size_t i = 0; i < expected.GetTriangles().Size(); ++i) {
+        const Object lhs = cached->GetTriangles().GetObject(i);
+        const Object rhs = expected.GetTriangles().GetObject(i);
+        REQUIRE(lhs.material == rhs.material);
+        for (size_t j = 0; j < 3; ++j) {
+            REQUIRE(Length(lhs.polygon.GetVertex(j) - rhs.polygon.GetVertex(j)) == 0);
+            REQUIRE(Length(lhs.normals[j] - rhs.normals[j]) == 0);
+        }
+    }
+    REQUIRE(cached->GetSphereObjects().size() == expected.GetSphereObjects().size());
+    REQUIRE(cached->GetSphereObjects()[1].material == expected.GetSphereObjects()[1].material);
+    REQUIRE(cached->GetMaterials().GetNames() == expected.GetMaterials().GetNames());
+    REQUIRE(cached->GetBvh().GetPrimitives() == expected.GetBvh().GetPrimitives());
+    REQUIRE(cached->GetBvh().GetNodes().size() == expected.GetBvh().GetNodes().size());
+
+    // Any edit of an input invalidates the cache, and the next read writes it again.
+    std::ofstream(dir / "CornellBox-Sphere.mtl", std::ios::app) << "\n";
+    REQUIRE(!LoadSceneCache(cache, HashSceneFiles(obj)));
+    REQUIRE(ReadSceneCached(obj).GetTriangles().Size() == expected.GetTriangles().Size());
+    REQUIRE(LoadSceneCache(cache, HashSceneFiles(obj)));
+
+    // So does damage to the cache itself.
+    std::filesystem::resize_file(cache, std::filesystem::file_size(cache) / 2);
+    REQUIRE(!LoadSceneCache(cache, HashSceneFiles(obj)));
+
+    // A missing file gets no cache.
+    const std::string missing = dir / "missing.obj";
+    REQUIRE(ReadSceneCached(missing).GetTriangles().Size() == 0);
+    REQUIRE(!std::filesystem::exists(SceneCachePath(missing)));
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Stored hierarchy checks", "[raytracer]") {
+    // A chain of `depth` interior nodes down the left, each with a leaf on the right, laid out
+    // as the builder lays trees out: the left subtree right after its parent.
+    auto chain = [](int depth) {
+        std::vector<BvhNode> nodes(2 * depth + 1);
+        for (int i = 0; i < depth; ++i) {
+            nodes[i].offset = 2 * depth - i;
+        }
+        for (int i = depth; i <= 2 * depth; ++i) {
+            nodes[i].count = 1;
+        }
+        return nodes;
+    };
+    auto load = [](std::vector<BvhNode> nodes) {
+        CacheWriter writer;
+        PutBvh(Bvh(std::move(nodes), {0}), &writer);
+        CacheReader reader(writer.Data());
+        Bvh bvh;
+        return GetBvh(&reader, 1, &bvh);
+    };
+    REQUIRE(load(chain(Bvh::kMaxDepth - 1)));
+    // Deeper than the traversal stacks.
+    REQUIRE(!load(chain(Bvh::kMaxDepth)));
+    // A right child inside the left subtree, and one past the end of its parent's run.
+    std::vector<BvhNode> nodes = chain(3);
+    nodes[1].offset = 3;
+    REQUIRE(!load(nodes));
+    nodes = chain(3);
+    nodes[1].offset = 6;
+    REQUIRE(!load(nodes));
+}
+
+TEST_CASE("Primitive store", "[raytracer]") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto scene = ReadScene(current_dir / "tests/box/cube.obj");
+    const PrimitiveStore store(scene.GetTriangles(), scene.GetSphereObjects());
+    const auto& triangles = scene.GetTriangles();
+    const auto& spheres = scene.GetSphereObjects();
+    REQUIRE(store.TriangleCount() == triangles.Size());
+    REQUIRE(store.Size() == triangles.Size() + spheres.size());
+    for (uint32_t i = 0; i < triangles.Size(); ++i) {
+        REQUIRE(store.IsTriangle(i));
+        REQUIRE(store.GetMaterial(i) == triangles.GetMaterial(i));
+        const Triangle triangle = store.GetTriangle(i);
+        Vector center = (triangle.GetVertex(0) + triangle.GetVertex(1) + triangle.GetVertex(2)) *
+                        (1. / 3);
+        Vector normal = store.GetTriangleNormal(i, 1. / 3, 1. / 3);
+        REQUIRE(Length(normal - triangles.GetObject(i).GetNormalAtPoint(center)) < 1e-9);
+    }
+    for (uint32_t i = 0; i < spheres.size(); ++i) {
+        uint32_t id = triangles.Size() + i;
+        REQUIRE(!store.IsTriangle(id));
+        REQUIRE(store.GetMaterial(id) == spheres[i].material);
+        REQUIRE(store.GetSphere(id).GetRadius() == spheres[i].sphere.GetRadius());
+    }
+}
+
+TEST_CASE("Indexed mesh", "[raytracer]") {
+    // A smooth grid written as an .obj file: every inner vertex is shared by six triangles.
+    const auto path = std::filesystem::temp_directory_path() / "raytracer_reader_grid.obj";
+    constexpr int kSide = 100;
+    {
+        std::ofstream out(path);
+        for (int x = 0; x <= kSide; ++x) {
+            for (int y = 0; y <= kSide; ++y) {
+                out << "v " << x << " 0 " << y << "\nvn " << 0.01 * x << " 1 " << 0.01 * y << "\n";
+            }
+        }
+        for (int x = 0; x < kSide; ++x) {
+            for (int y = 0; y < kSide; ++y) {
+                int a = x * (kSide + 1) + y + 1, b = a + kSide + 1;
+                out << "f " << a << "//" << a << " " << b << "//" << b << " " << a + 1 << "//"
+                    << a + 1 << "\n";
+                // Negative indices count back from the last vertex read.
+                int last = (kSide + 1) * (kSide + 1) + 1;
+                out << "f " << b - last << "//" << b << " " << b + 1 - last << "//" << b + 1
+                    << " " << a + 1 - last << "//" << a + 1 << "\n";
+            }
+        }
+    }
+    const auto scene = ReadScene(path);
+    std::filesystem::remove(path);
+    const TriangleMesh& triangles = scene.GetTriangles();
+    REQUIRE(triangles.Size() == 2 * kSide * kSide);
+    REQUIRE(triangles.GetVertexBuffer().size() == (kSide + 1) * (kSide + 1));
+    REQUIRE(triangles.GetNormalBuffer().size() == (kSide + 1) * (kSide + 1));
+
+    // Both triangles of a cell refer to the same shared corners.
+    const Triangle first = triangles.GetTriangle(0), second = triangles.GetTriangle(1);
+    REQUIRE(Length(first.GetVertex(1) - Vector{1, 0, 0}) == 0);
+    REQUIRE(Length(second.GetVertex(0) - Vector{1, 0, 0}) == 0);
+    REQUIRE(triangles.GetVertexIndices()[1] == triangles.GetVertexIndices()[3]);
+    REQUIRE(!triangles.IsFlat(0));
+    Vector expected = triangles.GetObject(0).GetNormalAtPoint({0.25, 0, 0.5});
+    REQUIRE(Length(triangles.GetNormal(0, 0.25, 0.5) - expected) < 1e-9);
+
+    // Several times smaller than a copy of every corner and normal per triangle.
+    REQUIRE(triangles.MemoryUsage() * 3 < triangles.Size() * sizeof(Object));
+    const PrimitiveStore store(triangles, {});
+    REQUIRE(store.MemoryUsage() * 3 < triangles.Size() * (sizeof(Object) + sizeof(SphereObject)));
+
+    // Replacing a triangle leaves its neighbours on the shared vertices.
+    TriangleMesh moved = triangles;
+    moved.Set(0, {{0, 1, 0}, {1, 1, 0}, {0, 1, 1}}, triangles.GetNormals(0));
+    moved.Set(0, {{0, 2, 0}, {1, 2, 0}, {0, 2, 1}}, triangles.GetNormals(0));
+    REQUIRE(moved.GetTriangle(0).GetVertex(1)[1] == 2);
+    REQUIRE(Length(moved.GetTriangle(1).GetVertex(0) - Vector{1, 0, 0}) == 0);
+    REQUIRE(moved.GetVertexBuffer().size() == triangles.GetVertexBuffer().size() + 3);
+}
+
+TEST_CASE("Chunked parsing", "[raytracer]") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto dir = std::filesystem::temp_directory_path() / "raytracer_reader_chunks";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    std::filesystem::copy_file(current_dir / "tests/box/CornellBox-Sphere.mtl",
+                               dir / "CornellBox-Sphere.mtl");
+    const std::string path = dir / "scene.obj";
+    {
+        std::ofstream out(path);
+        // A material used before any library defines it, then switches every few faces.
+        out << "usemtl early\nv 0 0 0\nv 1 0 0\nv 0 1 0\nf 1 2 3\n";
+        out << "mtllib CornellBox-Sphere.mtl\n";
+        const char* names[] = {"floor", "leftWall", "rightWall", "light"};
+        for (int i = 0; i < 200; ++i) {
+            if (i % 7 == 0) {
+                out << "usemtl " << names[i / 7 % 4] << "\n";
+            }
+            out << "v " << i << " " << i % 3 << " 1\nv " << i << " 1 " << i % 5 << "\n";
+            out << "vn 0 0 1\nvn 0 1 0\n";
+            // Negative indices reach back across chunks; quads fan into two triangles.
+            out << "f -1//-1 -2//-2 " << 2 * i + 3 << "//" << 2 * i + 1 << "\n";
+            if (i > 0) {
+                out << "f -1 -2 -3 -4\n";
+            }
+            if (i % 50 == 0) {
+                out << "S " << i << " 0 0 0.5\nP " << i << " 5 5 1 1 1\n";
+            }
+        }
+        out << "usemtl unused\nusemtl floor\nf 1 2 3";
+    }
+
+    const Scene serial = ReadScene(path, 1, SIZE_MAX);
+    REQUIRE(serial.GetTriangles().Size() == 2 + 200 + 2 * 199);
+    REQUIRE(serial.GetMaterials().Find("early"));
+    REQUIRE(!serial.GetMaterials().Find("unused"));
+    for (size_t chunk_size : {1, 10, 100, 1000}) {
+        RequireSameScene(ReadScene(path, 4, chunk_size), serial);
+    }
+    const std::string cube = current_dir / "tests/box/cube.obj";
+    RequireSameScene(ReadScene(cube, 3, 64), ReadScene(cube, 1, SIZE_MAX));
+
+    // Faces that name a vertex or normal the file does not have.
+    const char* header = "v 0 0 0\nv 1 0 0\nv 0 1 0\nvn 0 0 1\n";
+    std::ofstream(path) << header << "f -3//1 -2//-1 3//1\n";
+    REQUIRE(ReadScene(path, 2, 8).GetTriangles().Size() == 1);
+    for (const char* face : {"f 1 2 9", "f 0 1 2", "f -4 -1 -2", "f 1//1 2//1 3//2",
+                             "f 1//-2 2//1 3//1", "f 1//0 2//1 3//1"}) {
+        std::ofstream(path) << header << face << "\n";
+        for (size_t chunk_size : {size_t(8), SIZE_MAX}) {
+            REQUIRE_THROWS_AS(ReadScene(path, 2, chunk_size), std::runtime_error);
+        }
+    }
+
+    // Instances flattened or squashed into a plane have no inverse transform.
+    std::ofstream(dir / "mesh.obj") << header << "f 1 2 3\n";
+    std::ofstream(path) << "I mesh.obj 0 0 1 2\n";
+    REQUIRE(ReadScene(path).GetInstances().size() == 1);
+    for (const char* instance : {"I mesh.obj 0 0 1 0", "I mesh.obj 1 0 0 0 0 1 0 0 0 2 0 0"}) {
+        std::ofstream(path) << instance << "\n";
+        REQUIRE_THROWS_AS(ReadScene(path), std::runtime_error);
+    }
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Scene file", "[raytracer]") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto dir = std::filesystem::temp_directory_path() / "raytracer_reader_scene_file";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const std::string path = dir / "cube.rtscene";
+    const Scene expected = ReadScene(current_dir / "tests/box/cube.obj");
+    SaveSceneFile(expected, path);
+    REQUIRE(IsSceneFile(path));
+    const std::optional<Scene> loaded = LoadSceneFile(path);
+    REQUIRE(loaded);
+    RequireSameScene(*loaded, expected);
+    REQUIRE(loaded->GetBvh().GetNodes().size() == expected.GetBvh().GetNodes().size());
+    RequireSameScene(LoadScene(path), expected);
+
+    // Arrays sit at aligned offsets: the vertex buffer follows its length, padded.
+    const MappedFile file(path);
+    const std::string_view data = file.View();
+    const auto& vertices = expected.GetTriangles().GetVertexBuffer();
+    const std::string_view vertex_bytes(reinterpret_cast<const char*>(vertices.data()),
+                                        vertices.size() * sizeof(Vector));
+    const size_t offset = data.find(vertex_bytes);
+    REQUIRE(offset != data.npos);
+    REQUIRE(offset % kArrayAlignment == 0);
+
+    // Another header version, or a cut file, is refused.
+    std::string bytes(data);
+    bytes[sizeof(kSceneFileMagic)] += 1;
+    std::ofstream(dir / "version.rtscene", std::ios::binary) << bytes;
+    REQUIRE(!LoadSceneFile(dir / "version.rtscene"));
+    std::ofstream(dir / "cut.rtscene", std::ios::binary) << data.substr(0, data.size() / 2);
+    REQUIRE(!LoadSceneFile(dir / "cut.rtscene"));
+    REQUIRE_THROWS_AS(LoadScene(dir / "cut.rtscene"), std::runtime_error);
+    std::filesystem::remove_all(dir);
+}
+
+TEST_CASE("Paged scene file", "[raytracer]") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const auto dir = std::filesystem::temp_directory_path() / "raytracer_reader_paged_scene";
+    std::filesystem::remove_all(dir);
+    std::filesystem::create_directories(dir);
+    const std::string path = dir / "cube.rtpaged";
+    const Scene expected = ReadScene(current_dir / "tests/box/cube.obj");
+    SavePagedScene(expected, path, 4);
+    REQUIRE(IsPagedSceneFile(path));
+    const std::optional<PagedScene> loaded = LoadPagedScene(path);
+    REQUIRE(loaded);
+    REQUIRE(loaded->resident.GetTriangles().Empty());
+    REQUIRE(loaded->resident.GetSphereObjects().size() == expected.GetSphereObjects().size());
+    REQUIRE(loaded->resident.GetLights().size() == expected.GetLights().size());
+
+    // Every primitive lands in exactly one cluster, each triangle with its own vertices and
+    // material, and the clusters are the leaves of the top of the tree.
+    const ClusterFile& clusters = loaded->clusters;
+    REQUIRE(clusters.ClusterCount() > 1);
+    REQUIRE(clusters.GetBvh().GetPrimitives().size() == clusters.ClusterCount());
+    std::multiset<std::tuple<double, double, double, MaterialId>> triangles, expected_triangles;
+    const TriangleMesh& mesh = expected.GetTriangles();
+    for (size_t i = 0; i < mesh.Size(); ++i) {
+        const Vector center = mesh.GetTriangle(i).GetVertex(0) + mesh.GetTriangle(i).GetVertex(1);
+        expected_triangles.emplace(center[0], center[1], center[2], mesh.GetMaterial(i));
+    }
+    size_t resident_count = 0;
+    for (uint32_t c = 0; c < clusters.ClusterCount(); ++c) {
+        const GeometryCluster cluster = clusters.ReadCluster(c);
+        REQUIRE(cluster.bvh.GetPrimitives().size() ==
+                cluster.triangles.Size() + cluster.resident.size());
+        for (size_t i = 0; i < cluster.triangles.Size(); ++i) {
+            const Triangle triangle = cluster.triangles.GetTriangle(i);
+            const Vector center = triangle.GetVertex(0) + triangle.GetVertex(1);
+            triangles.emplace(center[0], center[1], center[2], cluster.triangles.GetMaterial(i));
+        }
+        resident_count += cluster.resident.size();
+    }
+    REQUIRE(triangles == expected_triangles);
+    REQUIRE(resident_count == expected.GetSphereObjects().size());
+
+    // A cut file is refused.
+    const MappedFile file(path);
+    std::ofstream(dir / "cut.rtpaged", std::ios::binary)
+        << file.View().substr(0, file.View().size() / 2);
+    REQUIRE(!LoadPagedScene(dir / "cut.rtpaged"));
+    std::filesystem::remove_all(dir);
+}
+
+// The line reader of .obj and .mtl files that ParseObjChunk and ParseMaterials replaced, kept
+// only as the reference the tests compare them with.
+
+double ConvertToDouble(std::string_view s) {
+    double result;
+    std::from_chars(s.data(), s.data() + s.size(), result);
+    return result;
+}
+bool IsDouble(std::string_view s) {
+    double result;
+    auto [end, error] = std::from_chars(s.data(), s.data() + s.size(), result);
+    return error == std::errc() && end == s.data() + s.size();
+}
+
+// trim from start
+std::string &Ltrim(std::string &s) {
+    s.erase(s.begin(), std::find_if(s.begin(), s.end(), [](unsigned char c) {
+                return !std::isspace(c);
+            }));
+    return s;
+}
+
+// trim from end
+std::string &Rtrim(std::string &s) {
+    s.erase(std::find_if(s.rbegin(), s.rend(), [](unsigned char c) { return !std::isspace(c); })
+                .base(),
+            s.end());
+    return s;
+}
+
+std::vector<std::string> Split(const std::string &s, char delim = ' ', bool without_empty = true) {
+    std::stringstream ss(s);
+    std::string item;
+    std::vector<std::string> elems;
+    while (std::getline(ss, item, delim)) {
+        if (without_empty) {
+            if (!item.empty()) {
+                elems.push_back(item);
+            }
+        } else {
+            elems.push_back(item);
+        }
+    }
+    return elems;
+}
+
+class Reader {
+protected:
+    std::string s_;
+
+public:
+    Reader(std::string s) : s_(s) {
+    }
+    void Trim() {
+        Ltrim(Rtrim(s_));
+    }
+    Vector GetVector() {
+        Trim();
+        auto v = Split(s_);
+        assert(v.size() == 3);
+        double x = ConvertToDouble(v[0]), y = ConvertToDouble(v[1]), z = ConvertToDouble(v[2]);
+        return {x, y, z};
+    }
+    double GetDouble() {
+        Trim();
+        return ConvertToDouble(s_);
+    }
+};
+
+class ReaderMtl : Reader {
+
+public:
+    ReaderMtl(std::string s) : Reader(s) {
+        Trim();
+    }
+
+    bool Newmtl() {
+        return s_.starts_with("newmtl") || s_.starts_with("Newmtl");
+    }
+    bool Ka() {
+        return s_.starts_with("Ka");
+    }
+    bool Kd() {
+        return s_.starts_with("Kd");
+    }
+    bool Ks() {
+        return s_.starts_with("Ks");
+    }
+    bool Ke() {
+        return s_.starts_with("Ke");
+    }
+    bool Ns() {
+        return s_.starts_with("Ns");
+    }
+    bool Ni() {
+        return s_.starts_with("Ni");
+    }
+    bool Al() {
+        return s_.starts_with("al");
+    }
+    std::string GetNewmtl() {
+        s_ = s_.substr(6);
+        Trim();
+        return s_;
+    }
+    Vector GetKaKdKsKe() {
+        s_ = s_.substr(2);
+        Trim();
+        return GetVector();
+    }
+    double GetNsNi() {
+        s_ = s_.substr(2);
+        Trim();
+        return GetDouble();
+    }
+    std::array<double, 3> GetAl() {
+        s_ = s_.substr(2);
+        Trim();
+        Vector v = GetVector();
+        return {v[0], v[1], v[2]};
+    }
+};
+
+class ReaderObj : Reader {
+
+public:
+    ReaderObj(std::string s) : Reader(s) {
+        Trim();
+    }
+    bool V() {
+        return s_.starts_with("v") && !Vn();
+    }
+    bool Vn() {
+        return s_.starts_with("vn");
+    }
+    bool F() {
+        return s_.starts_with("f");
+    }
+
+    bool Mtllib() {
+        return s_.starts_with("mtllib");
+    }
+    bool Usemtl() {
+        return s_.starts_with("usemtl");
+    }
+    bool S() {
+        return s_.starts_with("S");
+    }
+    bool P() {
+        return s_.starts_with("P");
+    }
+    bool I() {
+        return s_.starts_with("I");
+    }
+    Vector GetVnV() {
+        s_ = s_.substr(2);
+        Trim();
+        return GetVector();
+    }
+    std::string GetMtllibUsemtl() {
+        s_ = s_.substr(6);
+        Trim();
+        return s_;
+    }
+    std::pair<Vector, double> GetS() {
+        s_ = s_.substr(2);
+        Trim();
+        std::vector<std::string> v = Split(s_);
+        assert(v.size() == 4);
+        double x = ConvertToDouble(v[0]), y = ConvertToDouble(v[1]), z = ConvertToDouble(v[2]),
+               r = ConvertToDouble(v[3]);
+        return {{x, y, z}, r};
+    };
+    std::pair<Vector, Vector> GetP() {
+        s_ = s_.substr(2);
+        Trim();
+        std::vector<std::string> v = Split(s_);
+        assert(v.size() == 6);
+        double x = ConvertToDouble(v[0]), y = ConvertToDouble(v[1]), z = ConvertToDouble(v[2]),
+               r = ConvertToDouble(v[3]), g = ConvertToDouble(v[4]), b = ConvertToDouble((v[5]));
+        return {{x, y, z}, {r, g, b}};
+    };
+    // `I file.obj <3, 4 or 12 numbers> [material]`: mesh file, transform and material override.
+    std::tuple<std::string, std::vector<double>, std::string> GetI() {
+        s_ = s_.substr(1);
+        Trim();
+        std::vector<std::string> v = Split(s_);
+        assert(!v.empty());
+        std::vector<double> numbers;
+        std::string material;
+        for (size_t i = 1; i < v.size(); ++i) {
+            if (i + 1 == v.size() && !IsDouble(v[i])) {
+                material = v[i];
+            } else {
+                numbers.push_back(ConvertToDouble(v[i]));
+            }
+        }
+        return {v[0], numbers, material};
+    }
+    std::vector<std::pair<int, std::optional<int>>> GetF() {
+        std::vector<std::pair<int, std::optional<int>>> result;
+        s_ = s_.substr(2);
+        Trim();
+        std::vector<std::string> v = Split(s_);
+        for (std::string vertex : v) {
+            Reader local_reader(vertex);
+            std::vector<std::string> local_vector = Split(vertex, '/', false);
+            assert(local_vector.size() <= 3);
+            if (local_vector.size() == 3) {
+                result.push_back({static_cast<int>(ConvertToDouble(local_vector[0])),
+                                  static_cast<int>(ConvertToDouble(local_vector[2]))});
+            } else {
+                result.push_back({static_cast<int>(ConvertToDouble(local_vector[0])), {}});
+            }
+        }
+        return result;
+    }
+};
+
+// The line reader ParseObjChunk replaced, kept as the reference for it: every line is copied,
+// trimmed and split into strings. Two slips of it are avoided here: it took texture coordinates
+// for vertices, and went on to read the material name of mtllib and usemtl lines as a line of
+// its own, so `usemtl floor` also gave a face.
+ObjChunk ParseObjChunkByLines(std::string_view text) {
+    ObjChunk chunk;
+    auto use_material = [&] {
+        chunk.used.back() = true;
+        return chunk.events.size();
+    };
+    auto add_event = [&](ObjChunk::Event event) {
+        chunk.events.push_back(std::move(event));
+        chunk.used.push_back(false);
+    };
+    std::istringstream in{std::string(text)};
+    for (std::string line; std::getline(in, line);) {
+        ReaderObj line_reader(line);
+        if (line_reader.Mtllib()) {
+            add_event({ObjChunk::Event::kMtllib, line_reader.GetMtllibUsemtl()});
+            continue;
+        }
+        if (line_reader.Usemtl()) {
+            add_event({ObjChunk::Event::kUsemtl, line_reader.GetMtllibUsemtl()});
+            continue;
+        }
+        if (line_reader.V() && !Rtrim(Ltrim(line)).starts_with("vt")) {
+            chunk.vertices.push_back(line_reader.GetVnV());
+        }
+        if (line_reader.Vn()) {
+            chunk.vn_slots.push_back(chunk.normals.size());
+            chunk.normals.push_back(line_reader.GetVnV());
+        }
+        if (line_reader.P()) {
+            auto [position, intensity] = line_reader.GetP();
+            chunk.lights.push_back(Light(position, intensity));
+        }
+        if (line_reader.S()) {
+            auto [center, radius] = line_reader.GetS();
+            chunk.spheres.emplace_back(Sphere(center, radius), use_material());
+        }
+        if (line_reader.I()) {
+            auto [mesh_filename, numbers, material] = line_reader.GetI();
+            add_event({ObjChunk::Event::kInstance, mesh_filename, numbers, material});
+        }
+        if (line_reader.F()) {
+            auto face = line_reader.GetF();
+            ObjChunk::Face entry{static_cast<uint32_t>(chunk.corners.size()),
+                                 static_cast<uint32_t>(face.size()),
+                                 static_cast<uint32_t>(chunk.vertices.size()),
+                                 static_cast<uint32_t>(chunk.vn_slots.size()),
+                                 chunk.triangle_count,
+                                 static_cast<uint32_t>(chunk.normals.size()),
+                                 0};
+            for (size_t i = 1; i + 1 < face.size(); ++i) {
+                if (!face[0].second || !face[i].second || !face[i + 1].second) {
+                    chunk.normals.emplace_back();
+                }
+                entry.segment = use_material();
+                ++chunk.triangle_count;
+            }
+            chunk.corners.insert(chunk.corners.end(), face.begin(), face.end());
+            chunk.faces.push_back(entry);
+        }
+    }
+    return chunk;
+}
+
+void RequireSameChunk(const ObjChunk& lhs, const ObjChunk& rhs) {
+    auto require_same = [](const std::vector<Vector>& lhs, const std::vector<Vector>& rhs) {
+        REQUIRE(lhs.size() == rhs.size());
+        for (size_t i = 0; i < lhs.size(); ++i) {
+            for (size_t k = 0; k < 3; ++k) {
+                REQUIRE(lhs[i][k] == rhs[i][k]);
+            }
+        }
+    };
+    require_same(lhs.vertices, rhs.vertices);
+    require_same(lhs.normals, rhs.normals);
+    REQUIRE(lhs.vn_slots == rhs.vn_slots);
+    REQUIRE(lhs.corners == rhs.corners);
+    REQUIRE(lhs.faces.size() == rhs.faces.size());
+    for (size_t i = 0; i < lhs.faces.size(); ++i) {
+        const ObjChunk::Face &a = lhs.faces[i], &b = rhs.faces[i];
+        REQUIRE(std::tie(a.first_corner, a.corner_count, a.vertex_count, a.vn_count,
+                         a.first_triangle, a.first_flat, a.segment) ==
+                std::tie(b.first_corner, b.corner_count, b.vertex_count, b.vn_count,
+                         b.first_triangle, b.first_flat, b.segment));
+    }
+    REQUIRE(lhs.triangle_count == rhs.triangle_count);
+    REQUIRE(lhs.spheres.size() == rhs.spheres.size());
+    for (size_t i = 0; i < lhs.spheres.size(); ++i) {
+        const Sphere &a = lhs.spheres[i].first, &b = rhs.spheres[i].first;
+        require_same({a.GetCenter()}, {b.GetCenter()});
+        REQUIRE(a.GetRadius() == b.GetRadius());
+        REQUIRE(lhs.spheres[i].second == rhs.spheres[i].second);
+    }
+    REQUIRE(lhs.lights.size() == rhs.lights.size());
+    for (size_t i = 0; i < lhs.lights.size(); ++i) {
+        require_same({lhs.lights[i].position, lhs.lights[i].intensity},
+                     {rhs.lights[i].position, rhs.lights[i].intensity});
+    }
+    REQUIRE(lhs.events.size() == rhs.events.size());
+    for (size_t i = 0; i < lhs.events.size(); ++i) {
+        const ObjChunk::Event &a = lhs.events[i], &b = rhs.events[i];
+        REQUIRE(std::tie(a.kind, a.name, a.numbers, a.material) ==
+                std::tie(b.kind, b.name, b.numbers, b.material));
+    }
+    REQUIRE(lhs.used == rhs.used);
+}
+
+TEST_CASE("Number scanning", "[raytracer]") {
+    std::mt19937_64 random(7);
+    std::vector<std::string> tokens = {"0",      "-0",    "1",         "-1.5",      "1.",
+                                       ".25",    "1e3",   "1E-3",      "2.5e+2",    "1e",
+                                       "7e-400", "1e400", "0.1000000", "123456789012345678901",
+                                       "0x1p3",  "inf",   "nan",       "-",         "4.2abc"};
+    const char* formats[] = {"%.17g", "%.6f", "%.3e", "%.9g", "%.2f"};
+    for (int i = 0; i < 20000; ++i) {
+        double value = std::ldexp(std::uniform_real_distribution<double>(-1, 1)(random),
+                                  std::uniform_int_distribution<int>(-40, 40)(random));
+        char buffer[64];
+        std::snprintf(buffer, sizeof(buffer), formats[i % 5], value);
+        tokens.push_back(buffer);
+    }
+    for (const std::string& token : tokens) {
+        const char* first = token.data();
+        const char* last = first + token.size();
+        double expected = 0, scanned = 0;
+        const char* expected_end = std::from_chars(first, last, expected).ptr;
+        REQUIRE(ScanDouble(first, last, &scanned) == expected_end);
+        if (expected_end != first) {
+            REQUIRE(std::memcmp(&scanned, &expected, sizeof(double)) == 0);
+        }
+    }
+    REQUIRE(ScanInt("-12/3") == -12);
+    REQUIRE(ScanInt("") == 0);
+}
+
+TEST_CASE("Zero-copy parsing", "[raytracer]") {
+    const auto current_dir = GetFileDir(__FILE__);
+    const std::string cube = current_dir / "tests/box/cube.obj";
+    const MappedFile cube_file(cube);
+    RequireSameChunk(ParseObjChunk(cube_file.View()), ParseObjChunkByLines(cube_file.View()));
+
+    // Tabs, CRLF ends, trailing blanks, comments, all corner forms, instances and no final newline.
+    const std::string text =
+        "# comment\r\nmtllib  lib.mtl \r\nv\t1.00  0.00  -1.04   \nv 1e-3 -2.5E2 .5\r\n"
+        "v 0 1 0\nvt 0.5 0.5 0\nvn 0 0 1\nvn\t0 1 0 \nusemtl  red  \n"
+        "f 1/1/1 2/2/2 3/3/1\nf 1//2 2//1 3//2 -1//-1\nf 1/1 2/2 3/3\nf -3 -2 -1\n"
+        "g group\ns 1\nS 0 1 2 0.25\nP 1 2 3 0.5 0.5 0.5\nI mesh.obj 1 2 3\n"
+        "I mesh.obj 1 2 3 2 gold\nusemtl blue\nf 3 2 1";
+    RequireSameChunk(ParseObjChunk(text), ParseObjChunkByLines(text));
+    const ObjChunk chunk = ParseObjChunk(text);
+    REQUIRE(chunk.vertices.size() == 3);
+    REQUIRE(chunk.events.back().name == "blue");
+    REQUIRE(chunk.events[3].material == "gold");
+
+    // An instance takes a translation, a translation and scale, or a 3 x 4 matrix.
+    REQUIRE(ParseObjChunk("I mesh.obj 1 2 3 4 5 6 7 8 9 10 11 12 red\n").events[0].numbers.size() ==
+            12);
+    for (std::string_view line : {"I mesh.obj\n", "I mesh.obj 1 2 red\n", "I mesh.obj 1 2 3 4 5\n",
+                                  "I mesh.obj 1 2 3 4 5 6 7 8 9 10 11 12 13\n"}) {
+        REQUIRE_THROWS_AS(ParseObjChunk(line), std::runtime_error);
+    }
+
+    // Materials come out as the line reader read them.
+    const MappedFile mtl_file(current_dir / "tests/box/CornellBox-Sphere.mtl");
+    MaterialTable scanned, expected;
+    ParseMaterials(mtl_file.View(), &scanned);
+    std::istringstream in{std::string(mtl_file.View())};
+    Material current{};
+    bool begun = false;
+    for (std::string line; std::getline(in, line);) {
+        ReaderMtl reader(line);
+        if (reader.Newmtl()) {
+            if (begun) {
+                expected.Add(current);
+            }
+            begun = true;
+            current = Material{"", Vector(), Vector(), Vector(), Vector(), 0, 0, {1, 0, 0}};
+            current.name = reader.GetNewmtl();
+        } else if (reader.Ka()) {
+            current.ambient_color = reader.GetKaKdKsKe();
+        } else if (reader.Kd()) {
+            current.diffuse_color = reader.GetKaKdKsKe();
+        } else if (reader.Ks()) {
+            current.specular_color = reader.GetKaKdKsKe();
+        } else if (reader.Ke()) {
+            current.intensity = reader.GetKaKdKsKe();
+        } else if (reader.Ns()) {
+            current.specular_exponent = reader.GetNsNi();
+        } else if (reader.Ni()) {
+            current.refraction_index = reader.GetNsNi();
+        } else if (reader.Al()) {
+            current.albedo = reader.GetAl();
+        }
+    }
+    expected.Add(current);
+    REQUIRE(scanned.GetNames() == expected.GetNames());
+    REQUIRE(scanned.Size() == expected.Size());
+    for (MaterialId id = 0; id < scanned.Size(); ++id) {
+        REQUIRE(scanned[id].name == expected[id].name);
+        REQUIRE(scanned[id].specular_exponent == expected[id].specular_exponent);
+        REQUIRE(scanned[id].refraction_index == expected[id].refraction_index);
+        REQUIRE(scanned[id].albedo == expected[id].albedo);
+        for (size_t k = 0; k < 3; ++k) {
+            REQUIRE(scanned[id].ambient_color[k] == expected[id].ambient_color[k]);
+            REQUIRE(scanned[id].diffuse_color[k] == expected[id].diffuse_color[k]);
+            REQUIRE(scanned[id].specular_color[k] == expected[id].specular_color[k]);
+            REQUIRE(scanned[id].intensity[k] == expected[id].intensity[k]);
+        }
+    }
+}
+
+TEST_CASE("Parsing throughput", "[.bench]") {
+    std::string text;
+    std::mt19937 random(1);
+    std::uniform_real_distribution<double> coordinate(-100, 100);
+    char line[128];
+    for (int i = 0; i < 300000; ++i) {
+        std::snprintf(line, sizeof(line), "v %.6f %.6f %.6f\nvn %.6f %.6f %.6f\n",
+                      coordinate(random), coordinate(random), coordinate(random),
+                      coordinate(random), coordinate(random), coordinate(random));
+        text += line;
+        if (i >= 2) {
+            std::snprintf(line, sizeof(line), "f %d//%d %d//%d %d//%d\n", i - 1, i - 1, i, i,
+                          i + 1, i + 1);
+            text += line;
+        }
+    }
+    auto measure = [&](auto&& parse) {
+        auto start = std::chrono::steady_clock::now();
+        ObjChunk chunk = parse(text);
+        std::chrono::duration<double> seconds = std::chrono::steady_clock::now() - start;
+        REQUIRE(chunk.triangle_count == 299998);
+        return text.size() / seconds.count() / (1 << 20);
+    };
+    double by_lines = measure(ParseObjChunkByLines);
+    double scanned = measure([](std::string_view s) { return ParseObjChunk(s); });
+    std::printf("Parsing %.1f MB: %.1f MB/s by lines, %.1f MB/s scanned\n",
+                text.size() / double(1 << 20), by_lines, scanned);
 }
@@ -0,0 +1,205 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Persistent worker threads with one task queue each. A worker takes tasks from the front of its
+// own queue and, once that is empty, steals from the back of the others, so uneven tasks even
+// out. Several ParallelFor calls may run at once from different threads.
+class ThreadPool {
+public:
+    // `thread_count` threads take part in every ParallelFor: the caller and thread_count - 1
+    // workers.
+    explicit ThreadPool(int thread_count) : queues_(std::max(thread_count - 1, 0)) {
+        for (size_t i = 0; i < queues_.size(); ++i) {
+            workers_.emplace_back([this, i] { Work(i); });
+        }
+    }
+    ~ThreadPool() {
+        {
+            std::lock_guard lock(sleep_mutex_);
+            stop_ = true;
+        }
+        sleep_.notify_all();
+        for (std::thread& worker : workers_) {
+            worker.join();
+        }
+    }
+    ThreadPool(const ThreadPool&) = delete;
+    ThreadPool& operator=(const ThreadPool&) = delete;
+
+    int Size() const {
+        return workers_.size() + 1;
+    }
+
+    // Runs task(i) for every i in [0, count) and returns when all have finished. Tasks are dealt
+    // to the queues in contiguous runs; the caller works too, taking tasks from any queue. If a
+    // task throws, the tasks not started yet are skipped and the first exception is rethrown
+    // here once the others are done.
+    void ParallelFor(size_t count, const std::function<void(size_t)>& task) {
+        if (queues_.empty() || count <= 1) {
+            for (size_t i = 0; i < count; ++i) {
+                task(i);
+            }
+            return;
+        }
+        Job job(&task, count);
+        {
+            std::lock_guard lock(sleep_mutex_);
+            pending_ += count;
+        }
+        const size_t queue_count = queues_.size();
+        for (size_t q = 0; q < queue_count; ++q) {
+            std::lock_guard lock(queues_[q].mutex);
+            for (size_t i = q * count / queue_count; i < (q + 1) * count / queue_count; ++i) {
+                queues_[q].items.push_back({&job, i});
+            }
+        }
+        sleep_.notify_all();
+        Item item;
+        while (TrySteal(0, &item)) {
+            Run(item);
+        }
+        // The job lives on this stack, so it is left only under its mutex, after the last task
+        // has signalled it.
+        std::unique_lock lock(job.mutex);
+        job.done.wait(lock, [&] { return job.remaining == 0; });
+        if (job.error) {
+            std::rethrow_exception(job.error);
+        }
+    }
+
+private:
+    struct Job {
+        Job(const std::function<void(size_t)>* task, size_t remaining)
+            : task(task), remaining(remaining) {
+        }
+
+        const std::function<void(size_t)>* task;
+        // Tasks not finished yet, and the first exception thrown by one, guarded by `mutex`.
+        size_t remaining;
+        std::exception_ptr error;
+        std::atomic<bool> failed = false;
+        std::mutex mutex;
+        std::condition_variable done;
+    };
+    struct Item {
+        Job* job = nullptr;
+        size_t index = 0;
+    };
+    struct Queue {
+        std::mutex mutex;
+        std::deque<Item> items;
+    };
+
+    // The job stays on the stack of its ParallelFor until every task has been counted here, so
+    // no exception may leave.
+    void Run(const Item& item) {
+        std::exception_ptr error;
+        if (!item.job->failed) {
+            try {
+                (*item.job->task)(item.index);
+            } catch (...) {
+                error = std::current_exception();
+                item.job->failed = true;
+            }
+        }
+        std::lock_guard lock(item.job->mutex);
+        if (error && !item.job->error) {
+            item.job->error = error;
+        }
+        if (--item.job->remaining == 0) {
+            item.job->done.notify_all();
+        }
+    }
+
+    bool TryPop(size_t queue, Item* item) {
+        std::lock_guard lock(queues_[queue].mutex);
+        if (queues_[queue].items.empty()) {
+            return false;
+        }
+        *item = queues_[queue].items.front();
+        queues_[queue].items.pop_front();
+        --pending_;
+        return true;
+    }
+    // Takes the last task of some queue, looking at queue `first` first.
+    bool TrySteal(size_t first, Item* item) {
+        for (size_t k = 0; k < queues_.size(); ++k) {
+            Queue& queue = queues_[(first + k) % queues_.size()];
+            std::lock_guard lock(queue.mutex);
+            if (!queue.items.empty()) {
+                *item = queue.items.back();
+                queue.items.pop_back();
+                --pending_;
+                return true;
+            }
+        }
+        return false;
+    }
+
+    void Work(size_t own) {
+        while (true) {
+            Item item;
+            if (TryPop(own, &item) || TrySteal(own + 1, &item)) {
+                Run(item);
+                continue;
+            }
+            std::unique_lock lock(sleep_mutex_);
+            sleep_.wait(lock, [&] { return stop_ || pending_ > 0; });
+            if (stop_) {
+                return;
+            }
+        }
+    }
+
+    std::vector<Queue> queues_;
+    std::vector<std::thread> workers_;
+    // Tasks queued and not yet taken.
+    std::atomic<size_t> pending_ = 0;
+    std::mutex sleep_mutex_;
+    std::condition_variable sleep_;
+    bool stop_ = false;
+};
+
+// Number of threads to use for a requested count; 0 picks one per hardware thread.
+inline int ThreadCount(int requested) {
+    return requested > 0 ? requested : std::max<int>(std::thread::hardware_concurrency(), 1);
+}
+
+// One pool per thread count, created on first use and kept for the life of the program, so
+// renders do not pay for starting threads.
+inline ThreadPool& SharedThreadPool(int thread_count) {
+    static std::mutex mutex;
+    static std::map<int, std::unique_ptr<ThreadPool>> pools;
+    thread_count = ThreadCount(thread_count);
+    std::lock_guard lock(mutex);
+    std::unique_ptr<ThreadPool>& pool = pools[thread_count];
+    if (!pool) {
+        pool = std::make_unique<ThreadPool>(thread_count);
+    }
+    return *pool;
+}
+
+// ParallelFor on the shared pool for `thread_count` threads. A single thread runs the tasks in
+// place without touching any pool, which keeps it usable in a forked child, where the threads of
+// the pools are gone.
+inline void ParallelFor(int thread_count, size_t count,
+                        const std::function<void(size_t)>& task) {
+    if (ThreadCount(thread_count) == 1) {
+        for (size_t i = 0; i < count; ++i) {
+            task(i);
+        }
+        return;
+    }
+    SharedThreadPool(thread_count).ParallelFor(count, task);
+}
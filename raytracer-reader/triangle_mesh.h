@@ -0,0 +1,141 @@
+#pragma once
+
+#include <object.h>
+#include <material.h>
+#include <triangle.h>
+
+#include <array>
+#include <cstdint>
+#include <unordered_set>
+#include <vector>
+
+// Triangles as 32-bit indices into shared vertex and normal buffers, the way an .obj file
+// stores them: a vertex used by six faces is kept once. Triangle i takes entries [3i, 3i + 3)
+// of both index buffers. A flat triangle refers to one normal three times.
+class TriangleMesh {
+public:
+    TriangleMesh() {
+    }
+    // From buffers as returned by the getters below; indices must be in range.
+    TriangleMesh(std::vector<Vector> vertices, std::vector<Vector> normals,
+                 std::vector<uint32_t> vertex_indices, std::vector<uint32_t> normal_indices,
+                 std::vector<MaterialId> materials)
+        : vertices_(std::move(vertices)),
+          normals_(std::move(normals)),
+          vertex_indices_(std::move(vertex_indices)),
+          normal_indices_(std::move(normal_indices)),
+          materials_(std::move(materials)) {
+    }
+
+    uint32_t AddVertex(const Vector& vertex) {
+        vertices_.push_back(vertex);
+        return vertices_.size() - 1;
+    }
+    uint32_t AddNormal(const Vector& normal) {
+        normals_.push_back(normal);
+        return normals_.size() - 1;
+    }
+    void Add(MaterialId material, const std::array<uint32_t, 3>& vertices,
+             const std::array<uint32_t, 3>& normals) {
+        vertex_indices_.insert(vertex_indices_.end(), vertices.begin(), vertices.end());
+        normal_indices_.insert(normal_indices_.end(), normals.begin(), normals.end());
+        materials_.push_back(material);
+    }
+    // A triangle with vertices and normals of its own.
+    void Add(MaterialId material, const Triangle& polygon,
+             const std::array<Vector, 3>& normals) {
+        std::array<uint32_t, 3> vertex_ids, normal_ids;
+        for (size_t k = 0; k < 3; ++k) {
+            vertex_ids[k] = AddVertex(polygon.GetVertex(k));
+            normal_ids[k] = AddNormal(normals[k]);
+        }
+        Add(material, vertex_ids, normal_ids);
+    }
+
+    size_t Size() const {
+        return materials_.size();
+    }
+    bool Empty() const {
+        return materials_.empty();
+    }
+
+    Triangle GetTriangle(size_t i) const {
+        const uint32_t* ids = &vertex_indices_[3 * i];
+        return {vertices_[ids[0]], vertices_[ids[1]], vertices_[ids[2]]};
+    }
+    std::array<Vector, 3> GetNormals(size_t i) const {
+        const uint32_t* ids = &normal_indices_[3 * i];
+        return {normals_[ids[0]], normals_[ids[1]], normals_[ids[2]]};
+    }
+    MaterialId GetMaterial(size_t i) const {
+        return materials_[i];
+    }
+    Object GetObject(size_t i) const {
+        return Object(materials_[i], GetTriangle(i), GetNormals(i));
+    }
+    bool IsFlat(size_t i) const {
+        const uint32_t* ids = &normal_indices_[3 * i];
+        return ids[0] == ids[1] && ids[1] == ids[2];
+    }
+    // Normal at barycentric coordinates (u, v) along the two edges, interpolated between the
+    // vertex normals.
+    Vector GetNormal(size_t i, double u, double v) const {
+        const uint32_t* ids = &normal_indices_[3 * i];
+        if (IsFlat(i)) {
+            return normals_[ids[0]];
+        }
+        return normals_[ids[0]] * (1 - u - v) + normals_[ids[1]] * u + normals_[ids[2]] * v;
+    }
+
+    // Replaces every material id m by ids[m], as when merging into another material table.
+    void RemapMaterials(const std::vector<MaterialId>& ids) {
+        for (MaterialId& material : materials_) {
+            material = ids[material];
+        }
+    }
+    // Replaces triangle i. The first replacement gives it vertices and normals of its own, so
+    // neighbours that shared the old ones stay in place; later ones overwrite them.
+    void Set(size_t i, const Triangle& polygon, const std::array<Vector, 3>& normals) {
+        if (detached_.insert(i).second) {
+            for (size_t k = 0; k < 3; ++k) {
+                vertex_indices_[3 * i + k] = AddVertex(polygon.GetVertex(k));
+                normal_indices_[3 * i + k] = AddNormal(normals[k]);
+            }
+            return;
+        }
+        for (size_t k = 0; k < 3; ++k) {
+            vertices_[vertex_indices_[3 * i + k]] = polygon.GetVertex(k);
+            normals_[normal_indices_[3 * i + k]] = normals[k];
+        }
+    }
+
+    const std::vector<Vector>& GetVertexBuffer() const {
+        return vertices_;
+    }
+    const std::vector<Vector>& GetNormalBuffer() const {
+        return normals_;
+    }
+    const std::vector<uint32_t>& GetVertexIndices() const {
+        return vertex_indices_;
+    }
+    const std::vector<uint32_t>& GetNormalIndices() const {
+        return normal_indices_;
+    }
+
+    // Bytes held by the buffers.
+    size_t MemoryUsage() const {
+        return (vertices_.size() + normals_.size()) * sizeof(Vector) +
+               (vertex_indices_.size() + normal_indices_.size()) * sizeof(uint32_t) +
+               materials_.size() * sizeof(MaterialId);
+    }
+
+private:
+    std::vector<Vector> vertices_;
+    std::vector<Vector> normals_;
+    std::vector<uint32_t> vertex_indices_;
+    std::vector<uint32_t> normal_indices_;
+    // Per triangle.
+    std::vector<MaterialId> materials_;
+    // Triangles that own their vertices and normals after Set.
+    std::unordered_set<size_t> detached_;
+};
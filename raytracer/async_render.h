@@ -0,0 +1,152 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <functional>
+#include <future>
+#include <memory>
+#include <stdexcept>
+#include <thread>
+#include <vector>
+
+// Thrown by RenderJob::Get for a job that was cancelled before it finished.
+struct RenderCancelled : std::runtime_error {
+    RenderCancelled() : std::runtime_error("Render cancelled") {
+    }
+};
+
+struct AsyncRenderOptions {
+    // Called on the thread of the job after every partial_every tiles, with the image of the
+    // tiles done so far (the others black, tone mapped on their own) and RenderJob::Progress.
+    // Every partial image is the whole frame, tone mapped and copied anew, so it costs as much
+    // as the final one: leave enough tiles between them for that to stay small.
+    std::function<void(const Image& partial, double progress)> on_partial;
+    // Tiles between partial images; also the tiles the pool gets at once while on_partial is
+    // set, each such wave ending in a wait for its slowest tile. 0, or no on_partial, sends all
+    // tiles in one go.
+    size_t partial_every = 64;
+};
+
+// A render running in the background, as Render would do it on render_options.threads threads
+// of the shared pool; time_budget is not used, cancel the job instead. The scene must outlive
+// the job. Cancel is checked before every tile: the tiles left are skipped, which frees the pool
+// threads at once, and the pixels are released as the job ends. Dropping the handle cancels the
+// job and waits for that.
+class RenderJob {
+public:
+    RenderJob(const PreparedScene& scene, const CameraOptions& camera_options,
+              const RenderOptions& render_options, AsyncRenderOptions async_options = {})
+        : state_(std::make_shared<State>()) {
+        state_->tile_count = GetTiles(camera_options, render_options.tile_size).size();
+        result_ = state_->result.get_future();
+        thread_ = std::thread([&scene, camera_options, render_options,
+                               async_options = std::move(async_options), state = state_] {
+            try {
+                state->result.set_value(
+                    Run(scene, camera_options, render_options, async_options, state.get()));
+            } catch (...) {
+                state->result.set_exception(std::current_exception());
+            }
+        });
+    }
+    RenderJob(RenderJob&&) = default;
+    RenderJob& operator=(RenderJob&& other) {
+        Stop();
+        state_ = std::move(other.state_);
+        result_ = std::move(other.result_);
+        thread_ = std::move(other.thread_);
+        return *this;
+    }
+    ~RenderJob() {
+        Stop();
+    }
+
+    size_t TileCount() const {
+        return state_->tile_count;
+    }
+    size_t TilesDone() const {
+        return state_->tiles_done;
+    }
+    // Fraction of the tiles done, in [0, 1].
+    double Progress() const {
+        return TileCount() == 0 ? 1 : static_cast<double>(TilesDone()) / TileCount();
+    }
+
+    // Asks the job to stop; it skips the tiles it has not started.
+    void Cancel() {
+        state_->cancelled = true;
+    }
+    bool Ready() const {
+        return result_.wait_for(std::chrono::seconds(0)) == std::future_status::ready;
+    }
+    // Waits for the image; throws RenderCancelled if the job was cancelled first, or what the
+    // render threw. Only the first call gets the image.
+    Image Get() {
+        return result_.get();
+    }
+
+private:
+    struct State {
+        std::promise<Image> result;
+        size_t tile_count = 0;
+        std::atomic<size_t> tiles_done = 0;
+        std::atomic<bool> cancelled = false;
+    };
+
+    static Image Run(const PreparedScene& scene, const CameraOptions& camera_options,
+                     const RenderOptions& render_options, const AsyncRenderOptions& async_options,
+                     State* state) {
+        const SceneGeometry& geometry = scene.GetGeometry();
+        const std::vector<Light>& lights = scene.GetScene().GetLights();
+        const RenderStats before = GetStats(geometry);
+        std::vector<Pixel> pixels = GetView(camera_options);
+        const std::vector<Tile> tiles = GetTiles(camera_options, render_options.tile_size);
+        const size_t wave = async_options.on_partial && async_options.partial_every > 0
+                                ? async_options.partial_every
+                                : std::max<size_t>(tiles.size(), 1);
+        ThreadPool& pool = SharedThreadPool(render_options.threads);
+        for (size_t first = 0; first < tiles.size(); first += wave) {
+            pool.ParallelFor(std::min(wave, tiles.size() - first), [&](size_t i) {
+                if (state->cancelled) {
+                    return;
+                }
+                ShadeTile(geometry, lights, camera_options.screen_height, render_options,
+                          render_options.mode, tiles[first + i], &pixels);
+                ++state->tiles_done;
+            });
+            if (state->cancelled) {
+                throw RenderCancelled();
+            }
+            if (first + wave < tiles.size()) {
+                async_options.on_partial(
+                    ImageFromPixels(pixels, camera_options, render_options.mode,
+                                    render_options.threads),
+                    static_cast<double>(state->tiles_done) / tiles.size());
+            }
+        }
+        ReportStats(geometry, render_options, before);
+        return ImageFromPixels(pixels, camera_options, render_options.mode, render_options.threads);
+    }
+
+    void Stop() {
+        if (state_) {
+            Cancel();
+        }
+        if (thread_.joinable()) {
+            thread_.join();
+        }
+    }
+
+    std::shared_ptr<State> state_;
+    std::future<Image> result_;
+    std::thread thread_;
+};
+
+// Starts rendering `scene` in the background; see RenderJob.
+RenderJob RenderAsync(const PreparedScene& scene, const CameraOptions& camera_options,
+                      const RenderOptions& render_options, AsyncRenderOptions async_options = {}) {
+    return RenderJob(scene, camera_options, render_options, std::move(async_options));
+}
@@ -1,6 +1,12 @@
 #pragma once
 
+#include <image.h>
 #include <pixel.h>
+#include <render_options.h>
+
+#include <algorithm>
+#include <cmath>
+#include <vector>
 
 double MaxScalarByPixels(const std::vector<Pixel>& pixels) {
     double max = 0;
@@ -17,58 +23,49 @@ double MaxScalarByPixels(const std::vector<Pixel>& pixels) {
 double ToOneScale(double color_i, double max) {
     return (color_i + pow(color_i / max, 2)) / (color_i + 1);
 }
-Vector TransformColor(const Pixel& pixel, double max) {
+Vector TransformColor(const Vector& color, double max) {
     Vector result;
-    const Vector& color = pixel.color;
     for (int i = 0; i < 3; ++i) {
         result[i] = pow(ToOneScale(color[i], max), 1 / 2.2);
     }
     return result;
 }
-void TransformAllColors(std::vector<Pixel>* pixels) {
-    double max = MaxScalarByPixels(*pixels);
-    for (Pixel& pixel : *pixels) {
-        pixel.color = TransformColor(pixel, max);
-    }
-}
 
+// Values past [0, 1], which only a max below the true one gives, saturate; not a number, as a
+// max of 0 gives, is black.
 int ScalarToRGB(double c) {
-    return round(c * 255);
-}
-
-void AllToRGB(std::vector<Pixel>* pixels) {
-    for (Pixel& pixel : *pixels) {
-        Vector color = pixel.color;
-        pixel.rgb = {ScalarToRGB(color[0]), ScalarToRGB(color[1]), ScalarToRGB(color[2])};
+    if (std::isnan(c)) {
+        return 0;
     }
+    return round(std::clamp(c, 0.0, 1.0) * 255);
 }
 
-void FullToRGB(std::vector<Pixel>* pixels) {
-    TransformAllColors(pixels);
-    AllToRGB(pixels);
-}
+// Maps raw pixel values of a frame rendered in `mode` to 8-bit color: colors are tone mapped
+// and depths scaled by `max`, the largest component over the frame, and normals moved from
+// [-1, 1] to [0, 1]. A missed depth is white.
+struct ToneMap {
+    RenderMode mode;
+    double max;
 
-void DepthToRGB(std::vector<Pixel>* pixels) {
-    double max = MaxScalarByPixels(*pixels);
-    for (Pixel& pixel : *pixels) {
-        Vector& color = pixel.color;
-        if (color[0] < -0.5) {
-            pixel.color = {1, 1, 1};
-            continue;
-        }
-        for (int i = 0; i < 3; ++i) {
-            color[i] /= max;
+    RGB operator()(Vector color) const {
+        if (mode == RenderMode::kFull) {
+            color = TransformColor(color, max);
+        } else if (mode == RenderMode::kDepth) {
+            if (color[0] < -0.5) {
+                return {255, 255, 255};
+            }
+            for (int i = 0; i < 3; ++i) {
+                color[i] /= max;
+            }
+        } else {
+            for (int i = 0; i < 3; ++i) {
+                color[i] = color[i] / 2 + 0.5;
+            }
         }
+        return {ScalarToRGB(color[0]), ScalarToRGB(color[1]), ScalarToRGB(color[2])};
     }
-    AllToRGB(pixels);
-}
+};
 
-void NormalToRGB(std::vector<Pixel>* pixels) {
-    for (Pixel& pixel : *pixels) {
-        Vector& color = pixel.color;
-        for (int i = 0; i < 3; ++i) {
-            color[i] = color[i] / 2 + 0.5;
-        }
-    }
-    AllToRGB(pixels);
-}
\ No newline at end of file
+ToneMap GetToneMap(const std::vector<Pixel>& pixels, RenderMode mode) {
+    return {mode, mode == RenderMode::kNormal ? 0 : MaxScalarByPixels(pixels)};
+}
@@ -29,3 +29,16 @@ inline void Compare(const Image& actual, const Image& expected) {
     auto similarity = static_cast<double>(matches) / (actual.Width() * actual.Height());
     REQUIRE(similarity >= 0.99);
 }
+
+// Pixel for pixel equal, for renders that must not depend on how the work was split.
+inline void RequireSameImage(const Image& actual, const Image& expected) {
+    REQUIRE(actual.Width() == expected.Width());
+    REQUIRE(actual.Height() == expected.Height());
+    int mismatches = 0;
+    for (int y = 0; y < actual.Height(); ++y) {
+        for (int x = 0; x < actual.Width(); ++x) {
+            mismatches += !(actual.GetPixel(y, x) == expected.GetPixel(y, x));
+        }
+    }
+    REQUIRE(mismatches == 0);
+}
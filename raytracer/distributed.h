@@ -0,0 +1,315 @@
+#pragma once
+
+#include <raytracer.h>
+
+#include <poll.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <cstdint>
+#include <cstring>
+#include <deque>
+#include <functional>
+#include <numeric>
+#include <optional>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct DistributedOptions {
+    // Worker processes rendering at once.
+    int workers = 4;
+    // A worker that has not returned its tile after this long is killed and replaced.
+    std::chrono::milliseconds tile_timeout = std::chrono::minutes(1);
+    // Workers started in place of ones that died or timed out, over the whole render.
+    int max_restarts = 8;
+    // Called in a worker before it renders a tile, with the number of the worker (in the order
+    // workers were started) and of the tile. Lets tests make workers fail or stall.
+    std::function<void(int worker, size_t tile)> before_tile;
+};
+
+// The whole buffer over a socket; false once the other side is gone.
+inline bool SendAll(int fd, const void* data, size_t size) {
+    const char* bytes = static_cast<const char*>(data);
+    while (size > 0) {
+        ssize_t sent = send(fd, bytes, size, MSG_NOSIGNAL);
+        if (sent < 0 && errno == EINTR) {
+            continue;
+        }
+        if (sent <= 0) {
+            return false;
+        }
+        bytes += sent;
+        size -= sent;
+    }
+    return true;
+}
+inline bool ReceiveAll(int fd, void* data, size_t size) {
+    char* bytes = static_cast<char*>(data);
+    while (size > 0) {
+        ssize_t received = recv(fd, bytes, size, 0);
+        if (received < 0 && errno == EINTR) {
+            continue;
+        }
+        if (received <= 0) {
+            return false;
+        }
+        bytes += received;
+        size -= received;
+    }
+    return true;
+}
+
+// Pixel values of a tile, three per pixel, row by row: what a worker sends for it.
+inline size_t TileValueCount(const Tile& tile) {
+    return 3 * tile.Size();
+}
+
+// Body of a worker process: reads the scene, then renders every tile whose index arrives on
+// `fd` and answers with the index and the values of the tile, until `fd` is closed. The scene is
+// read and tiles rendered as RenderTiled does, on this one thread: the pools of the parent did
+// not survive the fork.
+[[noreturn]] inline void RunRenderWorker(int fd, int id, const std::string& filename,
+                                         const CameraOptions& camera_options,
+                                         const RenderOptions& render_options,
+                                         const DistributedOptions& options) {
+    try {
+        const Scene scene = LoadScene(filename, 1);
+        const SceneGeometry geometry(scene);
+        const std::vector<Pixel> pixels = GetView(camera_options);
+        const std::vector<Tile> tiles = GetTiles(camera_options, render_options.tile_size);
+        const int height = camera_options.screen_height;
+        uint32_t index;
+        while (ReceiveAll(fd, &index, sizeof(index)) && index < tiles.size()) {
+            if (options.before_tile) {
+                options.before_tile(id, index);
+            }
+            const Tile& tile = tiles[index];
+            const auto hits =
+                GetPrimaryHits(geometry, pixels, height, render_options.packet_size, tile);
+            std::vector<Scalar> values(TileValueCount(tile));
+            const int tile_width = tile.x1 - tile.x0;
+            for (size_t i = 0; i < hits.size(); ++i) {
+                const Pixel& pixel = pixels[tile.PixelIndex(i, height)];
+                const Vector value = ShadePixel(geometry, scene.GetLights(), pixel, hits[i],
+                                                render_options.mode, render_options.depth);
+                size_t offset = 3 * (static_cast<size_t>(pixel.y - tile.y0) * tile_width +
+                                     pixel.x - tile.x0);
+                for (size_t k = 0; k < 3; ++k) {
+                    values[offset + k] = value[k];
+                }
+            }
+            if (!SendAll(fd, &index, sizeof(index)) ||
+                !SendAll(fd, values.data(), values.size() * sizeof(Scalar))) {
+                break;
+            }
+        }
+    } catch (...) {
+    }
+    // Skips the exit handlers of the parent's copy, such as the destructors of its thread pools.
+    _exit(0);
+}
+
+// Renders `filename` with its tiles spread over worker processes forked from this one, talking
+// over Unix socket pairs. Every worker loads the scene itself and returns the raw values of the
+// tiles it is sent; tone mapping runs here over the assembled pixels, so the image is exactly
+// the one Render gives. A worker that dies or exceeds tile_timeout is replaced and its tile sent
+// again. Once no tile is left to hand out, idle workers take a copy of the tile in flight the
+// longest, and the first answer wins, so one slow worker does not hold up the frame.
+Image RenderDistributed(const std::string& filename, const CameraOptions& camera_options,
+                        const RenderOptions& render_options, const DistributedOptions& options) {
+    using Clock = std::chrono::steady_clock;
+    const std::vector<Tile> tiles = GetTiles(camera_options, render_options.tile_size);
+    const int height = camera_options.screen_height;
+    std::vector<Pixel> pixels = GetView(camera_options);
+
+    struct Worker {
+        pid_t pid = 0;
+        int fd = -1;
+        int id = 0;
+        // Tile being rendered, when it was sent, and the part of the answer received so far.
+        std::optional<uint32_t> tile = {};
+        Clock::time_point sent = {};
+        std::vector<char> received = {};
+    };
+    std::vector<Worker> workers;
+    int started = 0;
+    auto start_worker = [&] {
+        int fds[2];
+        if (socketpair(AF_UNIX, SOCK_STREAM, 0, fds) != 0) {
+            throw std::runtime_error("Can't create a socket pair for a render worker");
+        }
+        const pid_t pid = fork();
+        if (pid < 0) {
+            close(fds[0]);
+            close(fds[1]);
+            throw std::runtime_error("Can't start a render worker");
+        }
+        if (pid == 0) {
+            close(fds[0]);
+            for (const Worker& worker : workers) {
+                close(worker.fd);
+            }
+            RunRenderWorker(fds[1], started, filename, camera_options, render_options, options);
+        }
+        close(fds[1]);
+        workers.push_back({pid, fds[0], started++});
+    };
+    auto stop_worker = [&](const Worker& worker) {
+        kill(worker.pid, SIGKILL);
+        close(worker.fd);
+        waitpid(worker.pid, nullptr, 0);
+    };
+
+    std::deque<uint32_t> queue(tiles.size());
+    std::iota(queue.begin(), queue.end(), 0);
+    std::vector<char> done(tiles.size(), false);
+    // Copies of every tile being rendered.
+    std::vector<int> in_flight(tiles.size(), 0);
+    size_t remaining = tiles.size();
+    int restarts = 0;
+    try {
+        for (int i = 0; i < std::max(options.workers, 1); ++i) {
+            start_worker();
+        }
+        while (remaining > 0) {
+            for (Worker& worker : workers) {
+                if (worker.tile) {
+                    continue;
+                }
+                while (!queue.empty() && done[queue.front()]) {
+                    queue.pop_front();
+                }
+                std::optional<uint32_t> tile;
+                if (!queue.empty()) {
+                    tile = queue.front();
+                    queue.pop_front();
+                } else {
+                    const Worker* slowest = nullptr;
+                    for (const Worker& other : workers) {
+                        if (other.tile && in_flight[*other.tile] == 1 &&
+                            (!slowest || other.sent < slowest->sent)) {
+                            slowest = &other;
+                        }
+                    }
+                    if (slowest) {
+                        tile = slowest->tile;
+                    }
+                }
+                if (!tile) {
+                    continue;
+                }
+                if (!SendAll(worker.fd, &*tile, sizeof(*tile))) {
+                    // Found dead by the poll below.
+                    queue.push_front(*tile);
+                    continue;
+                }
+                worker.tile = tile;
+                worker.sent = Clock::now();
+                ++in_flight[*tile];
+            }
+
+            std::vector<pollfd> fds;
+            int timeout = -1;
+            const Clock::time_point now = Clock::now();
+            for (const Worker& worker : workers) {
+                fds.push_back({worker.fd, POLLIN, 0});
+                if (worker.tile) {
+                    auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+                        worker.sent + options.tile_timeout - now);
+                    int left_ms = std::max<int64_t>(left.count() + 1, 0);
+                    timeout = timeout < 0 ? left_ms : std::min(timeout, left_ms);
+                }
+            }
+            if (poll(fds.data(), fds.size(), timeout) < 0 && errno != EINTR) {
+                throw std::runtime_error("Can't wait for render workers");
+            }
+
+            std::vector<size_t> failed;
+            for (size_t i = 0; i < workers.size(); ++i) {
+                Worker& worker = workers[i];
+                if (!(fds[i].revents & (POLLIN | POLLHUP | POLLERR))) {
+                    if (worker.tile && Clock::now() - worker.sent > options.tile_timeout) {
+                        failed.push_back(i);
+                    }
+                    continue;
+                }
+                if (!worker.tile) {
+                    failed.push_back(i);
+                    continue;
+                }
+                const Tile& tile = tiles[*worker.tile];
+                const size_t expected =
+                    sizeof(uint32_t) + TileValueCount(tile) * sizeof(Scalar);
+                const size_t offset = worker.received.size();
+                worker.received.resize(expected);
+                ssize_t count = read(worker.fd, worker.received.data() + offset, expected - offset);
+                if (count <= 0) {
+                    worker.received.resize(offset);
+                    if (count < 0 && errno == EINTR) {
+                        continue;
+                    }
+                    failed.push_back(i);
+                    continue;
+                }
+                worker.received.resize(offset + count);
+                if (worker.received.size() < expected) {
+                    continue;
+                }
+                uint32_t index;
+                std::memcpy(&index, worker.received.data(), sizeof(index));
+                if (index != *worker.tile) {
+                    failed.push_back(i);
+                    continue;
+                }
+                if (!done[index]) {
+                    const Scalar* values =
+                        reinterpret_cast<const Scalar*>(worker.received.data() + sizeof(index));
+                    for (int y = tile.y0; y < tile.y1; ++y) {
+                        for (int x = tile.x0; x < tile.x1; ++x, values += 3) {
+                            pixels[static_cast<size_t>(x) * height + y].color = {
+                                values[0], values[1], values[2]};
+                        }
+                    }
+                    done[index] = true;
+                    --remaining;
+                }
+                --in_flight[index];
+                worker.tile.reset();
+                worker.received.clear();
+            }
+
+            for (auto it = failed.rbegin(); it != failed.rend(); ++it) {
+                Worker worker = std::move(workers[*it]);
+                workers.erase(workers.begin() + *it);
+                stop_worker(worker);
+                if (worker.tile && --in_flight[*worker.tile] == 0 && !done[*worker.tile]) {
+                    queue.push_front(*worker.tile);
+                }
+            }
+            for (size_t i = 0; i < failed.size(); ++i) {
+                if (restarts == options.max_restarts) {
+                    break;
+                }
+                ++restarts;
+                start_worker();
+            }
+            if (workers.empty()) {
+                throw std::runtime_error("All render workers failed");
+            }
+        }
+    } catch (...) {
+        for (const Worker& worker : workers) {
+            stop_worker(worker);
+        }
+        throw;
+    }
+    for (const Worker& worker : workers) {
+        stop_worker(worker);
+    }
+    return ImageFromPixels(pixels, camera_options, render_options.mode, render_options.threads);
+}
@@ -2,7 +2,15 @@
 
 #include <png.h>
 #include <jpeglib.h>
+#include <png_encoder.h>
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
 #include <iostream>
+#include <memory>
+#include <new>
+#include <stdexcept>
+#include <utility>
 
 struct RGB {
     int r, g, b;
@@ -11,23 +19,42 @@ struct RGB {
     }
 };
 
+// An 8-bit RGBA picture in one contiguous buffer, rows top to bottom without padding, the
+// layout libpng reads and writes row by row. The buffer starts at a kAlignment boundary.
 class Image {
 public:
+    static constexpr size_t kAlignment = 64;
+    static constexpr int kChannels = 4;
+
+    Image() {
+    }
+    // Black and opaque.
     Image(int width, int height) {
-        PrepareImage(width, height);
+        Allocate(width, height);
+        Fill({0, 0, 0});
     }
-
-    void PrepareImage(int width, int height) {
-        height_ = height;
-        width_ = width;
-        bytes_ = static_cast<png_bytep*>(malloc(sizeof(png_bytep) * height_));
-        for (int y = 0; y < height_; y++) {
-            bytes_[y] = static_cast<png_byte*>(malloc(width_ * sizeof(png_byte) * 4));
-            for (int x = 0; x < width_; ++x) {
-                bytes_[y][x * 4] = bytes_[y][x * 4 + 1] = bytes_[y][x * 4 + 2] = 0;
-                bytes_[y][x * 4 + 3] = 255;
-            }
+    Image(const Image& other) {
+        Allocate(other.width_, other.height_);
+        std::memcpy(bytes_.get(), other.bytes_.get(), other.ByteSize());
+    }
+    Image& operator=(const Image& other) {
+        if (this != &other) {
+            Image copy(other);
+            *this = std::move(copy);
         }
+        return *this;
+    }
+    // The source is left empty, 0 x 0.
+    Image(Image&& other) noexcept
+        : width_(std::exchange(other.width_, 0)),
+          height_(std::exchange(other.height_, 0)),
+          bytes_(std::move(other.bytes_)) {
+    }
+    Image& operator=(Image&& other) noexcept {
+        width_ = std::exchange(other.width_, 0);
+        height_ = std::exchange(other.height_, 0);
+        bytes_ = std::move(other.bytes_);
+        return *this;
     }
 
     explicit Image(const std::string& filename) {
@@ -61,8 +88,6 @@ public:
 
         png_read_info(png, info);
 
-        width_ = png_get_image_width(png, info);
-        height_ = png_get_image_height(png, info);
         png_byte color_type = png_get_color_type(png, info);
         png_byte bit_depth = png_get_bit_depth(png, info);
 
@@ -96,14 +121,20 @@ public:
             png_set_gray_to_rgb(png);
         }
 
+        // Interlaced images come in passes over the same rows.
+        const int passes = png_set_interlace_handling(png);
         png_read_update_info(png, info);
 
-        bytes_ = static_cast<png_bytep*>(malloc(sizeof(png_bytep) * height_));
-        for (int y = 0; y < height_; y++) {
-            bytes_[y] = static_cast<png_byte*>(malloc(png_get_rowbytes(png, info)));
+        Allocate(png_get_image_width(png, info), png_get_image_height(png, info));
+        if (png_get_rowbytes(png, info) != RowSize()) {
+            throw std::runtime_error("Unexpected png row size in " + filename);
         }
-
-        png_read_image(png, bytes_);
+        for (int pass = 0; pass < passes; ++pass) {
+            for (int y = 0; y < height_; ++y) {
+                png_read_row(png, Row(y), nullptr);
+            }
+        }
+        png_read_end(png, nullptr);
         png_destroy_read_struct(&png, &info, nullptr);
         fclose(fp);
     }
@@ -128,21 +159,21 @@ public:
         JSAMPARRAY buffer = (*cinfo.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&cinfo),
                                                        JPOOL_IMAGE, row_stride, 1);
 
-        PrepareImage(cinfo.output_width, cinfo.output_height);
-        size_t y = 0;
+        Allocate(cinfo.output_width, cinfo.output_height);
+        int y = 0;
 
         while (cinfo.output_scanline < cinfo.output_height) {
             (void)jpeg_read_scanlines(&cinfo, buffer, 1);
-            for (int x = 0; x < Width(); ++x) {
-                RGB pixel;
+            png_bytep row = Row(y);
+            for (int x = 0; x < Width(); ++x, row += kChannels) {
                 if (cinfo.output_components == 3) {
-                    pixel.r = buffer[0][x * 3];
-                    pixel.g = buffer[0][x * 3 + 1];
-                    pixel.b = buffer[0][x * 3 + 2];
+                    row[0] = buffer[0][x * 3];
+                    row[1] = buffer[0][x * 3 + 1];
+                    row[2] = buffer[0][x * 3 + 2];
                 } else {
-                    pixel.r = pixel.g = pixel.b = buffer[0][x];
+                    row[0] = row[1] = row[2] = buffer[0][x];
                 }
-                SetPixel(pixel, y, x);
+                row[3] = 255;
             }
             ++y;
         }
@@ -152,7 +183,17 @@ public:
         fclose(infile);
     }
 
-    void Write(const std::string& filename) {
+    // Writes a PNG file. With more than one thread the rows are deflated in parallel by
+    // PngEncoder, otherwise libpng encodes them; the two decode to the same pixels.
+    void Write(const std::string& filename, const PngWriteOptions& options = {}) const {
+        CheckPngWriteOptions(options);
+        if (ThreadCount(options.threads) > 1) {
+            PngEncoder encoder(filename, width_, height_, options);
+            encoder.AddRows(Row(0), RowSize(), height_);
+            encoder.Finish();
+            return;
+        }
+
         FILE* fp = fopen(filename.c_str(), "wb");
         if (!fp) {
             throw std::runtime_error("Can't open file " + filename);
@@ -174,16 +215,25 @@ public:
 
         png_init_io(png, fp);
 
-        // Output is 8bit depth, RGBA format.
-        png_set_IHDR(png, info, width_, height_, 8, PNG_COLOR_TYPE_RGBA, PNG_INTERLACE_NONE,
-                     PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        // Output is 8bit depth, RGBA or RGB format.
+        png_set_IHDR(png, info, width_, height_, 8,
+                     options.alpha ? PNG_COLOR_TYPE_RGBA : PNG_COLOR_TYPE_RGB,
+                     PNG_INTERLACE_NONE, PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
+        png_set_compression_level(png, options.compression_level);
+        png_set_compression_strategy(png, options.compression_strategy);
+        static constexpr int kFilterMasks[] = {PNG_FILTER_NONE, PNG_FILTER_SUB,   PNG_FILTER_UP,
+                                               PNG_FILTER_AVG,  PNG_FILTER_PAETH, PNG_ALL_FILTERS};
+        png_set_filter(png, PNG_FILTER_TYPE_BASE, kFilterMasks[static_cast<int>(options.filter)]);
         png_write_info(png, info);
 
-        // To remove the alpha channel for PNG_COLOR_TYPE_RGB format,
-        // Use png_set_filler().
-        // png_set_filler(png, 0, PNG_FILLER_AFTER);
+        // Rows stay RGBA; for RGB output libpng drops the filler byte.
+        if (!options.alpha) {
+            png_set_filler(png, 0, PNG_FILLER_AFTER);
+        }
 
-        png_write_image(png, bytes_);
+        for (int y = 0; y < height_; ++y) {
+            png_write_row(png, Row(y));
+        }
         png_write_end(png, nullptr);
 
         fclose(fp);
@@ -191,19 +241,46 @@ public:
     }
 
     RGB GetPixel(int y, int x) const {
-        auto row = bytes_[y];
-        auto px = &row[x * 4];
+        const png_byte* px = Row(y) + x * kChannels;
         return RGB{px[0], px[1], px[2]};
     }
 
     void SetPixel(const RGB& pixel, int y, int x) {
-        auto row = bytes_[y];
-        auto px = &row[x * 4];
+        png_bytep px = Row(y) + x * kChannels;
         px[0] = pixel.r;
         px[1] = pixel.g;
         px[2] = pixel.b;
     }
 
+    // Sets every pixel to `color`, opaque.
+    void Fill(const RGB& color) {
+        if (height_ == 0 || width_ == 0) {
+            return;
+        }
+        png_bytep first = Row(0);
+        for (int x = 0; x < width_; ++x) {
+            SetPixel(color, 0, x);
+            first[x * kChannels + 3] = 255;
+        }
+        for (int y = 1; y < height_; ++y) {
+            std::memcpy(Row(y), first, RowSize());
+        }
+    }
+
+    // Row y, RowSize() bytes of RGBA pixels.
+    png_bytep Row(int y) {
+        return bytes_.get() + static_cast<size_t>(y) * RowSize();
+    }
+    const png_byte* Row(int y) const {
+        return bytes_.get() + static_cast<size_t>(y) * RowSize();
+    }
+    size_t RowSize() const {
+        return static_cast<size_t>(width_) * kChannels;
+    }
+    size_t ByteSize() const {
+        return RowSize() * height_;
+    }
+
     int Height() const {
         return height_;
     }
@@ -212,14 +289,26 @@ public:
         return width_;
     }
 
-    ~Image() {
-        for (int i = 0; i < height_; ++i) {
-            free(bytes_[i]);
+private:
+    struct Free {
+        void operator()(png_bytep bytes) const {
+            std::free(bytes);
+        }
+    };
+
+    // Uninitialized pixels.
+    void Allocate(int width, int height) {
+        width_ = width;
+        height_ = height;
+        // aligned_alloc takes a multiple of the alignment.
+        const size_t size = (ByteSize() + kAlignment - 1) / kAlignment * kAlignment;
+        bytes_.reset(
+            static_cast<png_bytep>(std::aligned_alloc(kAlignment, std::max(size, kAlignment))));
+        if (!bytes_) {
+            throw std::bad_alloc();
         }
-        free(bytes_);
     }
 
-private:
-    int width_, height_;
-    png_bytep* bytes_;
+    int width_ = 0, height_ = 0;
+    std::unique_ptr<png_byte[], Free> bytes_;
 };
@@ -8,6 +8,6 @@ struct Pixel {
     const Ray direction;
     const double distance;
     const int x, y;
+    // Raw value in the render mode, tone mapped only once the frame is done.
     Vector color{0, 0, 0};
-    RGB rgb{0, 0, 0};
 };
@@ -0,0 +1,355 @@
+#pragma once
+
+#include <png.h>
+#include <zlib.h>
+#include <thread_pool.h>
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+// Row filters of PNG. kAdaptive picks, for every row, the filter whose output has the smallest
+// sum of absolute (signed) bytes, the heuristic libpng uses by default.
+enum class PngFilter { kNone, kSub, kUp, kAverage, kPaeth, kAdaptive };
+
+struct PngWriteOptions {
+    // RGBA, or RGB without the alpha channel.
+    bool alpha = true;
+    // zlib level, 0 to 9 or Z_DEFAULT_COMPRESSION, and strategy: Z_DEFAULT_STRATEGY,
+    // Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE or Z_FIXED.
+    int compression_level = Z_DEFAULT_COMPRESSION;
+    int compression_strategy = Z_DEFAULT_STRATEGY;
+    PngFilter filter = PngFilter::kAdaptive;
+    // Threads deflating row groups at once. One leaves the whole encode to libpng; 0 picks one
+    // per hardware thread.
+    int threads = 1;
+};
+
+// Throws std::invalid_argument for settings zlib would reject.
+inline void CheckPngWriteOptions(const PngWriteOptions& options) {
+    if (options.compression_level < Z_DEFAULT_COMPRESSION || options.compression_level > 9) {
+        throw std::invalid_argument("Bad png compression level");
+    }
+    if (options.compression_strategy < Z_DEFAULT_STRATEGY ||
+        options.compression_strategy > Z_FIXED) {
+        throw std::invalid_argument("Bad png compression strategy");
+    }
+}
+
+// The filter of row `row`, `size` bytes of `bpp`-byte pixels below the row `above` (zeros for
+// the first row): the filter type byte and the filtered bytes, size + 1 in all, go to `out`.
+inline void FilterPngRow(PngFilter filter, const png_byte* row, const png_byte* above,
+                         size_t size, size_t bpp, png_byte* out) {
+    // Bytes before the row start are zeros, so the first pixel predicts from `above` alone.
+    auto apply = [&](PngFilter type, png_byte* dst) {
+        dst[0] = static_cast<png_byte>(type);
+        ++dst;
+        const size_t head = std::min(bpp, size);
+        switch (type) {
+            case PngFilter::kSub:
+                std::copy(row, row + head, dst);
+                for (size_t i = bpp; i < size; ++i) {
+                    dst[i] = row[i] - row[i - bpp];
+                }
+                break;
+            case PngFilter::kUp:
+                for (size_t i = 0; i < size; ++i) {
+                    dst[i] = row[i] - above[i];
+                }
+                break;
+            case PngFilter::kAverage:
+                for (size_t i = 0; i < head; ++i) {
+                    dst[i] = row[i] - above[i] / 2;
+                }
+                for (size_t i = bpp; i < size; ++i) {
+                    dst[i] = row[i] - (row[i - bpp] + above[i]) / 2;
+                }
+                break;
+            case PngFilter::kPaeth:
+                for (size_t i = 0; i < head; ++i) {
+                    dst[i] = row[i] - above[i];
+                }
+                for (size_t i = bpp; i < size; ++i) {
+                    const int a = row[i - bpp], b = above[i], c = above[i - bpp];
+                    const int pa = std::abs(b - c), pb = std::abs(a - c);
+                    const int pc = std::abs(a + b - 2 * c);
+                    dst[i] = row[i] - (pa <= pb && pa <= pc ? a : pb <= pc ? b : c);
+                }
+                break;
+            default:
+                std::copy(row, row + size, dst);
+                break;
+        }
+    };
+    if (filter != PngFilter::kAdaptive) {
+        apply(filter, out);
+        return;
+    }
+    std::vector<png_byte> candidate(size + 1);
+    uint64_t best = UINT64_MAX;
+    for (PngFilter type : {PngFilter::kNone, PngFilter::kSub, PngFilter::kUp,
+                           PngFilter::kAverage, PngFilter::kPaeth}) {
+        apply(type, candidate.data());
+        // Rows summed in runs, given up on once past the best.
+        uint64_t sum = 0;
+        for (size_t i = 1; i <= size && sum < best; i += 256) {
+            for (size_t j = i; j < std::min(i + 256, size + 1); ++j) {
+                sum += candidate[j] < 128 ? candidate[j] : 256 - candidate[j];
+            }
+        }
+        if (sum < best) {
+            best = sum;
+            std::copy(candidate.begin(), candidate.end(), out);
+        }
+    }
+}
+
+// Writes a PNG file from rows of 8-bit RGBA pixels handed over in bands, top to bottom. Every
+// band is cut into groups of rows that are filtered and deflated independently on
+// options.threads threads; the groups end on a sync flush, byte aligned, so their outputs
+// stitched together, one IDAT chunk each, make a single zlib stream. A group is primed with the
+// last 32 KiB of filtered data before it, as one deflate run would see it, which keeps the
+// output nearly as small as a serial encode. Memory is bounded by the band.
+class PngEncoder {
+public:
+    // Bytes of filtered rows per group.
+    static constexpr size_t kGroupBytes = 1 << 18;
+
+    // Starts the file; throws std::runtime_error if it cannot be opened.
+    PngEncoder(const std::string& filename, int width, int height,
+               const PngWriteOptions& options = {})
+        : width_(width),
+          height_(height),
+          options_(options),
+          channels_(options.alpha ? 4 : 3),
+          previous_(RowBytes(), 0) {
+        CheckPngWriteOptions(options);
+        file_ = std::fopen(filename.c_str(), "wb");
+        if (!file_) {
+            throw std::runtime_error("Can't open file " + filename);
+        }
+        static constexpr png_byte kSignature[8] = {137, 80, 78, 71, 13, 10, 26, 10};
+        Put(kSignature, sizeof(kSignature));
+        std::vector<png_byte> header;
+        PutUint32(width, &header);
+        PutUint32(height, &header);
+        header.insert(header.end(), {8, static_cast<png_byte>(options.alpha ? 6 : 2), 0, 0, 0});
+        WriteChunk("IHDR", header);
+
+        // zlib header: deflate with a 32 KiB window, and the level class of FLEVEL.
+        const int level = options.compression_level;
+        const int level_class = level == Z_DEFAULT_COMPRESSION ? 2
+                                : level < 2                    ? 0
+                                : level < 6                    ? 1
+                                : level == 6                   ? 2
+                                                               : 3;
+        const unsigned cmf = 0x78;
+        unsigned flg = level_class << 6;
+        flg += 31 - (cmf * 256 + flg) % 31;
+        stream_start_ = {static_cast<png_byte>(cmf), static_cast<png_byte>(flg)};
+    }
+    PngEncoder(const PngEncoder&) = delete;
+    PngEncoder& operator=(const PngEncoder&) = delete;
+    ~PngEncoder() {
+        if (file_) {
+            std::fclose(file_);
+        }
+    }
+
+    int RowsWritten() const {
+        return rows_written_;
+    }
+
+    // Encodes the next `count` rows, row r of the band starting at rows + r * stride, and
+    // writes them out before returning.
+    void AddRows(const png_byte* rows, size_t stride, int count) {
+        if (count <= 0) {
+            return;
+        }
+        if (count > height_ - rows_written_) {
+            throw std::runtime_error("More png rows than the image has");
+        }
+        const size_t row_bytes = RowBytes();
+        const size_t line = row_bytes + 1;
+        const int group_rows = std::max<size_t>(kGroupBytes / line, 1);
+        const size_t groups = (count + group_rows - 1) / group_rows;
+        const bool last_band = rows_written_ + count == height_;
+
+        std::vector<png_byte> filtered(count * line);
+        ParallelFor(options_.threads, groups, [&](size_t g) {
+            const int first = g * group_rows;
+            const int end = std::min(count, first + group_rows);
+            std::vector<png_byte> row(row_bytes), above(row_bytes);
+            if (first == 0) {
+                above = previous_;
+            } else {
+                Pack(rows + (first - 1) * stride, above.data());
+            }
+            for (int r = first; r < end; ++r) {
+                Pack(rows + r * stride, row.data());
+                FilterPngRow(options_.filter, row.data(), above.data(), row_bytes, channels_,
+                             filtered.data() + r * line);
+                std::swap(row, above);
+            }
+        });
+
+        std::vector<std::vector<png_byte>> compressed(groups);
+        std::vector<uLong> checksums(groups);
+        std::vector<char> failed(groups, false);
+        ParallelFor(options_.threads, groups, [&](size_t g) {
+            const size_t begin = g * group_rows * line;
+            const size_t size = std::min<size_t>(group_rows * line, filtered.size() - begin);
+            checksums[g] = adler32(adler32(0, nullptr, 0), filtered.data() + begin, size);
+            const png_byte* dictionary = filtered.data() + begin - std::min(begin, kWindow);
+            size_t dictionary_size = std::min(begin, kWindow);
+            if (g == 0) {
+                dictionary = dictionary_.data();
+                dictionary_size = dictionary_.size();
+            }
+            failed[g] = !Deflate(filtered.data() + begin, size, dictionary, dictionary_size,
+                                 last_band && g + 1 == groups, &compressed[g]);
+        });
+        if (std::find(failed.begin(), failed.end(), true) != failed.end()) {
+            throw std::runtime_error("Can't deflate png rows");
+        }
+
+        for (size_t g = 0; g < groups; ++g) {
+            const size_t size = std::min<size_t>(group_rows * line,
+                                                 filtered.size() - g * group_rows * line);
+            checksum_ = adler32_combine(checksum_, checksums[g], size);
+            std::vector<png_byte>& data = compressed[g];
+            if (!stream_start_.empty()) {
+                data.insert(data.begin(), stream_start_.begin(), stream_start_.end());
+                stream_start_.clear();
+            }
+            if (last_band && g + 1 == groups) {
+                PutUint32(checksum_, &data);
+            }
+            WriteChunk("IDAT", data);
+        }
+
+        Pack(rows + (count - 1) * stride, previous_.data());
+        if (filtered.size() >= kWindow) {
+            dictionary_.assign(filtered.end() - kWindow, filtered.end());
+        } else {
+            dictionary_.insert(dictionary_.end(), filtered.begin(), filtered.end());
+            if (dictionary_.size() > kWindow) {
+                dictionary_.erase(dictionary_.begin(), dictionary_.end() - kWindow);
+            }
+        }
+        rows_written_ += count;
+    }
+
+    // Ends the file. Throws std::runtime_error if rows are missing or it could not be written.
+    void Finish() {
+        if (rows_written_ != height_) {
+            throw std::runtime_error("Png image is missing rows");
+        }
+        WriteChunk("IEND", {});
+        const bool ok = std::fclose(file_) == 0 && !failed_;
+        file_ = nullptr;
+        if (!ok) {
+            throw std::runtime_error("Can't write png file");
+        }
+    }
+
+private:
+    // The deflate window: how far back a match may reach.
+    static constexpr size_t kWindow = 32768;
+
+    size_t RowBytes() const {
+        return static_cast<size_t>(width_) * channels_;
+    }
+
+    // An RGBA row with the alpha channel dropped when writing RGB.
+    void Pack(const png_byte* rgba, png_byte* out) const {
+        if (channels_ == 4) {
+            std::copy(rgba, rgba + RowBytes(), out);
+            return;
+        }
+        for (int x = 0; x < width_; ++x, rgba += 4, out += 3) {
+            out[0] = rgba[0];
+            out[1] = rgba[1];
+            out[2] = rgba[2];
+        }
+    }
+
+    // Raw deflate of one group, ending on a sync flush or, for the last group, the final block.
+    bool Deflate(const png_byte* data, size_t size, const png_byte* dictionary,
+                 size_t dictionary_size, bool last, std::vector<png_byte>* out) const {
+        z_stream stream{};
+        if (deflateInit2(&stream, options_.compression_level, Z_DEFLATED, -15, 8,
+                         options_.compression_strategy) != Z_OK) {
+            return false;
+        }
+        bool ok = dictionary_size == 0 ||
+                  deflateSetDictionary(&stream, dictionary, dictionary_size) == Z_OK;
+        stream.next_in = const_cast<png_byte*>(data);
+        stream.avail_in = size;
+        out->resize(deflateBound(&stream, size) + 16);
+        const int flush = last ? Z_FINISH : Z_SYNC_FLUSH;
+        while (ok) {
+            stream.next_out = out->data() + stream.total_out;
+            stream.avail_out = out->size() - stream.total_out;
+            const int status = deflate(&stream, flush);
+            if (status == Z_STREAM_ERROR) {
+                ok = false;
+            } else if (last ? status == Z_STREAM_END : stream.avail_out > 0) {
+                break;
+            } else {
+                out->resize(out->size() * 2);
+            }
+        }
+        out->resize(stream.total_out);
+        deflateEnd(&stream);
+        return ok;
+    }
+
+    static void PutUint32(uint32_t value, std::vector<png_byte>* out) {
+        for (int shift = 24; shift >= 0; shift -= 8) {
+            out->push_back(value >> shift);
+        }
+    }
+
+    void Put(const png_byte* data, size_t size) {
+        if (size > 0 && std::fwrite(data, 1, size, file_) != size) {
+            failed_ = true;
+        }
+    }
+
+    // Length, type, data and the CRC of type and data.
+    void WriteChunk(const char (&type)[5], const std::vector<png_byte>& data) {
+        std::vector<png_byte> length;
+        PutUint32(data.size(), &length);
+        Put(length.data(), length.size());
+        const png_byte* type_bytes = reinterpret_cast<const png_byte*>(type);
+        Put(type_bytes, 4);
+        Put(data.data(), data.size());
+        uLong crc = crc32(crc32(0, nullptr, 0), type_bytes, 4);
+        if (!data.empty()) {
+            // A null buffer would reset the CRC.
+            crc = crc32(crc, data.data(), data.size());
+        }
+        std::vector<png_byte> trailer;
+        PutUint32(crc, &trailer);
+        Put(trailer.data(), trailer.size());
+    }
+
+    FILE* file_ = nullptr;
+    int width_, height_;
+    PngWriteOptions options_;
+    size_t channels_;
+    int rows_written_ = 0;
+    bool failed_ = false;
+    // The packed last row written and the filtered bytes before the next band, up to a window.
+    std::vector<png_byte> previous_;
+    std::vector<png_byte> dictionary_;
+    // zlib header, until it has gone out in the first IDAT chunk.
+    std::vector<png_byte> stream_start_;
+    uLong checksum_ = adler32(0, nullptr, 0);
+};
@@ -5,19 +5,48 @@
 #include <render_options.h>
 #include <string>
 #include <scene.h>
+#include <scene_cache.h>
+#include <scene_file.h>
+#include <paged_scene.h>
+#include <primitive_store.h>
+#include <triangle_batch.h>
 #include <view.h>
+#include <thread_pool.h>
 #include <image.h>
 #include <float.h>
 #include <cmath>
 #include <color_transformation.h>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <list>
+#include <memory>
+#include <mutex>
 
-const double kEps = 1e-5;
+// Offset of secondary ray origins from the surface they leave, and the gap left between a shadow
+// ray's end and the shaded point. Hit points in single precision are rounded more coarsely.
+constexpr bool kSinglePrecision = std::is_same_v<Scalar, float>;
+const double kEps = kSinglePrecision ? 1e-3 : 1e-5;
+const double kShadowGap = kSinglePrecision ? 1e-3 : kMykErr;
+
+struct BvhGeometry;
+
+constexpr uint32_t kNoCluster = UINT32_MAX;
+
+// Nearest hit of a ray: primitive `primitive` of `geometry`, seen through `instance` if that is
+// set. `geometry` stays null until something is hit. For triangles, `u` and `v` are the
+// barycentric coordinates found by the intersection test, so shading needs no new solve. A hit
+// on a triangle of a paged scene also records its cluster, which may be evicted before the hit
+// is shaded: `geometry` is then only valid once the cluster is acquired again.
 struct Closest {
-    Closest(const FinalObject& obj, double dist) : final_object(obj), distance(dist) {
-    }
-    const FinalObject& final_object;
-    double distance;
+    const BvhGeometry* geometry = nullptr;
+    uint32_t primitive = 0;
+    const Instance* instance = nullptr;
+    double distance = DBL_MAX;
+    double t = DBL_MAX;
+    double u = 0;
+    double v = 0;
+    uint32_t cluster = kNoCluster;
 };
 Vector Point(const Closest& closest, const Ray& ray) {
     Vector direction = ray.GetDirection();
@@ -30,237 +59,1013 @@ Vector Convert(const Vector& to_p) {
     result.Normalize();
     return result * (-1);
 }
-Vector ToCorrectNormal(const FinalObject& obj, const Vector& point,
-                       const Vector& initial_ray_direction) {
-
-    Vector normal = obj.IfTriangle() ? obj.object.GetNormalAtPoint(point)
-                                     : obj.sphere_object.GetNormalAtPoint(point);
-    //    if (obj.IfTriangle()) {
-    //        normal = obj.object.GetNormalAtPoint(point);
-    //    } else {
-    //        normal = obj.sphere_object.GetNormalAtPoint(point);
-    //    }
+// The normal turned against the direction the point is seen or lit from.
+Vector ToCorrectNormal(Vector normal, const Vector& initial_ray_direction) {
     if (OneSide(initial_ray_direction, normal)) {
         normal = normal * (-1);
     }
     return normal;
 }
 
-std::optional<Closest> GetClosest(const std::vector<FinalObject>& objects, const Ray& ray) {
-    double current_distance = DBL_MAX;
-    std::optional<Closest> current{};
-    for (const auto& obj : objects) {
+// Triangles of one BVH leaf packed for IntersectBatch, with the primitive behind every lane.
+struct LeafBatch {
+    TriangleBatch triangles;
+    std::array<uint32_t, TriangleBatch::kSize> primitives;
+};
+
+// Primitives behind a BVH, with the ids it indexes them by. Primitives past the store are not
+// tested here.
+struct BvhGeometry {
+    BvhGeometry(PrimitiveStore primitive_store, const Bvh& bvh)
+        : store(std::move(primitive_store)), bvh(bvh) {
+        Pack();
+    }
+
+    // Catches up with triangles that moved and with the tree refitted over them: only the lanes
+    // of the moved triangles are packed again, unless the tree was rebuilt.
+    void Refresh(const RefitResult& refitted) {
+        if (refitted.rebuilt) {
+            Pack();
+            return;
+        }
+        for (uint32_t id : refitted.primitives) {
+            if (!store.IsTriangle(id)) {
+                continue;
+            }
+            auto [first, last] = leaf_batches[bvh.GetLeaf(id)];
+            for (uint32_t i = first; i < last; ++i) {
+                LeafBatch& batch = batches[i];
+                for (int lane = 0; lane < batch.triangles.count; ++lane) {
+                    if (batch.primitives[lane] == id) {
+                        batch.triangles.Set(lane, store.GetTriangle(id));
+                    }
+                }
+            }
+        }
+    }
+
+    PrimitiveStore store;
+    const Bvh& bvh;
+    // Range of `batches` holding the triangles of every leaf node.
+    std::vector<std::pair<uint32_t, uint32_t>> leaf_batches;
+    std::vector<LeafBatch> batches;
+
+private:
+    void Pack() {
+        const std::vector<BvhNode>& nodes = bvh.GetNodes();
+        leaf_batches.assign(nodes.size(), {});
+        batches.clear();
+        for (size_t i = 0; i < nodes.size(); ++i) {
+            if (!nodes[i].IsLeaf()) {
+                continue;
+            }
+            leaf_batches[i].first = batches.size();
+            for (uint32_t j = nodes[i].offset; j < nodes[i].offset + nodes[i].count; ++j) {
+                uint32_t id = bvh.GetPrimitives()[j];
+                if (!store.IsTriangle(id)) {
+                    continue;
+                }
+                if (batches.size() == leaf_batches[i].first ||
+                    batches.back().triangles.count == TriangleBatch::kSize) {
+                    batches.emplace_back();
+                }
+                batches.back().primitives[batches.back().triangles.count] = id;
+                batches.back().triangles.Add(store.GetTriangle(id));
+            }
+            leaf_batches[i].second = batches.size();
+        }
+    }
+};
+
+// A cluster of a paged scene read into memory, its leaves packed like those of a mesh. The
+// resident primitives in its leaves are not tested by the BvhGeometry.
+struct LoadedCluster {
+    explicit LoadedCluster(GeometryCluster loaded)
+        : cluster(std::move(loaded)),
+          geometry(PrimitiveStore(cluster.triangles, {}), cluster.bvh) {
+    }
+    // The geometry refers into the cluster.
+    LoadedCluster(const LoadedCluster&) = delete;
+    LoadedCluster& operator=(const LoadedCluster&) = delete;
+
+    size_t MemoryUsage() const {
+        return cluster.MemoryUsage() + geometry.batches.size() * sizeof(LeafBatch) +
+               geometry.leaf_batches.size() * sizeof(geometry.leaf_batches[0]);
+    }
+
+    const GeometryCluster cluster;
+    const BvhGeometry geometry;
+};
+
+// The clusters of a paged scene in memory, read from the file on first use and evicted least
+// recently used first once they take more than `memory_budget` bytes. A cluster still in use
+// by a traversal lives on until it is released, so the budget may be exceeded by the clusters
+// the render threads hold at the moment. Safe to use from several threads at once.
+class ClusterCache {
+public:
+    ClusterCache(ClusterFile file, size_t memory_budget)
+        : file_(std::move(file)), memory_budget_(memory_budget), entries_(file_.ClusterCount()) {
+    }
+    ClusterCache(const ClusterCache&) = delete;
+    ClusterCache& operator=(const ClusterCache&) = delete;
+
+    // The top of the tree, whose leaves hold one cluster each.
+    const Bvh& GetBvh() const {
+        return file_.GetBvh();
+    }
+    // Cluster `cluster`, read in if it is not in memory. Throws std::runtime_error if it is
+    // damaged.
+    std::shared_ptr<const LoadedCluster> Acquire(uint32_t cluster) const {
+        {
+            std::lock_guard lock(mutex_);
+            if (std::shared_ptr<const LoadedCluster> loaded = Touch(cluster)) {
+                return loaded;
+            }
+        }
+        // Read outside the lock, so that threads missing different clusters wait for no one.
+        auto loaded = std::make_shared<const LoadedCluster>(file_.ReadCluster(cluster));
+        page_faults_.fetch_add(1, std::memory_order_relaxed);
+        std::lock_guard lock(mutex_);
+        if (std::shared_ptr<const LoadedCluster> other = Touch(cluster)) {
+            return other;
+        }
+        Entry& entry = entries_[cluster];
+        entry.cluster = loaded;
+        entry.bytes = loaded->MemoryUsage();
+        entry.position = lru_.insert(lru_.begin(), cluster);
+        resident_bytes_ += entry.bytes;
+        while (resident_bytes_ > memory_budget_ && lru_.size() > 1) {
+            Entry& victim = entries_[lru_.back()];
+            resident_bytes_ -= victim.bytes;
+            victim.cluster.reset();
+            lru_.pop_back();
+        }
+        return loaded;
+    }
+
+    // Clusters read from the file so far.
+    uint64_t PageFaults() const {
+        return page_faults_;
+    }
+    // Bytes of the clusters the cache holds.
+    size_t ResidentBytes() const {
+        std::lock_guard lock(mutex_);
+        return resident_bytes_;
+    }
+
+private:
+    struct Entry {
+        // Null while the cluster is not in memory.
+        std::shared_ptr<const LoadedCluster> cluster;
+        size_t bytes = 0;
+        std::list<uint32_t>::iterator position;
+    };
+
+    // The cluster, marked as the most recently used, if it is in memory. Needs the lock.
+    std::shared_ptr<const LoadedCluster> Touch(uint32_t cluster) const {
+        Entry& entry = entries_[cluster];
+        if (entry.cluster) {
+            lru_.splice(lru_.begin(), lru_, entry.position);
+        }
+        return entry.cluster;
+    }
+
+    const ClusterFile file_;
+    const size_t memory_budget_;
+    mutable std::mutex mutex_;
+    // Clusters in memory, the most recently used first.
+    mutable std::list<uint32_t> lru_;
+    mutable std::vector<Entry> entries_;
+    mutable size_t resident_bytes_ = 0;
+    mutable std::atomic<uint64_t> page_faults_ = 0;
+};
+
+// Everything rays are traced against: the top-level BVH over the scene's own triangles and
+// spheres followed by its instances, and one bottom-level geometry per mesh. For a paged scene
+// the top-level BVH ends in clusters, which hold the triangles and refer to the spheres and
+// instances of the resident scene.
+struct SceneGeometry : BvhGeometry {
+    explicit SceneGeometry(const Scene& scene) : SceneGeometry(scene, scene.GetBvh(), nullptr) {
+    }
+    // The resident part of a paged scene, with its clusters.
+    SceneGeometry(const Scene& resident, const ClusterCache& clusters)
+        : SceneGeometry(resident, clusters.GetBvh(), &clusters) {
+    }
+
+    // Catches up with scene.Refit() on the unpaged scene the geometry was made from, for the
+    // next frame of an animation: moved spheres are copied and the leaves of moved triangles
+    // packed again, so the cost follows the changes, not the size of the scene.
+    void Refresh(const Scene& scene) {
+        const RefitResult& refitted = scene.GetRefitted();
+        for (uint32_t id : refitted.primitives) {
+            if (!store.IsTriangle(id) && id < store.Size()) {
+                store.SetSphere(id, scene.GetSphereObjects()[id - store.TriangleCount()].sphere);
+            }
+        }
+        BvhGeometry::Refresh(refitted);
+        for (size_t i = 0; i < meshes.size(); ++i) {
+            meshes[i].Refresh(scene.GetMeshRefitted(i));
+        }
+    }
+    const std::vector<Instance>& instances;
+    // Indexed by MaterialId.
+    const std::vector<Material>& materials;
+    std::vector<BvhGeometry> meshes;
+    // Null unless the scene is paged.
+    const ClusterCache* const clusters;
+    // Shading work done so far; see RenderStats.
+    mutable std::atomic<uint64_t> triangle_hits = 0;
+    mutable std::atomic<uint64_t> interpolated_normals = 0;
+
+private:
+    SceneGeometry(const Scene& scene, const Bvh& bvh, const ClusterCache* clusters)
+        : BvhGeometry(PrimitiveStore(scene.GetTriangles(), scene.GetSphereObjects()), bvh),
+          instances(scene.GetInstances()),
+          materials(scene.GetMaterials().GetMaterials()),
+          clusters(clusters) {
+        meshes.reserve(scene.GetMeshes().size());
+        for (const Mesh& mesh : scene.GetMeshes()) {
+            meshes.emplace_back(PrimitiveStore(mesh.triangles, {}), mesh.bvh);
+        }
+    }
+};
+
+RenderStats GetStats(const SceneGeometry& geometry) {
+    return {geometry.triangle_hits, geometry.interpolated_normals,
+            geometry.clusters ? geometry.clusters->PageFaults() : 0};
+}
+// Fills render_options.stats with the work counted on `geometry` since `before`.
+void ReportStats(const SceneGeometry& geometry, const RenderOptions& render_options,
+                 const RenderStats& before) {
+    if (render_options.stats) {
+        render_options.stats->triangle_hits = geometry.triangle_hits - before.triangle_hits;
+        render_options.stats->interpolated_normals =
+            geometry.interpolated_normals - before.interpolated_normals;
+        render_options.stats->page_faults = GetStats(geometry).page_faults - before.page_faults;
+    }
+}
+
+// Tests the ray against the triangles and spheres of one BVH leaf, keeping the nearest hit in
+// `hit`. `length` converts the ray parameter to the distance. Returns the new limit of the ray
+// parameter.
+double IntersectLeaf(const BvhGeometry& geometry, uint32_t node, const Ray& ray, double length,
+                     double t_max, Closest* hit) {
+    auto [first, last] = geometry.leaf_batches[node];
+    for (uint32_t i = first; i < last; ++i) {
+        BatchHit batch_hit;
+        int lane = IntersectBatch(ray, geometry.batches[i].triangles, 0, t_max, &batch_hit);
+        if (lane >= 0 && batch_hit.t * length < hit->distance) {
+            *hit = {&geometry,          geometry.batches[i].primitives[lane],
+                    nullptr,            batch_hit.t * length,
+                    batch_hit.t,        batch_hit.u,
+                    batch_hit.v};
+            t_max = batch_hit.t;
+        }
+    }
+    const BvhNode& leaf = geometry.bvh.GetNodes()[node];
+    for (uint32_t j = leaf.offset; j < leaf.offset + leaf.count; ++j) {
+        uint32_t id = geometry.bvh.GetPrimitives()[j];
+        if (geometry.store.IsTriangle(id) || id >= geometry.store.Size()) {
+            continue;
+        }
+        std::optional<Intersection> intersection =
+            GetIntersection(ray, geometry.store.GetSphere(id));
+        if (intersection.has_value() && intersection->GetDistance() < hit->distance) {
+            *hit = {&geometry, id, nullptr, intersection->GetDistance(), intersection->GetT()};
+            t_max = intersection->GetT();
+        }
+    }
+    return t_max;
+}
+
+// The ray is moved into the space of the mesh, where it keeps its parameter, so limits and
+// distances carry over from the world ray. Meshes hold triangles only.
+double IntersectInstance(const SceneGeometry& geometry, const Instance& instance, const Ray& ray,
+                         double length, double t_max, Closest* hit) {
+    const BvhGeometry& mesh = geometry.meshes[instance.mesh];
+    const Ray local = instance.inverse.ApplyToRay(ray);
+    // A closer hit may be on the same mesh as the one before, reached through another instance.
+    const double before = hit->distance;
+    mesh.bvh.TraverseLeaves(local, t_max, [&](uint32_t node, double t_max_local) {
+        t_max = IntersectLeaf(mesh, node, local, length, t_max_local, hit);
+        return t_max;
+    });
+    if (hit->distance < before) {
+        hit->instance = &instance;
+    }
+    return t_max;
+}
+
+// Leaf `node` of cluster `index`, loaded as `loaded`: its triangles, then the spheres and the
+// instances it refers to, in the order IntersectLeaf tests those of an unpaged scene.
+double IntersectClusterLeaf(const SceneGeometry& geometry, uint32_t index,
+                            const LoadedCluster& loaded, uint32_t node, const Ray& ray,
+                            double length, double t_max, Closest* hit) {
+    const double before = hit->distance;
+    t_max = IntersectLeaf(loaded.geometry, node, ray, length, t_max, hit);
+    if (hit->distance < before) {
+        hit->cluster = index;
+    }
+    const BvhNode& leaf = loaded.cluster.bvh.GetNodes()[node];
+    const uint32_t triangle_count = loaded.geometry.store.Size();
+    const uint32_t sphere_count = geometry.store.Size();
+    // Index of the resident primitive in slot j of the leaf, or UINT32_MAX for a triangle.
+    auto resident_at = [&](uint32_t j) {
+        uint32_t id = loaded.cluster.bvh.GetPrimitives()[j];
+        return id < triangle_count ? UINT32_MAX : loaded.cluster.resident[id - triangle_count];
+    };
+    for (uint32_t j = leaf.offset; j < leaf.offset + leaf.count; ++j) {
+        uint32_t resident = resident_at(j);
+        if (resident >= sphere_count) {
+            continue;
+        }
         std::optional<Intersection> intersection =
-            obj.IfTriangle() ? GetIntersection(ray, obj.object.polygon)
-                             : GetIntersection(ray, obj.sphere_object.sphere);
-
-        //        if (obj.IfTriangle()) {
-        //            intersection = GetIntersection(ray, obj.object.polygon);
-        //        } else {
-        //            intersection = GetIntersection(ray, obj.sphere_object.sphere);
-        //        }
-        if (intersection.has_value()) {
-            double dist = intersection.value().GetDistance();
-            if (dist < current_distance) {
-                current_distance = dist;
-                current.emplace(Closest(obj, current_distance));
+            GetIntersection(ray, geometry.store.GetSphere(resident));
+        if (intersection.has_value() && intersection->GetDistance() < hit->distance) {
+            *hit = {&geometry, resident, nullptr, intersection->GetDistance(),
+                    intersection->GetT()};
+            t_max = intersection->GetT();
+        }
+    }
+    for (uint32_t j = leaf.offset; j < leaf.offset + leaf.count; ++j) {
+        uint32_t resident = resident_at(j);
+        if (resident != UINT32_MAX && resident >= sphere_count) {
+            t_max = IntersectInstance(geometry, geometry.instances[resident - sphere_count], ray,
+                                      length, t_max, hit);
+        }
+    }
+    return t_max;
+}
+
+// The cluster behind leaf `node` of the top of a paged scene, traversed as if its subtree were
+// still part of the tree.
+double IntersectCluster(const SceneGeometry& geometry, uint32_t node, const Ray& ray,
+                        double length, double t_max, Closest* hit) {
+    const uint32_t index = geometry.bvh.GetPrimitives()[geometry.bvh.GetNodes()[node].offset];
+    const std::shared_ptr<const LoadedCluster> loaded = geometry.clusters->Acquire(index);
+    loaded->cluster.bvh.TraverseLeaves(ray, t_max, [&](uint32_t local, double t_max_local) {
+        t_max = IntersectClusterLeaf(geometry, index, *loaded, local, ray, length, t_max_local,
+                                     hit);
+        return t_max;
+    });
+    return t_max;
+}
+
+double IntersectLeaf(const SceneGeometry& geometry, uint32_t node, const Ray& ray, double length,
+                     double t_max, Closest* hit) {
+    if (geometry.clusters) {
+        return IntersectCluster(geometry, node, ray, length, t_max, hit);
+    }
+    t_max = IntersectLeaf(static_cast<const BvhGeometry&>(geometry), node, ray, length, t_max, hit);
+    const BvhNode& leaf = geometry.bvh.GetNodes()[node];
+    const uint32_t primitive_count = geometry.store.Size();
+    for (uint32_t j = leaf.offset; j < leaf.offset + leaf.count; ++j) {
+        uint32_t id = geometry.bvh.GetPrimitives()[j];
+        if (id >= primitive_count) {
+            t_max = IntersectInstance(geometry, geometry.instances[id - primitive_count], ray,
+                                      length, t_max, hit);
+        }
+    }
+    return t_max;
+}
+
+std::optional<Closest> ToOptional(const Closest& hit) {
+    if (!hit.geometry) {
+        return std::nullopt;
+    }
+    return hit;
+}
+
+std::optional<Closest> GetClosest(const SceneGeometry& geometry, const Ray& ray) {
+    const double length = Length(ray.GetDirection());
+    Closest hit;
+    geometry.bvh.TraverseLeaves(ray, DBL_MAX, [&](uint32_t node, double t_max) {
+        return IntersectLeaf(geometry, node, ray, length, t_max, &hit);
+    });
+    return ToOptional(hit);
+}
+
+// Closest hits of a packet of coherent rays, in the order the rays were added.
+std::vector<std::optional<Closest>> GetClosest(const SceneGeometry& geometry,
+                                               const RayPacket& packet) {
+    std::array<Closest, RayPacket::kMaxSize> hits;
+    std::array<double, RayPacket::kMaxSize> t_max, length;
+    for (int i = 0; i < packet.Size(); ++i) {
+        t_max[i] = DBL_MAX;
+        length[i] = Length(packet.GetRay(i).GetDirection());
+    }
+    geometry.bvh.TraversePacket(packet, t_max.data(), [&](uint32_t node, int first) {
+        if (!geometry.clusters) {
+            for (int i = first; i < packet.Size(); ++i) {
+                t_max[i] =
+                    IntersectLeaf(geometry, node, packet.GetRay(i), length[i], t_max[i], &hits[i]);
             }
+            return;
         }
+        // The packet goes on into the subtree of the cluster as it would down the whole tree.
+        const uint32_t index = geometry.bvh.GetPrimitives()[geometry.bvh.GetNodes()[node].offset];
+        const std::shared_ptr<const LoadedCluster> loaded = geometry.clusters->Acquire(index);
+        loaded->cluster.bvh.TraversePacket(
+            packet, t_max.data(),
+            [&](uint32_t local, int first_local) {
+                for (int i = first_local; i < packet.Size(); ++i) {
+                    t_max[i] = IntersectClusterLeaf(geometry, index, *loaded, local,
+                                                    packet.GetRay(i), length[i], t_max[i],
+                                                    &hits[i]);
+                }
+            },
+            first);
+    });
+    std::vector<std::optional<Closest>> closest;
+    closest.reserve(packet.Size());
+    for (int i = 0; i < packet.Size(); ++i) {
+        closest.push_back(ToOptional(hits[i]));
     }
-    return current;
+    return closest;
 }
 
-Image ImageFromPixels(std::vector<Pixel>* pixels, const CameraOptions& camera_options,
-                      RenderMode mode) {
-    if (mode == RenderMode::kFull) {
-        FullToRGB(pixels);
+// What shading needs to know about a hit point: the material and the outward normal in world
+// space.
+struct Surface {
+    const Material* material;
+    Vector normal;
+    bool is_sphere;
+};
+
+// Barycentric coordinates do not change under affine maps, so an instanced triangle is
+// shaded from the same (u, v) as in mesh space.
+Surface GetSurface(const SceneGeometry& geometry, const Closest& closest, const Vector& point) {
+    std::shared_ptr<const LoadedCluster> loaded;
+    if (closest.cluster != kNoCluster) {
+        loaded = geometry.clusters->Acquire(closest.cluster);
     }
-    if (mode == RenderMode::kDepth) {
-        DepthToRGB(pixels);
+    const PrimitiveStore& store = loaded ? loaded->geometry.store : closest.geometry->store;
+    const Material* material = &geometry.materials[store.GetMaterial(closest.primitive)];
+    if (!store.IsTriangle(closest.primitive)) {
+        return {material, store.GetSphereNormal(closest.primitive, point), true};
     }
-    if (mode == RenderMode::kNormal) {
-        NormalToRGB(pixels);
+    geometry.triangle_hits.fetch_add(1, std::memory_order_relaxed);
+    if (!store.IsFlat(closest.primitive)) {
+        geometry.interpolated_normals.fetch_add(1, std::memory_order_relaxed);
     }
-    Image image(camera_options.screen_width, camera_options.screen_height);
-    for (const Pixel& pixel : *pixels) {
-        int x = pixel.x, y = pixel.y;
-        image.SetPixel(pixel.rgb, y, x);
+    Vector normal = store.GetTriangleNormal(closest.primitive, closest.u, closest.v);
+    if (!closest.instance) {
+        return {material, normal, false};
+    }
+    const Instance& instance = *closest.instance;
+    return {instance.material ? &geometry.materials[*instance.material] : material,
+            instance.inverse.ApplyToNormalTransposed(normal), false};
+}
+
+// A rectangle [x0, x1) x [y0, y1) of the image, the unit of work of a render. Its pixels are
+// listed column by column, like those of GetView.
+struct Tile {
+    int x0, y0, x1, y1;
+
+    size_t Size() const {
+        return static_cast<size_t>(x1 - x0) * (y1 - y0);
+    }
+    // Index in GetView of the pixel with index `i` in the tile.
+    size_t PixelIndex(size_t i, int height) const {
+        int h = y1 - y0;
+        return static_cast<size_t>(x0 + i / h) * height + y0 + i % h;
+    }
+};
+
+// Tiles of a width x height frame, row of tiles by row of tiles.
+std::vector<Tile> GetTiles(int width, int height, int tile_size) {
+    tile_size = std::max(tile_size, 1);
+    std::vector<Tile> tiles;
+    for (int y0 = 0; y0 < height; y0 += tile_size) {
+        for (int x0 = 0; x0 < width; x0 += tile_size) {
+            tiles.push_back(
+                {x0, y0, std::min(width, x0 + tile_size), std::min(height, y0 + tile_size)});
+        }
+    }
+    return tiles;
+}
+std::vector<Tile> GetTiles(const CameraOptions& camera_options, int tile_size) {
+    return GetTiles(camera_options.screen_width, camera_options.screen_height, tile_size);
+}
+
+// Tone maps the pixels of `tile` straight into their place in `image`.
+void WriteTile(const std::vector<Pixel>& pixels, const Tile& tile, int height,
+               const ToneMap& tone_map, Image* image) {
+    for (int x = tile.x0; x < tile.x1; ++x) {
+        const Pixel* column = &pixels[static_cast<size_t>(x) * height];
+        for (int y = tile.y0; y < tile.y1; ++y) {
+            image->SetPixel(tone_map(column[y].color), y, x);
+        }
     }
+}
+
+// Size of the tiles ImageFromPixels spreads over threads.
+constexpr int kToneMapTileSize = 64;
+
+// The image of raw pixel values in `mode`, tone mapped over the whole frame on `threads`
+// threads.
+Image ImageFromPixels(const std::vector<Pixel>& pixels, const CameraOptions& camera_options,
+                      RenderMode mode, int threads = 1) {
+    const ToneMap tone_map = GetToneMap(pixels, mode);
+    Image image(camera_options.screen_width, camera_options.screen_height);
+    const std::vector<Tile> tiles = GetTiles(camera_options, kToneMapTileSize);
+    ParallelFor(threads, tiles.size(), [&](size_t i) {
+        WriteTile(pixels, tiles[i], camera_options.screen_height, tone_map, &image);
+    });
     return image;
 }
 
-std::vector<FinalObject> GetFinalObjects(const std::vector<Object>& triangles,
-                                         const std::vector<SphereObject>& spheres) {
-    std::vector<FinalObject> objects{};
-    for (const auto& obj : triangles) {
-        objects.push_back(FinalObject(obj));
+// Calls render_tile(tile) for every tile of the image on render_options.threads threads of the
+// shared pool. Tiles write disjoint pixels, so the result does not depend on the schedule.
+template <class F>
+void ForEachTile(const CameraOptions& camera_options, const RenderOptions& render_options,
+                 F&& render_tile) {
+    const std::vector<Tile> tiles = GetTiles(camera_options, render_options.tile_size);
+    SharedThreadPool(render_options.threads).ParallelFor(tiles.size(), [&](size_t i) {
+        render_tile(tiles[i]);
+    });
+}
+
+// Primary hits of the pixels of a tile, in tile order; `pixels` are laid out in columns of
+// `height`, as GetView lays them out. Camera rays are traced in packets of
+// packet_size x packet_size neighbouring pixels, or one by one if packet_size is 1.
+std::vector<std::optional<Closest>> GetPrimaryHits(const SceneGeometry& geometry,
+                                                   const std::vector<Pixel>& pixels, int height,
+                                                   int packet_size, const Tile& tile) {
+    std::vector<std::optional<Closest>> hits(tile.Size());
+    if (packet_size <= 1) {
+        for (size_t i = 0; i < hits.size(); ++i) {
+            hits[i] = GetClosest(geometry, pixels[tile.PixelIndex(i, height)].direction);
+        }
+        return hits;
+    }
+    packet_size = std::min(packet_size, 8);
+    const int tile_height = tile.y1 - tile.y0;
+    for (int x0 = tile.x0; x0 < tile.x1; x0 += packet_size) {
+        for (int y0 = tile.y0; y0 < tile.y1; y0 += packet_size) {
+            RayPacket packet;
+            std::vector<size_t> indices;
+            for (int x = x0; x < std::min(tile.x1, x0 + packet_size); ++x) {
+                for (int y = y0; y < std::min(tile.y1, y0 + packet_size); ++y) {
+                    indices.push_back(static_cast<size_t>(x - tile.x0) * tile_height + y - tile.y0);
+                    packet.Add(pixels[static_cast<size_t>(x) * height + y].direction);
+                }
+            }
+            std::vector<std::optional<Closest>> packet_hits = GetClosest(geometry, packet);
+            for (size_t i = 0; i < indices.size(); ++i) {
+                hits[indices[i]] = packet_hits[i];
+            }
+        }
+    }
+    return hits;
+}
+
+// Whether a triangle or sphere of the leaf is hit with the ray parameter inside [t_min, t_max].
+bool LeafOccludes(const BvhGeometry& geometry, uint32_t node, const Ray& ray, double t_min,
+                  double t_max) {
+    auto [first, last] = geometry.leaf_batches[node];
+    for (uint32_t i = first; i < last; ++i) {
+        BatchHit batch_hit;
+        if (IntersectBatch(ray, geometry.batches[i].triangles, t_min, t_max, &batch_hit) >= 0) {
+            return true;
+        }
     }
-    for (const auto& sphere : spheres) {
-        objects.push_back(FinalObject(sphere));
+    const BvhNode& leaf = geometry.bvh.GetNodes()[node];
+    for (uint32_t j = leaf.offset; j < leaf.offset + leaf.count; ++j) {
+        uint32_t id = geometry.bvh.GetPrimitives()[j];
+        if (!geometry.store.IsTriangle(id) && id < geometry.store.Size() &&
+            HasIntersection(ray, geometry.store.GetSphere(id), t_min, t_max)) {
+            return true;
+        }
     }
-    return objects;
+    return false;
+}
+
+bool InstanceOccludes(const SceneGeometry& geometry, const Instance& instance, const Ray& ray,
+                      double t_min, double t_max) {
+    const BvhGeometry& mesh = geometry.meshes[instance.mesh];
+    const Ray local = instance.inverse.ApplyToRay(ray);
+    return mesh.bvh.TraverseLeavesAny(local, t_min, t_max, [&](uint32_t mesh_node) {
+        return LeafOccludes(mesh, mesh_node, local, t_min, t_max);
+    });
+}
+
+// LeafOccludes for the cluster behind leaf `node` of the top of a paged scene.
+bool ClusterOccludes(const SceneGeometry& geometry, uint32_t node, const Ray& ray, double t_min,
+                     double t_max) {
+    const uint32_t index = geometry.bvh.GetPrimitives()[geometry.bvh.GetNodes()[node].offset];
+    const std::shared_ptr<const LoadedCluster> loaded = geometry.clusters->Acquire(index);
+    const uint32_t triangle_count = loaded->geometry.store.Size();
+    const uint32_t sphere_count = geometry.store.Size();
+    return loaded->cluster.bvh.TraverseLeavesAny(ray, t_min, t_max, [&](uint32_t local) {
+        if (LeafOccludes(loaded->geometry, local, ray, t_min, t_max)) {
+            return true;
+        }
+        const BvhNode& leaf = loaded->cluster.bvh.GetNodes()[local];
+        for (uint32_t j = leaf.offset; j < leaf.offset + leaf.count; ++j) {
+            uint32_t id = loaded->cluster.bvh.GetPrimitives()[j];
+            if (id < triangle_count) {
+                continue;
+            }
+            uint32_t resident = loaded->cluster.resident[id - triangle_count];
+            if (resident < sphere_count
+                    ? HasIntersection(ray, geometry.store.GetSphere(resident), t_min, t_max)
+                    : InstanceOccludes(geometry, geometry.instances[resident - sphere_count],
+                                       ray, t_min, t_max)) {
+                return true;
+            }
+        }
+        return false;
+    });
 }
 
-bool CheckIfLightedByOneLight(const Ray& ray, const std::vector<FinalObject>& objects) {
-    //    const Vector& from = ray.GetOrigin();
+// Any-hit query: whether some primitive is hit with the ray parameter inside [t_min, t_max].
+bool IsOccluded(const SceneGeometry& geometry, const Ray& ray, double t_min, double t_max) {
+    const uint32_t primitive_count = geometry.store.Size();
+    return geometry.bvh.TraverseLeavesAny(ray, t_min, t_max, [&](uint32_t node) {
+        if (geometry.clusters) {
+            return ClusterOccludes(geometry, node, ray, t_min, t_max);
+        }
+        if (LeafOccludes(geometry, node, ray, t_min, t_max)) {
+            return true;
+        }
+        const BvhNode& leaf = geometry.bvh.GetNodes()[node];
+        for (uint32_t j = leaf.offset; j < leaf.offset + leaf.count; ++j) {
+            uint32_t id = geometry.bvh.GetPrimitives()[j];
+            if (id >= primitive_count &&
+                InstanceOccludes(geometry, geometry.instances[id - primitive_count], ray, t_min,
+                                 t_max)) {
+                return true;
+            }
+        }
+        return false;
+    });
+}
+// `ray` goes from the light to the shaded point and ends exactly there, so only the segment in
+// front of the point (up to kShadowGap in distance) can block the light.
+bool CheckIfLightedByOneLight(const Ray& ray, const SceneGeometry& geometry) {
     const Vector& to_p = ray.GetDirection();
     double max = Length(to_p);
-    const std::optional<Closest> closest = GetClosest(objects, ray);
-    if (!closest.has_value()) {
-        return false;
-    }
-    //    assert(closest.has_value());
-    return closest.value().distance >= max - kMykErr;
+    return !IsOccluded(geometry, ray, 0, 1 - kShadowGap / max);
 }
-Vector DiffuseByOneLight(const std::vector<FinalObject>& objects, const Light& light,
-                         const FinalObject& obj, const Vector& p) {
+Vector DiffuseByOneLight(const Light& light, const Surface& surface, const Vector& p) {
     const Vector& from = light.position;
     const Vector to_p = p - from;
     const Vector converted_to_p = Convert(to_p);
-    //    const std::optional<Closest> closest = GetClosest(objects, Ray(from,to_p));
-    if (!CheckIfLightedByOneLight(Ray(from, to_p), objects)) {
-        return {0, 0, 0};
-    }
-    const Vector normal = ToCorrectNormal(obj, p, to_p);
-    return light.intensity ^ (obj.IfTriangle() ? obj.object.material->diffuse_color
-                                               : obj.sphere_object.material->diffuse_color) *
-                                 DotProduct(normal, converted_to_p);
+    const Vector normal = ToCorrectNormal(surface.normal, to_p);
+    return light.intensity ^ surface.material->diffuse_color * DotProduct(normal, converted_to_p);
 }
-Vector SpecularByOneLight(const std::vector<FinalObject>& objects, const Light& light,
-                          const Vector& initial_ray_direction, const FinalObject& obj,
-                          const Vector& p) {
+Vector SpecularByOneLight(const Light& light, const Vector& initial_ray_direction,
+                          const Surface& surface, const Vector& p) {
     const Vector& from = light.position;
     const Vector to_p = p - from;
     const Vector converted = Convert(initial_ray_direction);
-    //    const std::optional<Closest> closest = GetClosest(objects, Ray(from,to_p));
-    if (!CheckIfLightedByOneLight(Ray(from, to_p), objects)) {
-        return {0, 0, 0};
-    }
-    const Vector reflected = Reflect(to_p, ToCorrectNormal(obj, p, to_p));
-    return light.intensity ^
-           (obj.IfTriangle() ? obj.object.material->specular_color
-                             : obj.sphere_object.material->specular_color) *
-               pow(std::max(0.0, DotProduct(converted, reflected)),
-                   obj.IfTriangle() ? obj.object.material->specular_exponent
-                                    : obj.sphere_object.material->specular_exponent);
+    const Vector reflected = Reflect(to_p, ToCorrectNormal(surface.normal, to_p));
+    return light.intensity ^ surface.material->specular_color *
+                                 pow(std::max<Scalar>(0, DotProduct(converted, reflected)),
+                                     surface.material->specular_exponent);
 }
 
-Vector GetBaseColor(const std::vector<FinalObject>& objects, const std::vector<Light>& lights,
-                    const Vector& initial_ray_direction, const FinalObject& obj, const Vector& p) {
+Vector GetBaseColor(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                    const Vector& initial_ray_direction, const Surface& surface,
+                    const Vector& p) {
     Vector result;
     for (const Light& light : lights) {
         const Vector& from = light.position;
         const Vector to_p = p - from;
-        if (DotProduct(ToCorrectNormal(obj, p, to_p), initial_ray_direction) < 0) {
-            result += SpecularByOneLight(objects, light, initial_ray_direction, obj, p);
-            result += DiffuseByOneLight(objects, light, obj, p);
+        // One visibility query per light, shared by the diffuse and specular terms.
+        if (DotProduct(ToCorrectNormal(surface.normal, to_p), initial_ray_direction) < 0 &&
+            CheckIfLightedByOneLight(Ray(from, to_p), geometry)) {
+            result += SpecularByOneLight(light, initial_ray_direction, surface, p);
+            result += DiffuseByOneLight(light, surface, p);
         }
     }
-    result *=
-        obj.IfTriangle() ? obj.object.material->albedo[0] : obj.sphere_object.material->albedo[0];
-    result +=
-        obj.IfTriangle() ? obj.object.material->intensity : obj.sphere_object.material->intensity;
-    result += obj.IfTriangle() ? obj.object.material->ambient_color
-                               : obj.sphere_object.material->ambient_color;
+    result *= surface.material->albedo[0];
+    result += surface.material->intensity;
+    result += surface.material->ambient_color;
     return result;
 }
-Vector GetColor(const std::vector<FinalObject>& objects, const std::vector<Light>& lights,
-                const Ray& initial_ray, int k, bool in) {
+Vector GetColor(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                const Ray& initial_ray, int k, bool in);
+// Color seen along `initial_ray`, whose closest hit is already known.
+Vector GetColor(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                const Ray& initial_ray, const std::optional<Closest>& closest, int k, bool in) {
     Vector result;
-    const std::optional<Closest> closest = GetClosest(objects, initial_ray);
     if (!closest.has_value()) {
         return {0, 0, 0};
     }
     const Vector p = Point(closest.value(), initial_ray);
-    const FinalObject& obj = closest.value().final_object;
+    const Surface surface = GetSurface(geometry, closest.value(), p);
+    const Material& material = *surface.material;
     const Vector& direction = initial_ray.GetDirection();
-    result += GetBaseColor(objects, lights, direction, obj, p);
+    result += GetBaseColor(geometry, lights, direction, surface, p);
     if (k == 0) {
         return result;
     }
-    const Vector normal = ToCorrectNormal(obj, p, direction);
+    const Vector normal = ToCorrectNormal(surface.normal, direction);
     if (!in) {
         const Ray reflected(p + normal * kEps, Reflect(direction, normal));
-        result += GetColor(objects, lights, reflected, k - 1, in) *
-                  (obj.IfTriangle() ? obj.object.material->albedo[1]
-                                    : obj.sphere_object.material->albedo[1]);
+        result += GetColor(geometry, lights, reflected, k - 1, in) * material.albedo[1];
     }
-    double eta = obj.IfTriangle() ? obj.object.material->refraction_index
-                                  : obj.sphere_object.material->refraction_index;
+    double eta = material.refraction_index;
     const std::optional<Vector> refracted = Refract(direction, normal, (!in) ? 1 / eta : eta);
     if (refracted.has_value()) {
         Ray ray(p - normal * kEps, refracted.value());
-        if (!obj.IfTriangle()) {
-            result += GetColor(objects, lights, ray, k - 1, !in) *
-                      (in ? 1 : obj.sphere_object.material->albedo[2]);
+        if (surface.is_sphere) {
+            result += GetColor(geometry, lights, ray, k - 1, !in) * (in ? 1 : material.albedo[2]);
         } else {
-            result += GetColor(objects, lights, ray, k - 1, in) * obj.object.material->albedo[2];
+            result += GetColor(geometry, lights, ray, k - 1, in) * material.albedo[2];
         }
     }
     return result;
 }
-Image RenderFull(const std::string& filename, const CameraOptions& camera_options, int k) {
+Vector GetColor(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                const Ray& initial_ray, int k, bool in) {
+    return GetColor(geometry, lights, initial_ray, GetClosest(geometry, initial_ray), k, in);
+}
+// Value of one pixel in `mode` given its primary hit: the color, the distance or the normal. A
+// miss reads {-1, -1, -1} in the depth and normal modes.
+Vector ShadePixel(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                  const Pixel& pixel, const std::optional<Closest>& hit, RenderMode mode,
+                  int depth) {
+    if (mode == RenderMode::kFull) {
+        return GetColor(geometry, lights, pixel.direction, hit, depth, false);
+    }
+    if (!hit.has_value()) {
+        return {-1, -1, -1};
+    }
+    if (mode == RenderMode::kDepth) {
+        return {hit->distance, hit->distance, hit->distance};
+    }
+    const Vector p = Point(hit.value(), pixel.direction);
+    return ToCorrectNormal(GetSurface(geometry, hit.value(), p).normal,
+                           pixel.direction.GetDirection());
+}
+
+// Sets the color of every pixel of `tile` to its value in `mode`; `pixels` are laid out in
+// columns of `height`.
+void ShadeTile(const SceneGeometry& geometry, const std::vector<Light>& lights, int height,
+               const RenderOptions& render_options, RenderMode mode, const Tile& tile,
+               std::vector<Pixel>* pixels) {
+    const auto hits =
+        GetPrimaryHits(geometry, *pixels, height, render_options.packet_size, tile);
+    for (size_t i = 0; i < hits.size(); ++i) {
+        Pixel& pixel = (*pixels)[tile.PixelIndex(i, height)];
+        pixel.color = ShadePixel(geometry, lights, pixel, hits[i], mode, render_options.depth);
+    }
+}
+
+// Every pixel at once, tile by tile.
+Image RenderTiled(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                  const CameraOptions& camera_options, const RenderOptions& render_options,
+                  RenderMode mode) {
+    const RenderStats before = GetStats(geometry);
     std::vector<Pixel> pixels = GetView(camera_options);
-    const Scene scene = ReadScene(filename);
-    const auto objects = GetFinalObjects(scene.GetObjects(), scene.GetSphereObjects());
-    const std::vector<Light>& lights = scene.GetLights();
+    ForEachTile(camera_options, render_options, [&](const Tile& tile) {
+        ShadeTile(geometry, lights, camera_options.screen_height, render_options, mode, tile,
+                  &pixels);
+    });
+    ReportStats(geometry, render_options, before);
+    return ImageFromPixels(pixels, camera_options, mode, render_options.threads);
+}
+Image RenderTiled(const Scene& scene, const CameraOptions& camera_options,
+                  const RenderOptions& render_options, RenderMode mode) {
+    return RenderTiled(SceneGeometry(scene), scene.GetLights(), camera_options, render_options,
+                       mode);
+}
+Image RenderFull(const Scene& scene, const CameraOptions& camera_options,
+                 const RenderOptions& render_options) {
+    return RenderTiled(scene, camera_options, render_options, RenderMode::kFull);
+}
+Image RenderDepth(const Scene& scene, const CameraOptions& camera_options,
+                  const RenderOptions& render_options) {
+    return RenderTiled(scene, camera_options, render_options, RenderMode::kDepth);
+}
+Image RenderNormal(const Scene& scene, const CameraOptions& camera_options,
+                   const RenderOptions& render_options) {
+    return RenderTiled(scene, camera_options, render_options, RenderMode::kNormal);
+}
 
-    for (Pixel& pixel : pixels) {
-        pixel.color = GetColor(objects, lights, pixel.direction, k, false);
-    }
-    return ImageFromPixels(&pixels, camera_options, RenderMode::kFull);
-}
-// const Pixel& search(int x, int y, const std::vector<Pixel>& pixels) {
-//     for (const Pixel& pixel : pixels) {
-//         if (pixel.x == x && pixel.y == y) {
-//             return pixel;
-//         }
-//     }
-// }
-Image RenderDepth(const std::string& filename, const CameraOptions& camera_options) {
+// Result of a time-budgeted render: the best image reached and the fraction of the work of the
+// whole progression that was done, in (0, 1].
+struct ProgressiveImage {
+    Image image;
+    double completed;
+};
+
+// Reflection depth of the preview passes, and their coarsest sampling step.
+constexpr int kPreviewDepth = 1;
+constexpr int kCoarsestStep = 8;
+
+// Renders in passes until render_options.time_budget runs out. The preview passes sample every
+// 8th, 4th, 2nd and finally every pixel in both directions, with reflections cut to
+// kPreviewDepth; a pixel not sampled yet shows the finest sample at the top left corner of its
+// block. A last pass then renders every pixel at full depth, which gives the same image as
+// Render without a budget. Within a pass tiles nearest to the image center go first. The first
+// pass always completes, so there is always an image.
+ProgressiveImage RenderProgressive(const SceneGeometry& geometry,
+                                   const std::vector<Light>& lights,
+                                   const CameraOptions& camera_options,
+                                   const RenderOptions& render_options) {
+    auto now = [&] {
+        return render_options.clock ? render_options.clock() : std::chrono::steady_clock::now();
+    };
+    const auto deadline = now() + render_options.time_budget;
+    const RenderStats before = GetStats(geometry);
     std::vector<Pixel> pixels = GetView(camera_options);
-    //    const Pixel& pixel = search(320,240,pixels);
-    const Scene scene = ReadScene(filename);
-    const auto objects = GetFinalObjects(scene.GetObjects(), scene.GetSphereObjects());
-    for (Pixel& pixel : pixels) {
-        std::optional<Closest> closest = GetClosest(objects, pixel.direction);
-        if (closest.has_value()) {
-            double dist = closest.value().distance;
-            pixel.color = {dist, dist, dist};
-        } else {
-            pixel.color = {-1, -1, -1};
+    const int width = camera_options.screen_width, height = camera_options.screen_height;
+    const RenderMode mode = render_options.mode;
+
+    // Sampling step and depth of every pass.
+    std::vector<std::pair<int, int>> passes;
+    const int preview_depth = std::min(render_options.depth, kPreviewDepth);
+    for (int step = kCoarsestStep; step >= 1; step /= 2) {
+        passes.emplace_back(step, preview_depth);
+    }
+    if (mode == RenderMode::kFull && preview_depth < render_options.depth) {
+        passes.emplace_back(1, render_options.depth);
+    }
+    // Whether pass `pass` samples pixel (x, y): preview passes skip what coarser ones did.
+    auto sampled = [&](size_t pass, int x, int y) {
+        auto [step, depth] = passes[pass];
+        bool on_grid = x % step == 0 && y % step == 0;
+        bool coarser = step < kCoarsestStep && x % (2 * step) == 0 && y % (2 * step) == 0;
+        return on_grid && (depth > preview_depth || !coarser);
+    };
+    size_t total = 0;
+    for (size_t pass = 0; pass < passes.size(); ++pass) {
+        for (int x = 0; x < width; ++x) {
+            for (int y = 0; y < height; ++y) {
+                total += sampled(pass, x, y);
+            }
         }
     }
-    return ImageFromPixels(&pixels, camera_options, RenderMode::kDepth);
-}
 
-Image RenderNormal(const std::string& filename, const CameraOptions& camera_options) {
-    std::vector<Pixel> pixels = GetView(camera_options);
-    const Scene scene = ReadScene(filename);
-    const auto objects = GetFinalObjects(scene.GetObjects(), scene.GetSphereObjects());
+    std::vector<Tile> tiles = GetTiles(camera_options, render_options.tile_size);
+    auto distance = [&](const Tile& tile) {
+        return std::hypot(tile.x0 + tile.x1 - width, tile.y0 + tile.y1 - height);
+    };
+    std::stable_sort(tiles.begin(), tiles.end(), [&](const Tile& lhs, const Tile& rhs) {
+        return distance(lhs) < distance(rhs);
+    });
+    std::vector<char> has_value(pixels.size(), false);
+    std::atomic<size_t> done = 0;
+    ThreadPool& pool = SharedThreadPool(render_options.threads);
+    for (size_t pass = 0; pass < passes.size(); ++pass) {
+        if (pass > 0 && now() >= deadline) {
+            break;
+        }
+        const int depth = passes[pass].second;
+        // Tasks take tiles in order from a shared counter, so the center goes first however
+        // the pool deals the tasks.
+        std::atomic<size_t> next = 0;
+        pool.ParallelFor(tiles.size(), [&](size_t) {
+            const Tile& tile = tiles[next++];
+            if (pass > 0 && now() >= deadline) {
+                return;
+            }
+            std::vector<std::optional<Closest>> hits;
+            if (passes[pass].first == 1 && depth > preview_depth) {
+                hits = GetPrimaryHits(geometry, pixels, height, render_options.packet_size, tile);
+            }
+            size_t count = 0;
+            for (size_t i = 0; i < tile.Size(); ++i) {
+                Pixel& pixel = pixels[tile.PixelIndex(i, height)];
+                if (!sampled(pass, pixel.x, pixel.y)) {
+                    continue;
+                }
+                const std::optional<Closest> hit =
+                    hits.empty() ? GetClosest(geometry, pixel.direction) : hits[i];
+                pixel.color = ShadePixel(geometry, lights, pixel, hit, mode, depth);
+                has_value[tile.PixelIndex(i, height)] = true;
+                ++count;
+            }
+            done += count;
+        });
+    }
+
     for (Pixel& pixel : pixels) {
-        std::optional<Closest> closest = GetClosest(objects, pixel.direction);
-        if (closest.has_value()) {
-            FinalObject obj = closest.value().final_object;
-            pixel.color = ToCorrectNormal(obj, Point(closest.value(), pixel.direction),
-                                          pixel.direction.GetDirection());
-        } else {
-            pixel.color = {-1, -1, -1};
+        if (has_value[static_cast<size_t>(pixel.x) * height + pixel.y]) {
+            continue;
+        }
+        for (int step = 2; step <= kCoarsestStep; step *= 2) {
+            size_t anchor = static_cast<size_t>(pixel.x - pixel.x % step) * height +
+                            pixel.y - pixel.y % step;
+            if (has_value[anchor]) {
+                pixel.color = pixels[anchor].color;
+                break;
+            }
         }
     }
-    return ImageFromPixels(&pixels, camera_options, RenderMode::kNormal);
+    ReportStats(geometry, render_options, before);
+    return {ImageFromPixels(pixels, camera_options, mode, render_options.threads),
+            static_cast<double>(done) / total};
+}
+ProgressiveImage RenderProgressive(const Scene& scene, const CameraOptions& camera_options,
+                                   const RenderOptions& render_options) {
+    return RenderProgressive(SceneGeometry(scene), scene.GetLights(), camera_options,
+                             render_options);
 }
 
+Image Render(const SceneGeometry& geometry, const std::vector<Light>& lights,
+             const CameraOptions& camera_options, const RenderOptions& render_options) {
+    if (render_options.time_budget.count() > 0) {
+        return std::move(
+            RenderProgressive(geometry, lights, camera_options, render_options).image);
+    }
+    return RenderTiled(geometry, lights, camera_options, render_options, render_options.mode);
+}
+Image Render(const Scene& scene, const CameraOptions& camera_options,
+             const RenderOptions& render_options) {
+    return Render(SceneGeometry(scene), scene.GetLights(), camera_options, render_options);
+}
+
+// A scene with everything tracing needs built once, for rendering many views of it. Render may
+// run from several threads at once; the stats of renders that overlap in time include each
+// other's work. An unpaged scene can also be animated: the Set* calls of Scene followed by
+// Refit update it in place for the next frame, at a cost that follows the changes. They must
+// not overlap with renders.
+class PreparedScene {
+public:
+    explicit PreparedScene(Scene scene) : scene_(std::move(scene)), geometry_(scene_) {
+    }
+    // Loads a compiled scene file, or reads an .obj file through the sidecar cache; see
+    // LoadScene.
+    explicit PreparedScene(const std::string& filename) : PreparedScene(LoadScene(filename)) {
+    }
+    // A paged scene, whose clusters are read in as traversal reaches them and kept in memory up
+    // to `memory_budget` bytes; see ClusterCache. It renders the same images as the scene it was
+    // written from, and renders throw std::runtime_error once they reach a damaged cluster.
+    PreparedScene(PagedScene paged, size_t memory_budget)
+        : scene_(std::move(paged.resident)),
+          clusters_(std::make_unique<const ClusterCache>(std::move(paged.clusters), memory_budget)),
+          geometry_(scene_, *clusters_) {
+    }
+    // The geometry refers into the scene, so a prepared scene stays where it was made.
+    PreparedScene(const PreparedScene&) = delete;
+    PreparedScene& operator=(const PreparedScene&) = delete;
+
+    Image Render(const CameraOptions& camera_options, const RenderOptions& render_options) const {
+        return ::Render(geometry_, scene_.GetLights(), camera_options, render_options);
+    }
+
+    // See Scene; they take effect for rendering after Refit. Throw std::runtime_error for a
+    // paged scene.
+    void SetSphere(size_t index, const Sphere& sphere) {
+        Animated().SetSphere(index, sphere);
+    }
+    void SetTriangle(size_t index, const Triangle& polygon, const std::array<Vector, 3>& normals) {
+        Animated().SetTriangle(index, polygon, normals);
+    }
+    void SetTriangle(size_t index, const Triangle& polygon) {
+        Animated().SetTriangle(index, polygon);
+    }
+    void SetMeshTriangle(size_t mesh, size_t index, const Triangle& polygon,
+                         const std::array<Vector, 3>& normals) {
+        Animated().SetMeshTriangle(mesh, index, polygon, normals);
+    }
+    void SetMeshTriangle(size_t mesh, size_t index, const Triangle& polygon) {
+        Animated().SetMeshTriangle(mesh, index, polygon);
+    }
+    void SetInstanceTransform(size_t index, const Transform& transform) {
+        Animated().SetInstanceTransform(index, transform);
+    }
+    void Refit() {
+        Animated().Refit();
+        geometry_.Refresh(scene_);
+    }
+    ProgressiveImage RenderProgressive(const CameraOptions& camera_options,
+                                       const RenderOptions& render_options) const {
+        return ::RenderProgressive(geometry_, scene_.GetLights(), camera_options,
+                                   render_options);
+    }
+
+    const Scene& GetScene() const {
+        return scene_;
+    }
+    const SceneGeometry& GetGeometry() const {
+        return geometry_;
+    }
+
+private:
+    Scene& Animated() {
+        if (clusters_) {
+            throw std::runtime_error("A paged scene can't be animated");
+        }
+        return scene_;
+    }
+
+    // Without the scene's own triangles if it is paged.
+    Scene scene_;
+    // Null unless the scene is paged.
+    const std::unique_ptr<const ClusterCache> clusters_;
+    SceneGeometry geometry_;
+};
+
 Image Render(const std::string& filename, const CameraOptions& camera_options,
              const RenderOptions& render_options) {
 //<<<<<<< HEAD
-    if (render_options.mode == RenderMode::kFull) {
-        return RenderFull(filename, camera_options, render_options.depth);
-    } else if (render_options.mode == RenderMode::kDepth) {
-        return RenderDepth(filename, camera_options);
-    } else {
-        return RenderNormal(filename, camera_options);
-    }
+    return PreparedScene(filename).Render(camera_options, render_options);
 }
 //=======
 //    throw std::runtime_error("Not implemented");
@@ -1,8 +1,38 @@
 #pragma once
 
+#include <chrono>
+#include <cstdint>
+#include <functional>
+
 enum class RenderMode { kDepth, kNormal, kFull };
 
+struct RenderStats {
+    // Triangle hits shaded. Each takes its barycentrics from the intersection test instead of
+    // solving for them again from the hit point.
+    uint64_t triangle_hits = 0;
+    // Hits on smooth triangles, whose vertex normals are interpolated. Flat triangles use their
+    // precomputed geometric normal as is.
+    uint64_t interpolated_normals = 0;
+    // Clusters of a paged scene read from its file because they were not in memory.
+    uint64_t page_faults = 0;
+};
+
 struct RenderOptions {
     int depth;
     RenderMode mode = RenderMode::kFull;
+    // Camera rays of packet_size x packet_size pixel blocks are traced together (at most 8).
+    // 1 traces every camera ray on its own.
+    int packet_size = 8;
+    // If set, receives counters of the shading work done by the render.
+    RenderStats* stats = nullptr;
+    // Threads rendering at once, 0 for one per hardware thread. The image does not depend on it.
+    int threads = 0;
+    // The image is rendered in square tiles of tile_size pixels, one tile per task.
+    int tile_size = 32;
+    // If positive, Render refines the image in passes and returns what it has when the budget
+    // runs out; see RenderProgressive.
+    std::chrono::milliseconds time_budget{0};
+    // Clock the budget is measured on, called from the render threads; unset uses
+    // std::chrono::steady_clock.
+    std::function<std::chrono::steady_clock::time_point()> clock = nullptr;
 };
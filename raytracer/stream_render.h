@@ -0,0 +1,136 @@
+#pragma once
+
+#include <raytracer.h>
+#include <png_encoder.h>
+
+#include <algorithm>
+#include <functional>
+#include <string>
+#include <vector>
+
+// Where the streamed tone mapping takes the largest value of the frame from.
+enum class ToneMax {
+    // A first pass renders the frame without keeping it; the image is exactly the one Render
+    // gives, for twice the rendering work.
+    kTwoPass,
+    // A preview of every preview_step-th pixel in both directions, at full depth. Values above
+    // the largest it finds saturate. A preview that finds nothing above 0 falls back to a first
+    // pass.
+    kPreview,
+};
+
+struct StreamOptions {
+    // Rows rendered, tone mapped and handed on at once: what the memory of a render is
+    // proportional to, with the width of the image.
+    int band_rows = 64;
+    ToneMax tone_max = ToneMax::kTwoPass;
+    int preview_step = 8;
+    // Used by RenderToPng; its threads are taken from the render options.
+    PngWriteOptions png;
+};
+
+// Raw values of the pixels of rows [y0, y1), in the layout of GetView(camera_options, y0, y1).
+// The band is cut into tiles and rendered as RenderTiled renders a frame.
+std::vector<Pixel> RenderBand(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                              const CameraOptions& camera_options,
+                              const RenderOptions& render_options, int y0, int y1) {
+    std::vector<Pixel> pixels = GetView(camera_options, y0, y1);
+    const std::vector<Tile> tiles =
+        GetTiles(camera_options.screen_width, y1 - y0, render_options.tile_size);
+    SharedThreadPool(render_options.threads).ParallelFor(tiles.size(), [&](size_t i) {
+        ShadeTile(geometry, lights, y1 - y0, render_options, render_options.mode, tiles[i],
+                  &pixels);
+    });
+    return pixels;
+}
+
+// The largest value ToneMap scales by, estimated as stream_options.tone_max says.
+double GetStreamMax(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                    const CameraOptions& camera_options, const RenderOptions& render_options,
+                    const StreamOptions& stream_options) {
+    const int width = camera_options.screen_width, height = camera_options.screen_height;
+    const int band_rows = std::max(stream_options.band_rows, 1);
+    double max = 0;
+    if (stream_options.tone_max == ToneMax::kPreview) {
+        const int step = std::max(stream_options.preview_step, 1);
+        std::vector<double> row_max((height + step - 1) / step);
+        ParallelFor(render_options.threads, row_max.size(), [&](size_t i) {
+            const int y = i * step;
+            const std::vector<Pixel> row = GetView(camera_options, y, y + 1);
+            for (int x = 0; x < width; x += step) {
+                const Pixel& pixel = row[x];
+                const Vector value =
+                    ShadePixel(geometry, lights, pixel, GetClosest(geometry, pixel.direction),
+                               render_options.mode, render_options.depth);
+                for (int k = 0; k < 3; ++k) {
+                    row_max[i] = std::max<double>(row_max[i], value[k]);
+                }
+            }
+        });
+        for (double value : row_max) {
+            max = std::max(max, value);
+        }
+        if (max > 0) {
+            return max;
+        }
+    }
+    for (int y0 = 0; y0 < height; y0 += band_rows) {
+        max = std::max(max, MaxScalarByPixels(RenderBand(geometry, lights, camera_options,
+                                                         render_options, y0,
+                                                         std::min(height, y0 + band_rows))));
+    }
+    return max;
+}
+
+// Renders the frame in bands of stream_options.band_rows rows, top to bottom, and calls
+// on_band(band, y0) with each band tone mapped as soon as it is done: an image of the rows
+// starting at y0. Only one band is held at a time, so memory does not grow with the height of
+// the image. Full and depth renders first find the largest value of the frame; see ToneMax.
+// render_options.time_budget is not used.
+void RenderBands(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                 const CameraOptions& camera_options, const RenderOptions& render_options,
+                 const StreamOptions& stream_options,
+                 const std::function<void(const Image& band, int y0)>& on_band) {
+    const RenderMode mode = render_options.mode;
+    const ToneMap tone_map = {
+        mode, mode == RenderMode::kNormal ? 0
+                                          : GetStreamMax(geometry, lights, camera_options,
+                                                         render_options, stream_options)};
+    // The stats count the frame that is kept, not the work of finding the max.
+    const RenderStats before = GetStats(geometry);
+    const int width = camera_options.screen_width, height = camera_options.screen_height;
+    const int band_rows = std::max(stream_options.band_rows, 1);
+    for (int y0 = 0; y0 < height; y0 += band_rows) {
+        const int y1 = std::min(height, y0 + band_rows);
+        const std::vector<Pixel> pixels =
+            RenderBand(geometry, lights, camera_options, render_options, y0, y1);
+        Image band(width, y1 - y0);
+        const std::vector<Tile> tiles = GetTiles(width, y1 - y0, kToneMapTileSize);
+        ParallelFor(render_options.threads, tiles.size(), [&](size_t i) {
+            WriteTile(pixels, tiles[i], y1 - y0, tone_map, &band);
+        });
+        on_band(band, y0);
+    }
+    ReportStats(geometry, render_options, before);
+}
+
+// RenderBands into a PNG file, every band encoded and written out before the next one is
+// rendered. Throws std::runtime_error if the file cannot be written.
+void RenderToPng(const SceneGeometry& geometry, const std::vector<Light>& lights,
+                 const CameraOptions& camera_options, const RenderOptions& render_options,
+                 const std::string& filename, const StreamOptions& stream_options = {}) {
+    PngWriteOptions png = stream_options.png;
+    png.threads = render_options.threads;
+    PngEncoder encoder(filename, camera_options.screen_width, camera_options.screen_height, png);
+    RenderBands(geometry, lights, camera_options, render_options, stream_options,
+                [&](const Image& band, int) {
+                    encoder.AddRows(band.Row(0), band.RowSize(), band.Height());
+                });
+    encoder.Finish();
+}
+void RenderToPng(const PreparedScene& scene, const CameraOptions& camera_options,
+                 const RenderOptions& render_options, const std::string& filename,
+                 const StreamOptions& stream_options = {}) {
+    RenderToPng(scene.GetGeometry(), scene.GetScene().GetLights(), camera_options, render_options,
+                filename, stream_options);
+}
@@ -1,14 +1,25 @@
 #include <catch.hpp>
 #include <util.h>
 
+#include <atomic>
 #include <cmath>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <future>
 #include <string>
 #include <optional>
+#include <random>
+#include <thread>
+#include <tuple>
 
 #include <camera_options.h>
 #include <render_options.h>
 #include <commons.hpp>
 #include <raytracer.h>
+#include <distributed.h>
+#include <async_render.h>
+#include <stream_render.h>
 
 const auto kTestsDir = GetFileDir(__FILE__) / "tests";
 
@@ -23,6 +34,14 @@ void CheckImage(std::string_view obj_filename, std::string_view result_filename,
     Compare(image, ok_image);
 }
 
+// The view of box/cube.obj that most tests render.
+CameraOptions BoxCamera(int width, int height) {
+    CameraOptions camera_opts(width, height, std::numbers::pi / 3);
+    camera_opts.look_from = {0.0, 0.7, 1.75};
+    camera_opts.look_to = {0.0, 0.7, 0.0};
+    return camera_opts;
+}
+
 TEST_CASE("Shading parts", "[raytracer]") {
     CameraOptions camera_opts(640, 480);
     RenderOptions render_opts{1};
@@ -90,3 +109,642 @@ TEST_CASE("Deer", "[raytracer]") {
     RenderOptions render_opts{1};
     CheckImage("deer/CERF_Free.obj", "deer/result.png", camera_opts, render_opts);
 }
+
+TEST_CASE("Instances", "[raytracer]") {
+    CameraOptions camera_opts(640, 480);
+    camera_opts.look_from = {0.5, 2.5, 4.0};
+    camera_opts.look_to = {0.0, 0.3, 0.0};
+    RenderOptions render_opts{4};
+    auto image = Render(kTestsDir / "instances/scene.obj", camera_opts, render_opts);
+    auto flat_image = Render(kTestsDir / "instances/flat.obj", camera_opts, render_opts);
+    Compare(image, flat_image);
+}
+
+TEST_CASE("Overlapping instances", "[raytracer]") {
+    CameraOptions camera_opts(64, 48);
+    camera_opts.look_from = {0.0, 0.0, 4.0};
+    camera_opts.look_to = {0.0, 0.0, 0.0};
+    const Image image = Render(kTestsDir / "instances/overlap.obj", camera_opts, RenderOptions{1});
+    // The closer hit is on the same mesh as the first one, through the instance listed later,
+    // whose material is red.
+    const RGB center = image.GetPixel(24, 32);
+    REQUIRE(center.r > 2 * center.g);
+    REQUIRE(center.r > 2 * center.b);
+}
+
+// The same geometry with every hierarchy built from scratch.
+Scene Rebuilt(const Scene& scene) {
+    std::vector<Mesh> meshes = scene.GetMeshes();
+    for (Mesh& mesh : meshes) {
+        mesh.bvh = Bvh();
+    }
+    return Scene(scene.GetMaterials(), scene.GetLights(), scene.GetSphereObjects(),
+                 scene.GetTriangles(), std::move(meshes), scene.GetInstances());
+}
+
+TEST_CASE("Moving objects", "[raytracer]") {
+    CameraOptions camera_opts(320, 240);
+    camera_opts.look_from = {0.5, 2.5, 4.0};
+    camera_opts.look_to = {0.0, 0.3, 0.0};
+    RenderOptions render_opts{4};
+    // Moved alike: a scene rendered from scratch every frame, and a prepared one that is
+    // refreshed in place.
+    Scene scene = ReadScene(kTestsDir / "instances/scene.obj");
+    PreparedScene prepared(scene);
+    const Image still = Render(scene, camera_opts, render_opts);
+    const Sphere sphere = scene.GetSphereObjects()[0].sphere;
+    const Object floor = scene.GetTriangles().GetObject(0);
+    // The top of the cube mesh, seen through all three instances.
+    const Object top = scene.GetMeshes()[0].triangles.GetObject(6);
+    const Transform transform = scene.GetInstances()[1].transform;
+    auto move = [&](auto update) {
+        update(scene);
+        update(prepared);
+        scene.Refit();
+        prepared.Refit();
+    };
+
+    // Moves within view: the refitted scene renders as one built with them.
+    move([&](auto& target) {
+        target.SetSphere(0, Sphere({0.8, 0.6, -1.0}, 0.5));
+        target.SetTriangle(0, {floor.polygon.GetVertex(0), floor.polygon.GetVertex(1),
+                               floor.polygon.GetVertex(2) + Vector{0, 1, 0}});
+        target.SetMeshTriangle(0, 6, {top.polygon.GetVertex(0) + Vector{0, 0.3, 0},
+                                      top.polygon.GetVertex(1) + Vector{0, 0.3, 0},
+                                      top.polygon.GetVertex(2)});
+        target.SetInstanceTransform(1, Transform::TranslationScale({0.6, 0.25, 1.2}, 0.5));
+    });
+    REQUIRE(!scene.GetRefitted().rebuilt);
+    const Image moved = Render(scene, camera_opts, render_opts);
+    REQUIRE(std::memcmp(moved.Row(0), still.Row(0), still.ByteSize()) != 0);
+    RequireSameImage(moved, Render(Rebuilt(scene), camera_opts, render_opts));
+    RequireSameImage(prepared.Render(camera_opts, render_opts), moved);
+
+    // And back into place.
+    move([&](auto& target) {
+        target.SetSphere(0, sphere);
+        target.SetTriangle(0, floor.polygon, floor.normals);
+        target.SetMeshTriangle(0, 6, top.polygon, top.normals);
+        target.SetInstanceTransform(1, transform);
+    });
+    RequireSameImage(Render(scene, camera_opts, render_opts), still);
+    RequireSameImage(prepared.Render(camera_opts, render_opts), still);
+}
+
+TEST_CASE("Rebuilding degraded trees", "[raytracer]") {
+    // Triangles swapped across the model stretch every box above them, so refitting alone
+    // would leave trees that cost more than Bvh::kMaxDegradation times the built ones.
+    const Scene deer = ReadScene(kTestsDir / "deer/CERF_Free.obj");
+    const TriangleMesh& triangles = deer.GetTriangles();
+    const uint32_t count = triangles.Size();
+    std::vector<uint32_t> swapped;
+    for (uint32_t i = 0; i < count / 2; i += 2) {
+        swapped.push_back(i);
+    }
+    auto swap = [&](auto set) {
+        for (uint32_t i : swapped) {
+            set(i, triangles.GetTriangle(count - 1 - i));
+        }
+    };
+    // Every leaf box holds the primitives of the leaf where they are now.
+    auto require_bounds = [](const Bvh& bvh, auto get_box) {
+        int outside = 0;
+        for (const BvhNode& node : bvh.GetNodes()) {
+            for (uint32_t j = node.offset; node.IsLeaf() && j < node.offset + node.count; ++j) {
+                BoundingBox box = node.box;
+                box.Extend(get_box(bvh.GetPrimitives()[j]));
+                outside += !(box == node.box);
+            }
+        }
+        REQUIRE(outside == 0);
+    };
+
+    // A prepared scene repacks all of its geometry after a rebuild.
+    CameraOptions camera_opts(80, 80);
+    camera_opts.look_from = {100, 200, 150};
+    camera_opts.look_to = {0.0, 100.0, 0.0};
+    const RenderOptions render_opts{1};
+
+    Scene scene = deer;
+    PreparedScene prepared(deer);
+    swap([&](uint32_t i, const Triangle& polygon) {
+        scene.SetTriangle(i, polygon);
+        prepared.SetTriangle(i, polygon);
+    });
+    Bvh refitted = scene.GetBvh();
+    refitted.Refit(swapped, [&](uint32_t i) { return scene.GetPrimitiveBox(i); });
+    REQUIRE(refitted.Degradation() > Bvh::kMaxDegradation);
+    scene.Refit();
+    REQUIRE(scene.GetRefitted().rebuilt);
+    REQUIRE(scene.GetBvh().Degradation() == 1);
+    require_bounds(scene.GetBvh(), [&](uint32_t i) { return scene.GetPrimitiveBox(i); });
+    prepared.Refit();
+    RequireSameImage(prepared.Render(camera_opts, render_opts),
+                     Render(scene, camera_opts, render_opts));
+
+    // The same for the tree of a mesh, seen through an instance.
+    Instance instance;
+    instance.transform = instance.inverse = Transform::TranslationScale({0, 0, 0}, 1);
+    Scene instanced(deer.GetMaterials(), deer.GetLights(), {}, TriangleMesh(),
+                    {Mesh{triangles, {}}}, {instance});
+    PreparedScene prepared_instanced(instanced);
+    swap([&](uint32_t i, const Triangle& polygon) {
+        instanced.SetMeshTriangle(0, i, polygon);
+        prepared_instanced.SetMeshTriangle(0, i, polygon);
+    });
+    const Mesh& mesh = instanced.GetMeshes()[0];
+    Bvh mesh_refitted = mesh.bvh;
+    auto mesh_box = [&](uint32_t i) { return GetBoundingBox(mesh.triangles.GetTriangle(i)); };
+    mesh_refitted.Refit(swapped, mesh_box);
+    REQUIRE(mesh_refitted.Degradation() > Bvh::kMaxDegradation);
+    instanced.Refit();
+    REQUIRE(instanced.GetMeshRefitted(0).rebuilt);
+    REQUIRE(mesh.bvh.Degradation() == 1);
+    require_bounds(mesh.bvh, mesh_box);
+    prepared_instanced.Refit();
+    RequireSameImage(prepared_instanced.Render(camera_opts, render_opts),
+                     Render(instanced, camera_opts, render_opts));
+}
+
+TEST_CASE("Shading stats", "[raytracer]") {
+    const CameraOptions camera_opts = BoxCamera(640, 480);
+    RenderStats stats;
+    RenderOptions render_opts{4, RenderMode::kFull, 8, &stats};
+    Render(kTestsDir / "box/cube.obj", camera_opts, render_opts);
+    // Every triangle hit takes its barycentrics from the intersection; only the face with
+    // distinct vertex normals interpolates them.
+    REQUIRE(stats.triangle_hits > 0);
+    REQUIRE(stats.interpolated_normals > 0);
+    REQUIRE(stats.interpolated_normals < stats.triangle_hits);
+
+    // The deer has one normal per face, so all of its triangles are flat.
+    stats = {};
+    CameraOptions deer_opts(500, 500);
+    deer_opts.look_from = {100, 200, 150};
+    deer_opts.look_to = {0.0, 100.0, 0.0};
+    render_opts.depth = 1;
+    Render(kTestsDir / "deer/CERF_Free.obj", deer_opts, render_opts);
+    REQUIRE(stats.triangle_hits > 0);
+    REQUIRE(stats.interpolated_normals == 0);
+}
+
+TEST_CASE("Thread pool", "[raytracer]") {
+    ThreadPool pool(4);
+    REQUIRE(pool.Size() == 4);
+    // Calls from several threads at once share the workers.
+    std::vector<std::vector<int>> results(3, std::vector<int>(1000));
+    std::vector<std::thread> callers;
+    for (size_t c = 0; c < results.size(); ++c) {
+        callers.emplace_back([&, c] {
+            pool.ParallelFor(results[c].size(), [&](size_t i) { results[c][i] = i * (c + 1); });
+        });
+    }
+    for (std::thread& caller : callers) {
+        caller.join();
+    }
+    for (size_t c = 0; c < results.size(); ++c) {
+        for (size_t i = 0; i < results[c].size(); ++i) {
+            REQUIRE(results[c][i] == static_cast<int>(i * (c + 1)));
+        }
+    }
+    REQUIRE(&SharedThreadPool(3) == &SharedThreadPool(3));
+    REQUIRE(SharedThreadPool(3).Size() == 3);
+
+    // A throwing task, on a worker or on the caller, surfaces from ParallelFor, and the pool
+    // keeps working.
+    for (size_t bad : {0, 500, 999}) {
+        REQUIRE_THROWS_AS(pool.ParallelFor(1000,
+                                           [&](size_t i) {
+                                               if (i == bad) {
+                                                   throw std::runtime_error("Bad task");
+                                               }
+                                           }),
+                          std::runtime_error);
+    }
+    std::atomic<int> count = 0;
+    pool.ParallelFor(1000, [&](size_t) { ++count; });
+    REQUIRE(count == 1000);
+}
+
+TEST_CASE("Image buffer", "[raytracer]") {
+    Image image(37, 5);
+    REQUIRE(reinterpret_cast<uintptr_t>(image.Row(0)) % Image::kAlignment == 0);
+    for (int y = 1; y < image.Height(); ++y) {
+        REQUIRE(image.Row(y) == image.Row(y - 1) + image.RowSize());
+    }
+    REQUIRE(image.ByteSize() == 37 * 5 * 4);
+    image.Fill({10, 20, 30});
+    image.SetPixel({1, 2, 3}, 4, 36);
+    REQUIRE(image.GetPixel(0, 0) == RGB{10, 20, 30});
+    REQUIRE(image.GetPixel(4, 36) == RGB{1, 2, 3});
+    REQUIRE(image.Row(4)[36 * 4 + 3] == 255);
+
+    // Copies own their pixels; a moved-from image is empty.
+    Image copy = image;
+    copy.SetPixel({0, 0, 0}, 0, 0);
+    REQUIRE(image.GetPixel(0, 0) == RGB{10, 20, 30});
+    Image moved = std::move(copy);
+    REQUIRE(copy.Width() == 0);
+    REQUIRE(copy.Height() == 0);
+    REQUIRE(moved.GetPixel(0, 0) == RGB{0, 0, 0});
+    copy = moved;
+    REQUIRE(copy.GetPixel(4, 36) == RGB{1, 2, 3});
+
+    const std::string path = std::filesystem::temp_directory_path() / "image_buffer.png";
+    image.Write(path);
+    const Image read(path);
+    std::filesystem::remove(path);
+    REQUIRE(read.Width() == image.Width());
+    REQUIRE(read.Height() == image.Height());
+    REQUIRE(std::memcmp(read.Row(0), image.Row(0), image.ByteSize()) == 0);
+}
+
+TEST_CASE("Png write options", "[raytracer]") {
+    // Tall enough for several row groups of the parallel encoder.
+    Image image(257, 600);
+    std::mt19937 gen(7);
+    std::uniform_int_distribution<int> noise(0, 15);
+    for (int y = 0; y < image.Height(); ++y) {
+        for (int x = 0; x < image.Width(); ++x) {
+            image.SetPixel({(x + y) % 256, (x * y / 64 + noise(gen)) % 256, y / 4 % 256}, y, x);
+        }
+    }
+    const std::string path = std::filesystem::temp_directory_path() / "png_write_options.png";
+    auto check = [&](const PngWriteOptions& options) {
+        image.Write(path, options);
+        const Image read(path);
+        REQUIRE(read.Width() == image.Width());
+        REQUIRE(read.Height() == image.Height());
+        REQUIRE(std::memcmp(read.Row(0), image.Row(0), image.ByteSize()) == 0);
+        return std::filesystem::file_size(path);
+    };
+    for (int threads : {1, 4}) {
+        for (bool alpha : {true, false}) {
+            for (PngFilter filter : {PngFilter::kNone, PngFilter::kSub, PngFilter::kUp,
+                                     PngFilter::kAverage, PngFilter::kPaeth,
+                                     PngFilter::kAdaptive}) {
+                check({alpha, Z_DEFAULT_COMPRESSION, Z_DEFAULT_STRATEGY, filter, threads});
+            }
+            for (int strategy : {Z_FILTERED, Z_HUFFMAN_ONLY, Z_RLE, Z_FIXED}) {
+                check({alpha, 1, strategy, PngFilter::kAdaptive, threads});
+            }
+            check({alpha, 0, Z_DEFAULT_STRATEGY, PngFilter::kNone, threads});
+            check({alpha, 9, Z_DEFAULT_STRATEGY, PngFilter::kPaeth, threads});
+        }
+    }
+    // Groups primed with the data before them compress about as well as one deflate run.
+    const auto serial = check({});
+    const auto parallel = check({.threads = 4});
+    REQUIRE(parallel < serial * 1.02);
+
+    // Rows handed to the encoder in uneven bands make the same picture.
+    {
+        PngEncoder encoder(path, image.Width(), image.Height(), {.threads = 3});
+        const int bands[] = {0, 1, 2, 300, 301, 599, 600};
+        for (size_t i = 0; i + 1 < std::size(bands); ++i) {
+            encoder.AddRows(image.Row(bands[i]), image.RowSize(), bands[i + 1] - bands[i]);
+        }
+        encoder.Finish();
+    }
+    const Image banded(path);
+    std::filesystem::remove(path);
+    REQUIRE(std::memcmp(banded.Row(0), image.Row(0), image.ByteSize()) == 0);
+
+    REQUIRE_THROWS_AS(image.Write(path, {.compression_level = 10}), std::invalid_argument);
+    REQUIRE_THROWS_AS(image.Write(path, {.compression_strategy = 7}), std::invalid_argument);
+}
+
+TEST_CASE("Tiled rendering", "[raytracer]") {
+    const CameraOptions camera_opts = BoxCamera(320, 240);
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    for (RenderMode mode : {RenderMode::kFull, RenderMode::kDepth, RenderMode::kNormal}) {
+        RenderOptions serial{4, mode};
+        serial.threads = 1;
+        const Image expected = Render(scene, camera_opts, serial);
+        // Any split into tiles and threads gives the same pixels, with packets or without.
+        for (auto [threads, tile_size, packet_size] : {std::tuple{4, 7, 8}, std::tuple{3, 64, 1},
+                                                       std::tuple{2, 1000, 4}}) {
+            RenderOptions render_opts{4, mode, packet_size};
+            render_opts.threads = threads;
+            render_opts.tile_size = tile_size;
+            const Image image = Render(scene, camera_opts, render_opts);
+            RequireSameImage(image, expected);
+        }
+    }
+}
+
+TEST_CASE("Progressive rendering", "[raytracer]") {
+    const CameraOptions camera_opts = BoxCamera(320, 240);
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    RenderOptions render_opts{4};
+    const Image expected = Render(scene, camera_opts, render_opts);
+
+    // With time to spare every pass runs, and the last one is the full render.
+    render_opts.time_budget = std::chrono::hours(1);
+    const ProgressiveImage full = RenderProgressive(scene, camera_opts, render_opts);
+    REQUIRE(full.completed == 1);
+    RequireSameImage(full.image, expected);
+
+    // A budget that runs out as soon as the render starts still gives a whole image, from the
+    // first pass alone: every 8th pixel in both directions of the 2 x 320 x 240 sampled in all.
+    const auto start = std::chrono::steady_clock::now();
+    std::atomic<bool> started = false;
+    render_opts.time_budget = std::chrono::milliseconds(1);
+    render_opts.clock = [&] {
+        return started.exchange(true) ? start + render_opts.time_budget : start;
+    };
+    const ProgressiveImage preview = RenderProgressive(scene, camera_opts, render_opts);
+    REQUIRE(preview.completed == 1. / 128);
+    REQUIRE(preview.image.Width() == expected.Width());
+    REQUIRE(preview.image.Height() == expected.Height());
+    // Render takes the same path when given a budget.
+    REQUIRE(Render(scene, camera_opts, render_opts).Width() == expected.Width());
+}
+
+TEST_CASE("Streaming render", "[raytracer]") {
+    const CameraOptions camera_opts = BoxCamera(320, 240);
+    const PreparedScene scene(ReadScene(kTestsDir / "box/cube.obj"));
+    const std::string path = std::filesystem::temp_directory_path() / "streaming_render.png";
+    auto same = [](const Image& lhs, const Image& rhs) {
+        return lhs.Width() == rhs.Width() && lhs.Height() == rhs.Height() &&
+               std::memcmp(lhs.Row(0), rhs.Row(0), lhs.ByteSize()) == 0;
+    };
+    for (RenderMode mode : {RenderMode::kFull, RenderMode::kDepth, RenderMode::kNormal}) {
+        RenderOptions render_opts{4, mode};
+        render_opts.threads = 3;
+        render_opts.tile_size = 16;
+        const Image expected = scene.Render(camera_opts, render_opts);
+
+        // Bands come top to bottom, the last one short, and make up the frame.
+        StreamOptions stream_opts;
+        stream_opts.band_rows = 50;
+        Image assembled(camera_opts.screen_width, camera_opts.screen_height);
+        std::vector<int> starts;
+        RenderBands(scene.GetGeometry(), scene.GetScene().GetLights(), camera_opts, render_opts,
+                    stream_opts, [&](const Image& band, int y0) {
+                        REQUIRE(band.Width() == assembled.Width());
+                        REQUIRE(band.Height() == std::min(50, assembled.Height() - y0));
+                        std::memcpy(assembled.Row(y0), band.Row(0), band.ByteSize());
+                        starts.push_back(y0);
+                    });
+        REQUIRE(starts == std::vector<int>{0, 50, 100, 150, 200});
+        REQUIRE(same(assembled, expected));
+
+        // With two passes the file holds exactly the image Render gives, and so does a preview
+        // of every pixel.
+        stream_opts.band_rows = 7;
+        RenderToPng(scene, camera_opts, render_opts, path, stream_opts);
+        REQUIRE(same(Image(path), expected));
+        stream_opts.tone_max = ToneMax::kPreview;
+        stream_opts.preview_step = 1;
+        RenderToPng(scene, camera_opts, render_opts, path, stream_opts);
+        REQUIRE(same(Image(path), expected));
+
+        // A sparse preview can only miss the brightest values, which makes the image brighter.
+        stream_opts.preview_step = 8;
+        stream_opts.png = {.alpha = false, .compression_level = 1};
+        RenderToPng(scene, camera_opts, render_opts, path, stream_opts);
+        const Image preview(path);
+        REQUIRE(preview.Width() == expected.Width());
+        REQUIRE(preview.Height() == expected.Height());
+        int darker = 0;
+        for (int y = 0; y < preview.Height(); ++y) {
+            for (int x = 0; x < preview.Width(); ++x) {
+                const RGB actual = preview.GetPixel(y, x), base = expected.GetPixel(y, x);
+                darker += actual.r < base.r || actual.g < base.g || actual.b < base.b;
+            }
+        }
+        REQUIRE(darker == 0);
+
+        // The stats count the frame that was kept, not the pass that found the max.
+        RenderStats expected_stats, stats;
+        render_opts.stats = &expected_stats;
+        scene.Render(camera_opts, render_opts);
+        render_opts.stats = &stats;
+        stream_opts.tone_max = ToneMax::kTwoPass;
+        RenderToPng(scene, camera_opts, render_opts, path, stream_opts);
+        REQUIRE(stats.triangle_hits == expected_stats.triangle_hits);
+        REQUIRE(stats.interpolated_normals == expected_stats.interpolated_normals);
+    }
+
+    // A preview that only samples a pixel missing everything finds no max and falls back to a
+    // first pass.
+    CameraOptions triangle_opts(160, 120);
+    triangle_opts.look_from = {0.0, 2.0, 0.0};
+    triangle_opts.look_to = {0.0, 0.0, 0.0};
+    const PreparedScene triangle(ReadScene(kTestsDir / "triangle/scene.obj"));
+    for (RenderMode mode : {RenderMode::kFull, RenderMode::kDepth}) {
+        RenderOptions render_opts{1, mode};
+        const Image expected = triangle.Render(triangle_opts, render_opts);
+        const int background = mode == RenderMode::kFull ? 0 : 255;
+        REQUIRE(expected.GetPixel(0, 0) == RGB{background, background, background});
+        StreamOptions stream_opts;
+        stream_opts.tone_max = ToneMax::kPreview;
+        stream_opts.preview_step = 1000;
+        RenderToPng(triangle, triangle_opts, render_opts, path, stream_opts);
+        REQUIRE(same(Image(path), expected));
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Prepared scene", "[raytracer]") {
+    const Scene scene = ReadScene(kTestsDir / "box/cube.obj");
+    const PreparedScene prepared(ReadScene(kTestsDir / "box/cube.obj"));
+    RenderStats stats;
+    RenderOptions render_opts{4, RenderMode::kFull, 8, &stats};
+    render_opts.threads = 2;
+
+    // Views around the scene, rendered from several threads at once.
+    std::vector<CameraOptions> views;
+    for (int i = 0; i < 4; ++i) {
+        CameraOptions camera_opts(160, 120, std::numbers::pi / 3);
+        double angle = i * std::numbers::pi / 8;
+        camera_opts.look_from = {1.75 * std::sin(angle), 0.7, 1.75 * std::cos(angle)};
+        camera_opts.look_to = {0.0, 0.7, 0.0};
+        views.push_back(camera_opts);
+    }
+    std::vector<std::optional<Image>> images(views.size());
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < views.size(); ++i) {
+            threads.emplace_back([&, i] {
+                RenderOptions options{4};
+                options.threads = 2;
+                images[i] = prepared.Render(views[i], options);
+            });
+        }
+        for (std::thread& thread : threads) {
+            thread.join();
+        }
+    }
+    for (size_t i = 0; i < views.size(); ++i) {
+        const Image expected = Render(scene, views[i], render_opts);
+        RequireSameImage(*images[i], expected);
+    }
+
+    // A compiled scene file renders the same.
+    const std::string path = std::filesystem::temp_directory_path() / "prepared_cube.rtscene";
+    SaveSceneFile(scene, path);
+    const Image from_file = Render(path, views[0], RenderOptions{4});
+    std::filesystem::remove(path);
+    RequireSameImage(from_file, *images[0]);
+
+    // Stats count the work of one render, not of every render the scene has seen.
+    const RenderStats single = stats;
+    prepared.Render(views.back(), render_opts);
+    REQUIRE(stats.triangle_hits == single.triangle_hits);
+    REQUIRE(stats.interpolated_normals == single.interpolated_normals);
+}
+
+TEST_CASE("Paged scene", "[raytracer]") {
+    // Triangles with spheres, instances, and a larger smooth mesh.
+    const CameraOptions box_opts = BoxCamera(160, 120);
+    CameraOptions instances_opts(160, 120);
+    instances_opts.look_from = {0.5, 2.5, 4.0};
+    instances_opts.look_to = {0.0, 0.3, 0.0};
+    CameraOptions deer_opts(160, 160);
+    deer_opts.look_from = {100, 200, 150};
+    deer_opts.look_to = {0.0, 100.0, 0.0};
+    const std::vector<std::tuple<std::string, CameraOptions, int>> cases = {
+        {"box/cube.obj", box_opts, 4},
+        {"instances/scene.obj", instances_opts, 4},
+        {"deer/CERF_Free.obj", deer_opts, 1}};
+    const std::string path = std::filesystem::temp_directory_path() / "paged_scene.rtpaged";
+    for (const auto& [filename, camera_opts, depth] : cases) {
+        const Scene scene = ReadScene(kTestsDir / filename);
+        SavePagedScene(scene, path, 4);
+        // A budget below one cluster keeps a single cluster in memory, so the render pages
+        // clusters in and out all the time.
+        const PreparedScene paged(*LoadPagedScene(path), 0);
+        REQUIRE(paged.GetScene().GetTriangles().Empty());
+        for (int packet_size : {1, 8}) {
+            RenderOptions render_opts{depth};
+            render_opts.packet_size = packet_size;
+            const Image expected = Render(scene, camera_opts, render_opts);
+            RenderStats stats;
+            render_opts.stats = &stats;
+            const Image image = paged.Render(camera_opts, render_opts);
+            RequireSameImage(image, expected);
+            REQUIRE(stats.page_faults > 0);
+        }
+    }
+
+    // With room for every cluster, a second frame reads nothing from the file.
+    const PreparedScene cached(*LoadPagedScene(path), SIZE_MAX);
+    RenderStats stats;
+    RenderOptions render_opts{1, RenderMode::kFull, 8, &stats};
+    cached.Render(deer_opts, render_opts);
+    REQUIRE(stats.page_faults > 0);
+    cached.Render(deer_opts, render_opts);
+    REQUIRE(stats.page_faults == 0);
+
+    // The triangles are in the file, so a paged scene can't be animated.
+    PreparedScene animated(*LoadPagedScene(path), SIZE_MAX);
+    REQUIRE_THROWS_AS(animated.SetSphere(0, Sphere({0, 0, 0}, 1)), std::runtime_error);
+    REQUIRE_THROWS_AS(animated.Refit(), std::runtime_error);
+
+    // Clusters are checked as render threads read them; a damaged one fails the render.
+    const size_t size = std::filesystem::file_size(path);
+    {
+        std::fstream file(path, std::ios::in | std::ios::out | std::ios::binary);
+        file.seekp(size - size / 4);
+        const std::string garbage(size / 4, '\xff');
+        file.write(garbage.data(), garbage.size());
+    }
+    for (int threads : {1, 4}) {
+        const PreparedScene damaged(*LoadPagedScene(path), 0);
+        RenderOptions damaged_opts{1};
+        damaged_opts.threads = threads;
+        REQUIRE_THROWS_AS(damaged.Render(deer_opts, damaged_opts), std::runtime_error);
+    }
+    std::filesystem::remove(path);
+}
+
+TEST_CASE("Asynchronous rendering", "[raytracer]") {
+    const CameraOptions camera_opts = BoxCamera(320, 240);
+    const PreparedScene prepared(ReadScene(kTestsDir / "box/cube.obj"));
+    RenderOptions render_opts{4};
+    render_opts.tile_size = 16;
+    const Image expected = prepared.Render(camera_opts, render_opts);
+
+    // Filled on the thread of the job, checked once it is done.
+    std::vector<double> progress;
+    std::vector<int> partial_widths;
+    AsyncRenderOptions async_opts;
+    async_opts.partial_every = 100;
+    async_opts.on_partial = [&](const Image& partial, double done) {
+        partial_widths.push_back(partial.Width());
+        progress.push_back(done);
+    };
+    RenderJob job = RenderAsync(prepared, camera_opts, render_opts, async_opts);
+    const Image image = job.Get();
+    REQUIRE(job.TileCount() == 300);
+    REQUIRE(job.Progress() == 1);
+    REQUIRE(progress == std::vector<double>{1.0 / 3, 2.0 / 3});
+    REQUIRE(partial_widths == std::vector<int>(2, expected.Width()));
+    RequireSameImage(image, expected);
+
+    // Cancelled while it shows its first partial image, the job skips every tile after it.
+    std::promise<void> reached, cancelled;
+    async_opts.on_partial = [&, first = true](const Image&, double) mutable {
+        if (std::exchange(first, false)) {
+            reached.set_value();
+            cancelled.get_future().wait();
+        }
+    };
+    RenderJob cancelled_job = RenderAsync(prepared, camera_opts, render_opts, async_opts);
+    reached.get_future().wait();
+    REQUIRE(!cancelled_job.Ready());
+    cancelled_job.Cancel();
+    cancelled.set_value();
+    REQUIRE_THROWS_AS(cancelled_job.Get(), RenderCancelled);
+    REQUIRE(cancelled_job.TilesDone() == 100);
+
+    // Without partial images the pool gets every tile at once.
+    async_opts.on_partial = nullptr;
+    async_opts.partial_every = 1;
+    RequireSameImage(RenderAsync(prepared, camera_opts, render_opts, async_opts).Get(), expected);
+
+    // Dropping a handle stops its job.
+    RenderAsync(prepared, camera_opts, render_opts, async_opts);
+}
+
+TEST_CASE("Distributed rendering", "[raytracer]") {
+    const CameraOptions camera_opts = BoxCamera(160, 120);
+    const std::string filename = kTestsDir / "box/cube.obj";
+    RenderOptions render_opts{4};
+    const Image expected = Render(filename, camera_opts, render_opts);
+    auto check = [&](const DistributedOptions& options) {
+        RequireSameImage(RenderDistributed(filename, camera_opts, render_opts, options), expected);
+    };
+
+    DistributedOptions options;
+    options.workers = 3;
+    check(options);
+
+    // The first worker dies after one tile and the second stalls on its first: the first is
+    // replaced and a copy of the stalled tile goes to an idle worker.
+    options.before_tile = [](int worker, size_t tile) {
+        if (worker == 0 && tile != 0) {
+            _exit(1);
+        }
+        if (worker == 1 && tile == 1) {
+            std::this_thread::sleep_for(std::chrono::seconds(30));
+        }
+    };
+    check(options);
+
+    // A lone worker that hangs is killed after the timeout and replaced.
+    options.workers = 1;
+    options.tile_timeout = std::chrono::milliseconds(200);
+    options.before_tile = [](int worker, size_t tile) {
+        if (worker == 0 && tile == 2) {
+            std::this_thread::sleep_for(std::chrono::seconds(30));
+        }
+    };
+    check(options);
+
+    // Without restarts left the render fails rather than hangs.
+    options.max_restarts = 0;
+    REQUIRE_THROWS(RenderDistributed(filename, camera_opts, render_opts, options));
+}
@@ -5,6 +5,7 @@
 #include <pixel.h>
 
 #include <cmath>
+#include <limits>
 double Dx(const CameraOptions& camera_options, int x) {
     double angle_v = camera_options.fov / 2;
     int width_p = camera_options.screen_width;
@@ -34,13 +35,16 @@ bool CheckVectorForError(const Vector& real, const Vector& target, double err) {
            CheckDoubleForError(real[1], target[1], err) &&
            CheckDoubleForError(real[1], target[1], err);
 }
-std::vector<Pixel> GetView(const CameraOptions& camera_options) {
+// Pixels of rows [y0, y1) of the view, column by column: pixel (x, y) comes at index
+// x * (y1 - y0) + y - y0.
+std::vector<Pixel> GetView(const CameraOptions& camera_options, int y0, int y1) {
     std::vector<Pixel> result{};
-    const double err = 1e-8;
+    result.reserve(static_cast<size_t>(camera_options.screen_width) * (y1 - y0));
+    // Loose enough for a view direction normalized in single precision.
+    const double err = std::max(1e-8, 8. * std::numeric_limits<Scalar>::epsilon());
     const Vector from = camera_options.look_from;
     const Vector to = camera_options.look_to;
     int width_p = camera_options.screen_width;
-    int height_p = camera_options.screen_height;
     Vector z_v = from - to;
     z_v.Normalize();
     Vector up{0, 1, 0};
@@ -54,7 +58,7 @@ std::vector<Pixel> GetView(const CameraOptions& camera_options) {
     Vector y_v = CrossProduct(z_v, x_v);
     y_v.Normalize();
     for (int x = 0; x < width_p; ++x) {
-        for (int y = 0; y < height_p; ++y) {
+        for (int y = y0; y < y1; ++y) {
             Vector direction =
                 DirectionToPixel(Dx(camera_options, x), Dy(camera_options, y), -1, x_v, y_v, z_v);
             double distance = Length(direction);
@@ -65,3 +69,7 @@ std::vector<Pixel> GetView(const CameraOptions& camera_options) {
     }
     return result;
 }
+// The whole view, pixel (x, y) at index x * screen_height + y.
+std::vector<Pixel> GetView(const CameraOptions& camera_options) {
+    return GetView(camera_options, 0, camera_options.screen_height);
+}